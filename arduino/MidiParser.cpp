@@ -0,0 +1,149 @@
+// Serial MIDI -> USB MIDI parser
+
+#include <stdint.h>
+#include <stddef.h>	// for NULL
+#include "MidiParser.hpp"
+
+
+// status byte table entries: bits 0-3 = USB MIDI Code Index Number, bits 4-5 = message length, bits 6-7 = type
+#define ST_MSG		0x00	// channel/common message (the CIN 0x00 is used for Port Select)
+#define ST_REALTIME	0x40	// System Real Time message: can appear anywhere and doesn't change the state
+#define ST_SYSEX	0x80	// SysEx start
+#define ST_ENTRY(type, len, cin)	((type) | ((len) << 4) | (cin))
+
+static const uint8_t STATUS_TABLE[0x07 + 0x10] =
+{
+	// 80..E0: Note Off, Note On, Poly Aftertouch, Control Change, Program Change, Channel Aftertouch, Pitch Bend
+	ST_ENTRY(ST_MSG, 3, 0x8), ST_ENTRY(ST_MSG, 3, 0x9), ST_ENTRY(ST_MSG, 3, 0xA), ST_ENTRY(ST_MSG, 3, 0xB),
+	ST_ENTRY(ST_MSG, 2, 0xC), ST_ENTRY(ST_MSG, 2, 0xD), ST_ENTRY(ST_MSG, 3, 0xE),
+	// F0..F7: SysEx, MTC Quarter Frame, Song Position, Song Select, (undefined), Port Select, Tune Request, SysEx End
+	ST_ENTRY(ST_SYSEX, 1, 0x4), ST_ENTRY(ST_MSG, 2, 0x2), ST_ENTRY(ST_MSG, 3, 0x3), ST_ENTRY(ST_MSG, 2, 0x2),
+	ST_ENTRY(ST_MSG, 1, 0xF), ST_ENTRY(ST_MSG, 2, 0x0), ST_ENTRY(ST_MSG, 1, 0x5), ST_ENTRY(ST_MSG, 1, 0x5),
+	// F8..FF: System Real Time
+	ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF),
+	ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF), ST_ENTRY(ST_REALTIME, 1, 0xF),
+};
+
+static uint8_t EmitPacket(MidiParser* mp, uint8_t cin, uint8_t* pkt)
+{
+	pkt[0] = (mp->cable << 4) | cin;
+	pkt[1] = (mp->pos > 0) ? mp->data[0] : 0x00;
+	pkt[2] = (mp->pos > 1) ? mp->data[1] : 0x00;
+	pkt[3] = (mp->pos > 2) ? mp->data[2] : 0x00;
+	mp->pos = 0;
+	return 1;
+}
+
+void MidiParser_Init(MidiParser* mp)
+{
+	mp->runStatus = 0x00;
+	mp->cin = 0x00;
+	mp->remLen = 0;
+	mp->pos = 0;
+	mp->inSysEx = 0;
+	mp->port = 0x00;
+	mp->cable = 0;
+	mp->portMap = NULL;
+	mp->portMapLen = 0;
+	mp->errors = 0;
+	return;
+}
+
+static void SelectCable(MidiParser* mp)
+{
+	mp->cable = (mp->port < mp->portMapLen) ? (mp->portMap[mp->port] & 0x0F) : 0;
+	return;
+}
+
+void MidiParser_SetPortMap(MidiParser* mp, const uint8_t* portMap, uint8_t portMapLen)
+{
+	mp->portMap = portMap;
+	mp->portMapLen = (portMap != NULL) ? portMapLen : 0;
+	SelectCable(mp);
+	return;
+}
+
+uint8_t MidiParser_Feed(MidiParser* mp, uint8_t data, uint8_t* pkts)
+{
+	uint8_t entry;
+	uint8_t count;
+	
+	if (! (data & 0x80))
+	{
+		if (mp->inSysEx)
+		{
+			mp->data[mp->pos ++] = data;
+			return (mp->pos < 3) ? 0 : EmitPacket(mp, 0x04, pkts);	// SysEx start/continue
+		}
+		if (! mp->remLen)
+		{
+			if (! mp->runStatus)
+			{
+				// data byte without status - pass it on as single byte
+				mp->errors ++;
+				mp->data[0] = data;
+				mp->pos = 1;
+				return EmitPacket(mp, 0x0F, pkts);
+			}
+			// In USB MIDI, there is no "Running Status", so insert the status byte.
+			entry = STATUS_TABLE[(mp->runStatus >> 4) - 0x08];
+			mp->cin = entry & 0x0F;
+			mp->remLen = ((entry >> 4) & 0x03) - 1;
+			mp->data[0] = mp->runStatus;
+			mp->pos = 1;
+		}
+		mp->data[mp->pos ++] = data;
+		if (-- mp->remLen)
+			return 0;
+		if (mp->cin == 0x00)
+		{
+			mp->port = data;	// Port Select
+			SelectCable(mp);
+			mp->pos = 0;
+			return 0;
+		}
+		return EmitPacket(mp, mp->cin, pkts);
+	}
+	
+	entry = STATUS_TABLE[(data < 0xF0) ? ((data >> 4) - 0x08) : (0x07 + (data & 0x0F))];
+	if ((entry & 0xC0) == ST_REALTIME)
+	{
+		pkts[0] = (mp->cable << 4) | (entry & 0x0F);
+		pkts[1] = data;
+		pkts[2] = 0x00;
+		pkts[3] = 0x00;
+		return 1;
+	}
+	
+	count = 0;
+	if (mp->inSysEx)
+	{
+		mp->inSysEx = 0;
+		if (data == 0xF7)
+		{
+			mp->data[mp->pos ++] = data;
+			return EmitPacket(mp, 0x04 + mp->pos, pkts);	// SysEx end: CIN 5/6/7, depending on length
+		}
+		// SysEx aborted by another command - send the remaining bytes as SysEx end
+		mp->errors ++;
+		if (mp->pos)
+		{
+			count = EmitPacket(mp, 0x04 + mp->pos, pkts);
+			pkts += 4;
+		}
+	}
+	else if (mp->remLen || data == 0xF7)
+	{
+		mp->errors ++;	// incomplete message or SysEx End without SysEx
+	}
+	
+	mp->runStatus = (data < 0xF0) ? data : 0x00;
+	mp->inSysEx = ((entry & 0xC0) == ST_SYSEX);
+	mp->cin = entry & 0x0F;
+	mp->remLen = ((entry >> 4) & 0x03) - 1;
+	mp->data[0] = data;
+	mp->pos = 1;
+	if (! mp->remLen && ! mp->inSysEx)
+		count += EmitPacket(mp, mp->cin, pkts);	// single-byte message
+	return count;
+}
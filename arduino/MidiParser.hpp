@@ -0,0 +1,40 @@
+#ifndef MIDIPARSER_HPP
+#define MIDIPARSER_HPP
+
+#include <stdint.h>
+
+// Serial MIDI -> USB MIDI parser
+// Turns a serial MIDI byte stream into 4-byte USB MIDI event packets (header, 3 data bytes).
+// It handles running status, SysEx, System Real Time messages within other messages
+// and the port selection command "F5 nn".
+// It has no Arduino dependencies, so that the PC tools can use it as well.
+
+#define MIDIPARSER_MAX_PACKETS	2	// max. number of packets that a single byte can complete
+
+typedef struct
+{
+	uint8_t runStatus;	// running status (0x00 = none)
+	uint8_t cin;		// USB MIDI Code Index Number of the current message (0x00 = Port Select)
+	uint8_t remLen;		// number of bytes missing for the current message
+	uint8_t pos;		// number of bytes in "data"
+	uint8_t inSysEx;	// 1 = within a SysEx message
+	uint8_t port;		// parameter of the last Port Select command
+	uint8_t cable;		// USB MIDI cable number of the packets, selected by "port"
+	uint8_t data[3];	// bytes of the current message or SysEx chunk
+	const uint8_t* portMap;	// Port Select parameter -> cable number
+	uint8_t portMapLen;
+	uint8_t errors;		// number of interrupted messages and data bytes without status (wraps around)
+} MidiParser;
+
+void MidiParser_Init(MidiParser* mp);
+// Sets the table that maps the parameter of Port Select commands (F5 nn) to cable numbers.
+// portMap[nn] is the cable for "F5 nn", ports without an entry use cable 0.
+// Without a table, all packets are sent on cable 0.
+void MidiParser_SetPortMap(MidiParser* mp, const uint8_t* portMap, uint8_t portMapLen);
+// Processes one byte of serial MIDI data.
+// Completed packets are written to "pkts" (space for MIDIPARSER_MAX_PACKETS * 4 bytes).
+// Returns the number of completed packets.
+// Port Select commands don't generate packets, they change the cable number of the following ones.
+uint8_t MidiParser_Feed(MidiParser* mp, uint8_t data, uint8_t* pkts);
+
+#endif	// MIDIPARSER_HPP
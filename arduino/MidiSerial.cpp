@@ -0,0 +1,273 @@
+// Serial MIDI driver for USART1 with interrupt-driven CTS flow control
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "MidiSerial.hpp"
+#include "Trace.hpp"
+
+#if ! defined(__AVR_ATmega32U4__)
+#error "MidiSerial supports only the ATmega32U4. (Arduino Leonardo/Micro)"
+#endif
+
+#if (MIDISERIAL_RX_BUFFER_SIZE & (MIDISERIAL_RX_BUFFER_SIZE - 1)) || MIDISERIAL_RX_BUFFER_SIZE > 128
+#error "MIDISERIAL_RX_BUFFER_SIZE must be a power of 2 (max. 128)"
+#endif
+
+#define TX_MASK	(MIDISERIAL_TX_BUFFER_SIZE - 1)
+#define RT_MASK	(MIDISERIAL_RT_BUFFER_SIZE - 1)
+#define RX_MASK	(MIDISERIAL_RX_BUFFER_SIZE - 1)
+
+#define CTS_IS_HIGH()	bit_is_set(PIND, PD1)	// Arduino pin 2 = PD1 = INT1
+#define RTS_SET_HIGH()	(PORTD |= _BV(PD0))		// Arduino pin 3 = PD0
+#define RTS_SET_LOW()	(PORTD &= (uint8_t)~_BV(PD0))
+
+
+// The main program only writes the head of the TX buffer and the tail of the RX buffer,
+// the interrupts write the other index. Single-byte accesses are atomic on the AVR.
+static volatile uint8_t txBuffer[MIDISERIAL_TX_BUFFER_SIZE];
+static volatile uint8_t txHead = 0;
+static volatile uint8_t txTail = 0;
+static volatile uint8_t rtBuffer[MIDISERIAL_RT_BUFFER_SIZE];	// System Real Time bytes, sent first
+static volatile uint8_t rtHead = 0;
+static volatile uint8_t rtTail = 0;
+static volatile uint8_t rxBuffer[MIDISERIAL_RX_BUFFER_SIZE];
+static volatile uint8_t rxHead = 0;
+static volatile uint8_t rxTail = 0;
+static uint8_t ctsFlowCtrl = 0;
+static uint8_t rtsFlowCtrl = 0;
+static volatile uint8_t rtsHigh = 0;
+static volatile uint8_t ctsEvent = 0;
+static volatile uint32_t ctsHighStart = 0;	// time [us] when CTS went HIGH
+static volatile uint32_t ctsHighTime = 0;
+// receive errors, counted by the interrupt
+static volatile uint32_t rxOverruns = 0;
+static volatile uint32_t rxFrameErrors = 0;
+static volatile uint32_t rxDropped = 0;
+static volatile uint32_t rtsHighCount = 0;
+static MidiSerialStats serStats;	// all fields that the main program counts
+
+ISR(USART1_RX_vect)
+{
+	uint8_t status = UCSR1A;	// must be read before UDR1
+	uint8_t data = UDR1;
+	uint8_t next = (rxHead + 1) & RX_MASK;
+	
+	if (status & (_BV(FE1) | _BV(DOR1) | _BV(UPE1)))
+	{
+		TRACE(TRC_RX_ERROR, status & (_BV(FE1) | _BV(DOR1) | _BV(UPE1)));
+		if (status & _BV(DOR1))
+			rxOverruns ++;	// The byte after this one was lost. This one is fine.
+		if (status & (_BV(FE1) | _BV(UPE1)))
+		{
+			rxFrameErrors ++;
+			return;	// discard broken bytes
+		}
+	}
+	if (next == rxTail)
+	{
+		rxDropped ++;
+		TRACE(TRC_RX_OVERFLOW, data);
+		return;	// buffer full - drop the byte
+	}
+	rxBuffer[rxHead] = data;
+	rxHead = next;
+	if (rtsFlowCtrl && ! rtsHigh && ((next - rxTail) & RX_MASK) >= MIDISERIAL_RTS_HIGH)
+	{
+		RTS_SET_HIGH();	// ask the device to pause
+		rtsHigh = 1;
+		rtsHighCount ++;
+		TRACE(TRC_RTS_HIGH, 0);
+	}
+	return;
+}
+
+ISR(USART1_UDRE_vect)
+{
+	// The check is done when the previous byte starts being shifted out,
+	// so at most 2 bytes are in transmission when CTS goes HIGH.
+	if ((txHead == txTail && rtHead == rtTail) || (ctsFlowCtrl && CTS_IS_HIGH()))
+	{
+		// Nothing to send or the receiver is busy.
+		// Sending is resumed by MidiSerial_Write() or the CTS interrupt.
+		UCSR1B &= (uint8_t)~_BV(UDRIE1);
+		return;
+	}
+	if (rtHead != rtTail)
+	{
+		// System Real Time messages may be put between any two bytes.
+		UDR1 = rtBuffer[rtTail];
+		rtTail = (rtTail + 1) & RT_MASK;
+		return;
+	}
+	UDR1 = txBuffer[txTail];
+	txTail = (txTail + 1) & TX_MASK;
+	return;
+}
+
+ISR(INT1_vect)	// CTS pin change
+{
+	if (CTS_IS_HIGH())
+	{
+		ctsEvent = 1;
+		ctsHighStart = micros();
+		TRACE(TRC_CTS_HIGH, 0);
+		return;
+	}
+	ctsHighTime += micros() - ctsHighStart;
+	TRACE(TRC_CTS_LOW, 0);
+	if (txHead != txTail || rtHead != rtTail)
+		UCSR1B |= _BV(UDRIE1);	// receiver is ready again - resume sending
+	return;
+}
+
+void MidiSerial_Begin(unsigned long baud, uint8_t ctsFlow, uint8_t rtsFlow)
+{
+	uint16_t baudSetting = (F_CPU / 4 / baud - 1) / 2;	// U2X mode, like the Arduino core
+	
+	ctsFlowCtrl = ctsFlow;
+	rtsFlowCtrl = rtsFlow;
+	rtsHigh = 0;
+	RTS_SET_LOW();
+	txHead = txTail = 0;
+	rtHead = rtTail = 0;
+	rxHead = rxTail = 0;
+	ctsEvent = 0;
+	MidiSerial_ResetStats();
+	
+	UCSR1A = _BV(U2X1);
+	UBRR1H = baudSetting >> 8;
+	UBRR1L = (uint8_t)baudSetting;
+	UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);	// 8N1
+	UCSR1B = _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);
+	
+	// CTS: interrupt on any edge
+	EIMSK &= (uint8_t)~_BV(INT1);
+	EICRA = (EICRA & (uint8_t)~(_BV(ISC11) | _BV(ISC10))) | _BV(ISC10);
+	EIFR = _BV(INTF1);
+	EIMSK |= _BV(INT1);
+	return;
+}
+
+uint8_t MidiSerial_Available(void)
+{
+	uint8_t count = (rxHead - rxTail) & RX_MASK;
+	
+	if (count > serStats.rxHighWater)
+		serStats.rxHighWater = count;
+	return count;
+}
+
+uint8_t MidiSerial_Read(void)
+{
+	uint8_t data = rxBuffer[rxTail];
+	
+	rxTail = (rxTail + 1) & RX_MASK;
+	serStats.rxBytes ++;
+	// (rtsHigh is only set while the buffer is filled, so it can't change between the checks.)
+	if (rtsHigh && ((rxHead - rxTail) & RX_MASK) <= MIDISERIAL_RTS_LOW)
+	{
+		rtsHigh = 0;
+		RTS_SET_LOW();
+		TRACE(TRC_RTS_LOW, 0);
+	}
+	return data;
+}
+
+uint8_t MidiSerial_WriteSpace(void)
+{
+	return (txTail - txHead - 1) & TX_MASK;
+}
+
+uint8_t MidiSerial_Write(const uint8_t* data, uint8_t len)
+{
+	uint8_t head = txHead;
+	uint8_t pos;
+	uint8_t fill;
+	
+	if (len > MidiSerial_WriteSpace())
+		return 0xFF;
+	
+	for (pos = 0; pos < len; pos ++)
+	{
+		txBuffer[head] = data[pos];
+		head = (head + 1) & TX_MASK;
+	}
+	txHead = head;
+	serStats.txBytes += len;
+	fill = (head - txTail) & TX_MASK;
+	if (fill > serStats.txHighWater)
+		serStats.txHighWater = fill;
+	
+	// When CTS is HIGH, the CTS interrupt will start sending.
+	// (The interrupt checks CTS again, so a change right after the check is no problem.)
+	if (! ctsFlowCtrl || ! CTS_IS_HIGH())
+		UCSR1B |= _BV(UDRIE1);
+	return 0x00;
+}
+
+uint8_t MidiSerial_RealtimeSpace(void)
+{
+	return (rtTail - rtHead - 1) & RT_MASK;
+}
+
+uint8_t MidiSerial_WriteRealtime(uint8_t data)
+{
+	if (! MidiSerial_RealtimeSpace())
+		return 0xFF;
+	
+	rtBuffer[rtHead] = data;
+	rtHead = (rtHead + 1) & RT_MASK;
+	serStats.txBytes ++;
+	if (! ctsFlowCtrl || ! CTS_IS_HIGH())
+		UCSR1B |= _BV(UDRIE1);
+	return 0x00;
+}
+
+uint8_t MidiSerial_CtsEvent(void)
+{
+	uint8_t evt = ctsEvent;
+	
+	if (evt)
+		ctsEvent = 0;
+	return evt;
+}
+
+uint8_t MidiSerial_GetCts(void)
+{
+	return CTS_IS_HIGH() ? 0x01 : 0x00;
+}
+
+void MidiSerial_GetStats(MidiSerialStats* stats)
+{
+	uint8_t oldSREG = SREG;
+	
+	*stats = serStats;
+	cli();	// the interrupts write the 32-bit values
+	stats->ctsHighTime = ctsHighTime;
+	stats->rxOverruns = rxOverruns;
+	stats->rxFrameErrors = rxFrameErrors;
+	stats->rxDropped = rxDropped;
+	stats->rtsHighCount = rtsHighCount;
+	if (CTS_IS_HIGH())
+		stats->ctsHighTime += micros() - ctsHighStart;	// include the current stall
+	SREG = oldSREG;
+	return;
+}
+
+void MidiSerial_ResetStats(void)
+{
+	uint8_t oldSREG = SREG;
+	
+	memset(&serStats, 0x00, sizeof(MidiSerialStats));
+	cli();
+	ctsHighTime = 0;
+	ctsHighStart = micros();
+	rxOverruns = 0;
+	rxFrameErrors = 0;
+	rxDropped = 0;
+	rtsHighCount = 0;
+	SREG = oldSREG;
+	return;
+}
@@ -0,0 +1,58 @@
+#ifndef MIDISERIAL_HPP
+#define MIDISERIAL_HPP
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Interrupt-driven driver for the serial MIDI port on USART1 (pin 0 = RX, pin 1 = TX).
+// It replaces Serial1, because it needs its own USART interrupt handlers.
+//
+// Sent data is buffered and transmitted by the "data register empty" interrupt.
+// With CTS flow control, transmission pauses while CTS (pin 2 = INT1) is HIGH
+// and is resumed by the pin change interrupt, so writing never blocks.
+// With RTS flow control, RTS (pin 3) is set HIGH by the receive interrupt when the receive buffer
+// fills up to MIDISERIAL_RTS_HIGH bytes, which asks the device to pause.
+// It is set LOW again when the main program has read it down to MIDISERIAL_RTS_LOW bytes.
+//
+// System Real Time messages (F8..FF) can be sent with priority. They have their own small buffer,
+// which the interrupt sends before the normal data, so they overtake everything that is still waiting.
+
+#define MIDISERIAL_TX_BUFFER_SIZE	64	// must be a power of 2
+#define MIDISERIAL_RT_BUFFER_SIZE	8	// priority buffer for System Real Time messages, must be a power of 2
+// The receive buffer is filled by the interrupt and covers (size - 1) * 0.26 ms in which loop() doesn't read.
+#ifndef MIDISERIAL_RX_BUFFER_SIZE
+#define MIDISERIAL_RX_BUFFER_SIZE	128	// must be a power of 2 (max. 128)
+#endif
+#define MIDISERIAL_RTS_HIGH	(MIDISERIAL_RX_BUFFER_SIZE * 3 / 4)
+#define MIDISERIAL_RTS_LOW	(MIDISERIAL_RX_BUFFER_SIZE / 4)
+
+typedef struct
+{
+	uint32_t rxBytes;		// bytes read by the main program
+	uint32_t txBytes;		// bytes written by the main program
+	uint32_t ctsHighTime;	// time [us] that CTS was HIGH (wraps around after 71 minutes)
+	uint32_t rxOverruns;	// the hardware lost bytes, because the interrupt was blocked for too long
+	uint32_t rxFrameErrors;	// bytes with framing error (dropped)
+	uint32_t rxDropped;		// bytes dropped, because the receive buffer was full
+	uint32_t rtsHighCount;	// number of times RTS was set HIGH
+	uint8_t rxHighWater;	// max. number of bytes in the receive buffer
+	uint8_t txHighWater;	// max. number of bytes in the send buffer
+} MidiSerialStats;
+
+void MidiSerial_Begin(unsigned long baud, uint8_t ctsFlowCtrl, uint8_t rtsFlowCtrl);
+uint8_t MidiSerial_Available(void);	// number of received bytes
+uint8_t MidiSerial_Read(void);	// only valid when MidiSerial_Available() > 0
+uint8_t MidiSerial_WriteSpace(void);	// number of bytes that can be written without overflowing the buffer
+// Buffers the data for sending. Returns 0x00 on success or 0xFF (nothing written) when there is not enough space.
+uint8_t MidiSerial_Write(const uint8_t* data, uint8_t len);
+uint8_t MidiSerial_RealtimeSpace(void);	// number of System Real Time bytes that can be written
+// Buffers a System Real Time byte, which is sent before all bytes from MidiSerial_Write that weren't sent yet.
+// Returns 0x00 on success or 0xFF when the buffer is full.
+uint8_t MidiSerial_WriteRealtime(uint8_t data);
+// Returns 0x01 if CTS went HIGH since the last call, else 0x00. (for the "CTS active" LED)
+uint8_t MidiSerial_CtsEvent(void);
+uint8_t MidiSerial_GetCts(void);	// current CTS state (0 = LOW = ready, 1 = HIGH = busy)
+void MidiSerial_GetStats(MidiSerialStats* stats);
+void MidiSerial_ResetStats(void);
+
+#endif	// MIDISERIAL_HPP
@@ -0,0 +1,78 @@
+// Binary event trace
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "Trace.hpp"
+
+#if TRACE_ENABLE
+
+#define TRACE_MASK	(TRACE_BUFFER_SIZE - 1)
+#define TRACE_EVT_SIZE	6
+
+typedef struct
+{
+	uint32_t time;
+	uint8_t evt;
+	uint8_t param;
+} TraceEvent;
+
+
+static TraceEvent trcBuffer[TRACE_BUFFER_SIZE];
+static uint8_t trcHead = 0;
+static uint8_t trcCount = 0;
+static uint8_t trcLost = 0;
+
+void Trace_Add(uint8_t evt, uint8_t param)
+{
+	uint32_t time = micros();
+	uint8_t oldSREG = SREG;
+	TraceEvent* te;
+	
+	cli();	// the main program and interrupts may add events
+	te = &trcBuffer[trcHead];
+	te->time = time;
+	te->evt = evt;
+	te->param = param;
+	trcHead = (trcHead + 1) & TRACE_MASK;
+	if (trcCount < TRACE_BUFFER_SIZE)
+		trcCount ++;
+	else if (trcLost < 0xFF)
+		trcLost ++;	// the oldest event was overwritten
+	SREG = oldSREG;
+	return;
+}
+
+void Trace_Dump(Print& out)
+{
+	uint8_t data[5 + TRACE_BUFFER_SIZE * TRACE_EVT_SIZE];
+	uint8_t* dPtr;
+	uint8_t oldSREG = SREG;
+	uint8_t pos;
+	uint8_t curEvt;
+	
+	cli();
+	data[0] = 'T';	data[1] = 'R';	data[2] = 'C';
+	data[3] = trcCount;
+	data[4] = trcLost;
+	dPtr = &data[5];
+	pos = (trcHead - trcCount) & TRACE_MASK;
+	for (curEvt = 0; curEvt < trcCount; curEvt ++, pos = (pos + 1) & TRACE_MASK)
+	{
+		const TraceEvent* te = &trcBuffer[pos];
+		dPtr[0] = (uint8_t)(te->time >>  0);
+		dPtr[1] = (uint8_t)(te->time >>  8);
+		dPtr[2] = (uint8_t)(te->time >> 16);
+		dPtr[3] = (uint8_t)(te->time >> 24);
+		dPtr[4] = te->evt;
+		dPtr[5] = te->param;
+		dPtr += TRACE_EVT_SIZE;
+	}
+	trcCount = 0;
+	trcLost = 0;
+	SREG = oldSREG;
+	
+	out.write(data, dPtr - data);	// one transfer, so that the dump isn't interleaved with other output
+	return;
+}
+
+#endif	// TRACE_ENABLE
@@ -0,0 +1,39 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Binary event trace for debugging the bridge.
+// Events are stored with a timestamp in a small ring buffer. Sending 'T' over the
+// USB serial port (CDC) dumps the buffer and clears it.
+// It is compiled in only with TRACE_ENABLE = 1. Else TRACE() does nothing.
+//
+// Dump format: "TRC", number of events (1 byte), number of overwritten events (1 byte, max. 255),
+// then for each event (oldest first): time [us] (4 bytes, Little Endian), event type, parameter.
+
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE	0
+#endif
+#define TRACE_BUFFER_SIZE	32	// number of events, must be a power of 2
+
+// event types
+#define TRC_SERIAL_PORT		0x01	// Port Select received from the device, param = port
+#define TRC_USB_PORT		0x02	// Port Select sent to the device, param = port (0-based)
+#define TRC_CTS_HIGH		0x03	// device raised CTS - sending is paused
+#define TRC_CTS_LOW			0x04	// device released CTS
+#define TRC_RX_OVERFLOW		0x05	// serial receive buffer full, param = dropped byte
+#define TRC_PARSER_RESYNC	0x06	// incomplete message or data without status, param = byte that caused it
+#define TRC_RX_ERROR		0x07	// serial receive error, param = error flags of UCSR1A (FE1, DOR1, UPE1)
+#define TRC_RTS_HIGH		0x08	// receive buffer is getting full - asking the device to pause
+#define TRC_RTS_LOW			0x09	// device may send again
+
+#if TRACE_ENABLE
+void Trace_Add(uint8_t evt, uint8_t param);	// can be called from interrupts
+void Trace_Dump(Print& out);
+#define TRACE(evt, param)	Trace_Add(evt, param)
+#else
+#define TRACE(evt, param)	do {} while(0)
+#endif
+
+#endif	// TRACE_HPP
@@ -29,11 +29,13 @@ typedef struct
 
 #include <PluggableUSB.h>
 #define EPTYPE_DESCRIPTOR_SIZE		uint8_t
+#define MIDI_EP_SIZE				USB_EP_SIZE
 
 #elif defined(ARDUINO_ARCH_SAM)
 
 #include <USB/PluggableUSB.h>
 #define EPTYPE_DESCRIPTOR_SIZE		uint32_t
+#define MIDI_EP_SIZE				EPX_SIZE
 
 #elif defined(ARDUINO_ARCH_SAMD)
 
@@ -44,6 +46,7 @@ typedef struct
 #include <USB/PluggableUSB.h>
 #define EPTYPE_DESCRIPTOR_SIZE		uint32_t
 #endif
+#define MIDI_EP_SIZE				EPX_SIZE
 
 #else
 
@@ -51,34 +54,209 @@ typedef struct
 
 #endif
 
+#include "USBMultiMIDIDesc.hpp"
 
-class USBMultiMIDI : public PluggableUSBModule
+// Packets for the host are collected and sent together in one USB transaction.
+// (15 packets = 60 bytes, because the AVR core sends a zero-length packet after a full 64-byte bank.)
+#define MIDI_TX_BATCH_SIZE	60
+#define MIDI_TX_FLUSH_DELAY	500	// max. time [us] that a packet is held back for batching
+// number of received packets that can be buffered, must be a power of 2 (max. 128)
+// (independent of the endpoint size - larger buffers let the host send more data before it has to wait)
+// 128 packets = 512 bytes. This uses the RAM that building the descriptors at runtime needed.
+#ifndef MIDI_RX_BUFFER_SIZE
+#define MIDI_RX_BUFFER_SIZE	128
+#endif
+
+typedef struct
+{
+	uint32_t rxPackets;		// packets received from the host
+	uint32_t txPackets;		// packets sent to the host
+	uint32_t rxDropped;		// incomplete packets that accept() dropped
+	uint32_t txDropped;		// packets that were discarded, because the host didn't listen or sending failed
+	uint8_t rxHighWater;	// max. number of packets in the receive buffer
+} USBMidiStats;
+
+// Single-producer/single-consumer ring buffer for USB MIDI packets.
+// The 8-bit indices run freely and are masked on access, so that all SIZE slots can be used.
+// Each index is written by one side only, after the packets were written/read.
+template<uint8_t SIZE> class MidiPacketRing
+{
+	static_assert(SIZE > 0 && SIZE <= 128 && (SIZE & (SIZE - 1)) == 0, "ring buffer size must be a power of 2 (max. 128)");
+public:
+	MidiPacketRing(void);
+	uint8_t count(void) const;
+	uint8_t space(void) const;
+	// producer: returns the first free slot and the number of free slots up to the end of the buffer
+	midiEventPacket_t* writePtr(uint8_t* contig);
+	void commit(uint8_t count);	// producer: make "count" written packets visible to the consumer
+	uint8_t read(midiEventPacket_t* events, uint8_t count);	// consumer: returns the number of packets copied
+	// consumer: access to the packets that weren't read yet, "index" is a free-running index from readPos() to writePos()
+	uint8_t readPos(void) const;
+	uint8_t writePos(void) const;
+	midiEventPacket_t* at(uint8_t index);
+private:
+	midiEventPacket_t _data[SIZE];
+	volatile uint8_t _head;
+	volatile uint8_t _tail;
+};
+
+typedef struct
+{
+	uint16_t offset;	// position in the descriptor set
+	uint8_t value;
+} MIDIDescPatch;
+
+// everything that doesn't depend on the number of ports
+class USBMultiMIDIBase : public PluggableUSBModule
 {
 public:
-	USBMultiMIDI(uint8_t portsRX, uint8_t portsTX);
 	uint32_t available(void);
-	midiEventPacket_t read(void);
-	void flush(void);
+	midiEventPacket_t read(void);	// returns a packet with header 0 when there is no data
+	// Copies up to "count" received packets to "events" and returns the number of packets.
+	uint8_t readBatch(midiEventPacket_t* events, uint8_t count);
+	// Takes up to "count" System Real Time packets (CIN 0xF, F8..FF) out of the received packets, ahead of the other ones.
+	// Their places in the buffer are left as empty packets (header 0x00), which the readers have to skip.
+	// Once this was called, read() and readBatch() only return packets that readRealtime() has already checked,
+	// so that a System Real Time message can't be overtaken by another one.
+	uint8_t readRealtime(midiEventPacket_t* events, uint8_t count);
+	void flush(void);	// send all buffered packets now
+	// Call regularly. Fetches received packets from the endpoint and
+	// sends buffered packets once MIDI_TX_FLUSH_DELAY has passed.
+	void update(void);
+	// Returns the number of packets that sendMIDI can buffer without waiting for the host.
+	uint8_t txSpace(void);
 	void sendMIDI(midiEventPacket_t event);
+	void sendMIDI(const midiEventPacket_t* events, uint8_t count);
 	size_t write(const uint8_t *buffer, size_t size);
+	const USBMidiStats& getStats(void) const;
+	void resetStats(void);
 protected:
-	int getInterface(uint8_t* interfaceNum);
+	USBMultiMIDIBase(void);
+	// Sends a descriptor set from flash, with single bytes replaced. (The patches must be sorted by offset.)
+	int sendDescriptor(const uint8_t* desc, uint16_t len, const MIDIDescPatch* patches, uint8_t patchCount);
 	int getDescriptor(USBSetup& setup);
 	bool setup(USBSetup& setup);
 	uint8_t getShortName(char* name);
 private:
 	void accept(void);
+	uint8_t sendTxBuffer(uint8_t wait);
 	
 	EPTYPE_DESCRIPTOR_SIZE _epTypes[2];	// OUT and IN
 	uint8_t _epMidiRX;
 	uint8_t _epMidiTX;
-	uint8_t _jCntRX;
-	uint8_t _jCntTX;
-	uint8_t _jidRX[0x10];
-	uint8_t _jidTX[0x10];
 	
-	uint8_t _portsRX;
-	uint8_t _portsTX;
+	MidiPacketRing<MIDI_RX_BUFFER_SIZE> _rxRing;
+	uint8_t _rtScanPos;	// ring index of the first received packet that readRealtime didn't check yet
+	uint8_t _rtScanUsed;	// readRealtime was called, so readBatch must not read past _rtScanPos
+	uint8_t _txBuf[MIDI_TX_BATCH_SIZE];
+	uint8_t _txLen;
+	unsigned long _txStartTime;	// time [us] when the first buffered packet was added
+	USBMidiStats _stats;
 };
 
+// USB MIDI device with PORTS_RX MIDI Out ports (host -> device) and PORTS_TX MIDI In ports (device -> host).
+// The port numbers are template parameters, so that the descriptors are built by the compiler and stay in flash.
+template<uint8_t PORTS_RX, uint8_t PORTS_TX> class USBMultiMIDI : public USBMultiMIDIBase
+{
+public:
+	USBMultiMIDI(void);
+protected:
+	int getInterface(uint8_t* interfaceNum);
+private:
+	typedef USBMultiMIDIDescriptor<PORTS_RX, PORTS_TX> Descriptor;
+	// 8 [IADDescriptor] + 9+9 [AudioControl Intf] + 9+7 [MIDIStreaming Intf] +
+	// nRX * 6 [MIDIJackInDescriptor] + nTX * (6+2+1) [MIDIJackOutDescriptor] + 2 * 9 [MIDI_StdEPDescriptor] + (4+nRX) + (4+nTX) [MIDI_CsEPDescriptor]
+	// (With 16 MIDI in + out jacks each, this is 340 bytes.)
+	static_assert(sizeof(Descriptor) == 68 + 7 * PORTS_RX + 10 * PORTS_TX, "USB MIDI descriptors must be packed");
+	static const Descriptor _descriptor;	// in flash
+};
+
+
+// keeps the compiler from moving memory accesses across the index updates
+#define MIDI_RING_BARRIER()	__asm__ __volatile__("" ::: "memory")
+
+template<uint8_t SIZE> MidiPacketRing<SIZE>::MidiPacketRing(void) : _head(0), _tail(0)
+{
+}
+
+template<uint8_t SIZE> uint8_t MidiPacketRing<SIZE>::count(void) const
+{
+	return (uint8_t)(_head - _tail);
+}
+
+template<uint8_t SIZE> uint8_t MidiPacketRing<SIZE>::space(void) const
+{
+	return (uint8_t)(SIZE - count());
+}
+
+template<uint8_t SIZE> midiEventPacket_t* MidiPacketRing<SIZE>::writePtr(uint8_t* contig)
+{
+	uint8_t pos = _head & (SIZE - 1);
+	uint8_t free = space();
+	
+	*contig = (pos + free > SIZE) ? (SIZE - pos) : free;
+	return &_data[pos];
+}
+
+template<uint8_t SIZE> void MidiPacketRing<SIZE>::commit(uint8_t count)
+{
+	MIDI_RING_BARRIER();	// the packets must be stored before they are published
+	_head = (uint8_t)(_head + count);
+}
+
+template<uint8_t SIZE> uint8_t MidiPacketRing<SIZE>::readPos(void) const
+{
+	return _tail;
+}
+
+template<uint8_t SIZE> uint8_t MidiPacketRing<SIZE>::writePos(void) const
+{
+	return _head;
+}
+
+template<uint8_t SIZE> midiEventPacket_t* MidiPacketRing<SIZE>::at(uint8_t index)
+{
+	return &_data[index & (SIZE - 1)];
+}
+
+template<uint8_t SIZE> uint8_t MidiPacketRing<SIZE>::read(midiEventPacket_t* events, uint8_t count)
+{
+	uint8_t head = _head;
+	uint8_t tail = _tail;
+	uint8_t done;
+	
+	MIDI_RING_BARRIER();	// read the head before the packets
+	for (done = 0; done < count && tail != head; done ++, tail ++)
+		events[done] = _data[tail & (SIZE - 1)];
+	MIDI_RING_BARRIER();	// the packets must be copied before their slots are released
+	_tail = tail;
+	return done;
+}
+
+template<uint8_t PORTS_RX, uint8_t PORTS_TX> const USBMultiMIDIDescriptor<PORTS_RX, PORTS_TX>
+	USBMultiMIDI<PORTS_RX, PORTS_TX>::_descriptor PROGMEM;
+
+template<uint8_t PORTS_RX, uint8_t PORTS_TX> USBMultiMIDI<PORTS_RX, PORTS_TX>::USBMultiMIDI(void)
+{
+}
+
+template<uint8_t PORTS_RX, uint8_t PORTS_TX> int USBMultiMIDI<PORTS_RX, PORTS_TX>::getInterface(uint8_t* interfaceNum)
+{
+	// "pluggedInterface" and "pluggedEndpoint" are inherited from PluggableUSBModule
+	uint8_t midiAcIntfID = pluggedInterface + 0;
+	uint8_t midiStrmIntfID = pluggedInterface + 1;
+	const MIDIDescPatch patches[] =
+	{
+		{offsetof(Descriptor, iad.firstInterface), midiAcIntfID},
+		{offsetof(Descriptor, acIntf.number), midiAcIntfID},
+		{offsetof(Descriptor, acIDesc.baInterfaceNr), midiStrmIntfID},
+		{offsetof(Descriptor, msIntf.number), midiStrmIntfID},
+		{offsetof(Descriptor, epRX.len.addr), USB_ENDPOINT_OUT(pluggedEndpoint + 0)},
+		{offsetof(Descriptor, epTX.len.addr), USB_ENDPOINT_IN(pluggedEndpoint + 1)},
+	};
+	
+	(*interfaceNum) += 2;	// We use 2 interfaces: AudioControl and MIDIStream
+	return sendDescriptor((const uint8_t*)&_descriptor, sizeof(Descriptor), patches, sizeof(patches) / sizeof(patches[0]));
+}
+
 #endif	// USBMULTIMIDI_HPP
@@ -0,0 +1,219 @@
+#ifndef USBMULTIMIDIDESC_HPP
+#define USBMULTIMIDIDESC_HPP
+
+// USB MIDI descriptors for USBMultiMIDI
+// The whole descriptor set is a constant that the compiler builds for a fixed number of ports,
+// so that it can be stored in flash. Only the interface and endpoint numbers are assigned at runtime.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// --- USB MIDI structures ---
+
+#pragma pack(push, 1)
+typedef struct	// MIDI Adapter Class-specific AC (Audio Control) Interface Descriptor
+{
+	uint8_t bLength;			// Size of this descriptor, in bytes.
+	uint8_t bDescriptorType;	// CS_INTERFACE.
+	uint8_t bDescriptorSubtype;	// HEADER subtype.
+	uint16_t bcdADC;			// Revision of class specification - 1.0
+	uint16_t wTotalLength;		// Total size of class specific descriptors.
+	uint8_t bInCollection;		// Number of streaming interfaces.
+	uint8_t baInterfaceNr;		// MIDIStreaming interface 1 belongs to this AudioControl interface.
+} MIDI_ACInterfaceDescriptor;
+
+typedef struct	// Class-Specific MS (MIDIStreaming) Interface Header Descriptor (USB MIDI Spec. 1.0: Table 6-2)
+{
+	uint8_t bLength;			// Size of this descriptor, in bytes: 7.
+	uint8_t bDescriptorType;	// CS_INTERFACE descriptor type.
+	uint8_t bDescriptorSubtype;	// MS_HEADER descriptor subtype.
+	uint16_t bcdMSC;			// MIDIStreaming SubClass Spec. Release Number in BCD: 01.00.
+	uint16_t wTotalLength;		// Total size for the class-specific MIDIStreaming interface descriptor. Includes the combined length of this descriptor header and all Jack and Element descriptors.
+} MIDI_MSInterfaceDescriptor;
+
+typedef struct	// MIDI IN Jack Descriptor (USB MIDI Spec. 1.0: Table 6-3)
+{
+	uint8_t bLength;			// Size of this descriptor, in bytes: 6
+	uint8_t bDescriptorType;	// CS_INTERFACE descriptor type.
+	uint8_t bDescriptorSubtype;	// MIDI_IN_JACK descriptor subtype.
+	uint8_t bJackType;			// EMBEDDED or EXTERNAL
+	uint8_t bJackID;			// Constant uniquely identifying the MIDI IN Jack within the USB-MIDI function.
+	uint8_t iJack;				// Index of a string descriptor, describing the MIDI IN Jack
+} MIDIJackInDescriptor;
+
+typedef struct	// MIDI OUT Jack Descriptor (USB MIDI Spec. 1.0: Table 6-4)
+{
+	uint8_t bLength;			// Size of this descriptor, in bytes: 6+2*p
+	uint8_t bDescriptorType;	// CS_INTERFACE descriptor type.
+	uint8_t bDescriptorSubtype;	// MIDI_OUT_JACK descriptor subtype.
+	uint8_t bJackType;			// EMBEDDED or EXTERNAL
+	uint8_t bJackID;			// Constant uniquely identifying the MIDI OUT Jack within the USB-MIDI function.
+	uint8_t bNrInputPins;		// Number of Input Pins of this MIDI OUT Jack: p
+	uint8_t baSourceID[1];		// ID of the Entity to which the last Input Pin of this MIDI OUT Jack is connected.
+	uint8_t baSourcePin[1];		// Output Pin number of the Entity to which the last Input Pin of this MIDI OUT Jack is connected.
+	uint8_t iJack;				// Index of a string descriptor, describing the MIDI OUT Jack.
+} MIDIJackOutDescriptor;
+
+typedef struct	// Standard MS Bulk Data Endpoint Descriptor [for MIDI Jacks] (USB MIDI Spec. 1.0: Table 6-6)
+{
+	EndpointDescriptor len;	// see USBCore.h
+	uint8_t refresh;		// Reset to 0.
+	uint8_t sync;			// The address of the endpoint used to communicate synchronization information if required by this endpoint. Reset to zero.
+} MIDI_StdEPDescriptor;
+
+
+
+// --- USB MIDI constants ---
+#define USB_IC_AUDIO							0x01	// bInterfaceClass: AUDIO
+#define USB_ISC_AUDIO_CONTROL					0x01	// bInterfaceSubclass: AUDIO_CONTROL
+#define AC_IDS_HEADER							0x01	// bDescriptorSubtype: HEADER
+
+#define USB_ICS_MIDISTREAMING					0x03	// bInterfaceSubclass: MIDISTREAMING
+#define MS_CS_INTERFACE							0x24	// bDescriptorType: CS_INTERFACE
+#define MS_CS_ENDPOINT							0x25	// bDescriptorType: CS_ENDPOINT
+
+// MS Class-Specific Interface Descriptor Subtype (USB MIDI Spec. 1.0: A.1)
+#define MS_IDS_UNDEFINED						0x00	// MS_DESCRIPTOR_UNDEFINED
+#define MS_IDS_HEADER							0x01	// MS_HEADER
+#define MS_IDS_IN_JACK							0x02	// MIDI_IN_JACK
+#define MS_IDS_OUT_JACK							0x03	// MIDI_OUT_JACK
+#define MS_IDS_ELEMENT							0x04	// ELEMENT
+// MS Class-Specific Endpoint Descriptor Subtypes (USB MIDI Spec. 1.0: A.2)
+#define MS_EDS_UNDEFINED						0x00	// DESCRIPTOR_UNDEFINED
+#define MS_EDS_GENERAL							0x01	// MS_GENERAL
+// MS MIDI IN and OUT Jack types (USB MIDI Spec. 1.0: A.3)
+#define MS_JT_UNDEFINED							0x00	// JACK_TYPE_UNDEFINED
+#define MS_JT_EMBEDDED							0x01	// EMBEDDED
+#define MS_JT_EXTERNAL							0x02	// EXTERNAL
+
+
+// --- helper macros for filling in USB structures ---
+#define D_AC_INTERFACE(numIntfs, msIntf) \
+	{ 0x09, MS_CS_INTERFACE, AC_IDS_HEADER, 0x0100, 0x0009, numIntfs, msIntf }
+#define D_MS_INTERFACE(totalLen) \
+	{ 0x07, MS_CS_INTERFACE, MS_IDS_HEADER, 0x0100, totalLen }
+#define D_MIDI_INJACK(jackProp, jackID) \
+	{ 0x06, MS_CS_INTERFACE, MS_IDS_IN_JACK, jackProp, jackID, 0 }
+#define D_MIDI_OUTJACK(jackProp, jackID) \
+	{ 0x09, MS_CS_INTERFACE, MS_IDS_OUT_JACK, jackProp, jackID, 1, 1, 1, 0 }
+#define D_MIDI_JACK_EP(addr, attr, packetSize) \
+	{ 0x09, 5, addr, attr, packetSize, 0, 0, 0 }
+
+
+// --- descriptor set for a fixed number of ports ---
+// The lists are built recursively, one element per template level. The list for 1 element ends the recursion.
+
+template<uint8_t N, uint8_t FIRST_ID> struct MIDIJackIDList	// Jack IDs FIRST_ID .. FIRST_ID+N-1
+{
+	uint8_t jackID;
+	MIDIJackIDList<N - 1, FIRST_ID + 1> next;
+	
+	constexpr MIDIJackIDList(void) : jackID(FIRST_ID), next() {}
+};
+template<uint8_t FIRST_ID> struct MIDIJackIDList<1, FIRST_ID>
+{
+	uint8_t jackID;
+	
+	constexpr MIDIJackIDList(void) : jackID(FIRST_ID) {}
+};
+
+template<uint8_t N, uint8_t FIRST_ID> struct MIDIJackInList	// Embedded MIDI IN Jacks with IDs FIRST_ID .. FIRST_ID+N-1
+{
+	MIDIJackInDescriptor jack;
+	MIDIJackInList<N - 1, FIRST_ID + 1> next;
+	
+	//                              D_MIDI_INJACK(   jackType,    jackID)
+	constexpr MIDIJackInList(void) : jack D_MIDI_INJACK(MS_JT_EMBEDDED, FIRST_ID), next() {}	// see Table B-7
+};
+template<uint8_t FIRST_ID> struct MIDIJackInList<1, FIRST_ID>
+{
+	MIDIJackInDescriptor jack;
+	
+	constexpr MIDIJackInList(void) : jack D_MIDI_INJACK(MS_JT_EMBEDDED, FIRST_ID) {}
+};
+
+template<uint8_t N, uint8_t FIRST_ID> struct MIDIJackOutList	// Embedded MIDI OUT Jacks with IDs FIRST_ID .. FIRST_ID+N-1
+{
+	MIDIJackOutDescriptor jack;
+	MIDIJackOutList<N - 1, FIRST_ID + 1> next;
+	
+	//                               D_MIDI_OUTJACK(  jackType,     jackID)
+	constexpr MIDIJackOutList(void) : jack D_MIDI_OUTJACK(MS_JT_EMBEDDED, FIRST_ID), next() {}	// see Table B-9
+};
+template<uint8_t FIRST_ID> struct MIDIJackOutList<1, FIRST_ID>
+{
+	MIDIJackOutDescriptor jack;
+	
+	constexpr MIDIJackOutList(void) : jack D_MIDI_OUTJACK(MS_JT_EMBEDDED, FIRST_ID) {}
+};
+
+template<uint8_t N, uint8_t FIRST_ID> struct MIDI_CsEPDescriptor	// Class-specific MS Bulk Data Endpoint Descriptor [for MIDI Jacks] (USB MIDI Spec. 1.0: Table 6-7)
+{
+	uint8_t bLength;			// Size of this descriptor, in bytes: 4+n
+	uint8_t bDescriptorType;	// CS_ENDPOINT
+	uint8_t bDescriptorSubType;	// MS_GENERAL
+	uint8_t bNumEmbMIDIJack;	// Number of Embedded MIDI Jacks: n.
+	MIDIJackIDList<N, FIRST_ID> baAssocJackIDs;	// IDs of the first..last Embedded Jack that is associated with this endpoint.
+	
+	constexpr MIDI_CsEPDescriptor(void)
+		: bLength(4 + N), bDescriptorType(MS_CS_ENDPOINT), bDescriptorSubType(MS_EDS_GENERAL), bNumEmbMIDIJack(N)
+		, baAssocJackIDs()
+	{}
+};
+
+// Complete descriptor set of the USB MIDI function with PORTS_RX MIDI Out ports (host -> MIDI interface)
+// and PORTS_TX MIDI In ports (MIDI interface -> host).
+// Interface numbers and endpoint addresses are 0 and have to be replaced when sending it.
+template<uint8_t PORTS_RX, uint8_t PORTS_TX> struct USBMultiMIDIDescriptor
+{
+	static_assert(PORTS_RX >= 1 && PORTS_RX <= 16 && PORTS_TX >= 1 && PORTS_TX <= 16, "USB MIDI supports 1..16 ports per direction");
+	
+	IADDescriptor iad;
+	// --- AudioControl Interface ---
+	InterfaceDescriptor acIntf;
+	MIDI_ACInterfaceDescriptor acIDesc;
+	// --- MIDIStreaming Interface ---
+	InterfaceDescriptor msIntf;
+	MIDI_MSInterfaceDescriptor msIDesc;
+	// Embedded MIDI Jack = associated with USB MIDI endpoint (up to 16 embedded jacks per endpoint)
+	// External MIDI Jack = physical MIDI connections built into the "USB-MIDI function" -> not used for now
+	// Note: bJackID value 0 is reserved, IDs begin with 1
+	MIDIJackInList<PORTS_RX, 1> jacksRX;	// MIDI In Jacks for Host Output Endpoint (host -> MIDI interface)
+	MIDIJackOutList<PORTS_TX, 1 + PORTS_RX> jacksTX;	// MIDI Out Jacks for Host Input Endpoint (MIDI interface -> host)
+	// MIDI Out Endpoint (host -> MIDI interface)
+	MIDI_StdEPDescriptor epRX;
+	MIDI_CsEPDescriptor<PORTS_RX, 1> csEpRX;
+	// MIDI In Endpoint (MIDI interface -> host)
+	MIDI_StdEPDescriptor epTX;
+	MIDI_CsEPDescriptor<PORTS_TX, 1 + PORTS_RX> csEpTX;
+	
+	// Many of these field are taken from the "Example: Simple MIDI Adapter" from the USB MIDI Spec. 1.0.
+	// Comments denote which table was used as reference.
+	constexpr USBMultiMIDIDescriptor(void)
+		//      D_IAD(firstIntf, numIntfs, class,         subClass,     protocol)
+		: iad D_IAD(0, 2, USB_IC_AUDIO, USB_ISC_AUDIO_CONTROL, 0)
+		// The AudioControl interface doesn't have any endpoints.
+		//         D_INTERFACE(intfIndex, numEndpts, class,         subClass,   protocol)
+		, acIntf D_INTERFACE(0, 0, USB_IC_AUDIO, USB_ISC_AUDIO_CONTROL, 0)	// see Table B-3
+		// Here we assign our MIDIStreaming interface to this AudioControl interface.
+		//    D_AC_INTERFACE(numStreamIntfs, acIntfID)
+		, acIDesc D_AC_INTERFACE(1, 0)	// see Table B-4
+		// We have 2 endpoints: one for MIDI In and Out each.
+		//         D_INTERFACE(intfIndex, numEndpts, class,         subClass,      protocol)
+		, msIntf D_INTERFACE(0, 2, USB_IC_AUDIO, USB_ICS_MIDISTREAMING, 0)
+		// sizeof(Stream Intf Descriptor) + sizeof(all Jack descriptors) + sizeof(all Endpoint descriptors)
+		, msIDesc D_MS_INTERFACE(sizeof(USBMultiMIDIDescriptor) - offsetof(USBMultiMIDIDescriptor, msIDesc))	// USB-MIDI Spec. B-6
+		, jacksRX()
+		, jacksTX()
+		//       D_MIDI_JACK_EP(bEndpointAddress,  bmAttributes,       wMaxPacketSize)
+		, epRX D_MIDI_JACK_EP(USB_ENDPOINT_OUT(0), USB_ENDPOINT_TYPE_BULK, MIDI_EP_SIZE)	// see Table B-11
+		, csEpRX()
+		//       D_MIDI_JACK_EP(bEndpointAddress, bmAttributes,       wMaxPacketSize)
+		, epTX D_MIDI_JACK_EP(USB_ENDPOINT_IN(0), USB_ENDPOINT_TYPE_BULK, MIDI_EP_SIZE)	// see Table B-13
+		, csEpTX()
+	{}
+};
+
+#pragma pack(pop)
+
+#endif	// USBMULTIMIDIDESC_HPP
@@ -10,45 +10,133 @@
 
 #include <stdint.h>
 #include "USBMultiMIDI.hpp"
+#include "MidiSerial.hpp"
+#include "MidiParser.hpp"
+#include "Trace.hpp"
 
 
+#ifndef CTS_FLOW_CONTROL
 #define CTS_FLOW_CONTROL	0
+#endif
+// RTS is set HIGH when data from the device can't be forwarded fast enough. (Devices without flow control ignore it.)
+#ifndef RTS_FLOW_CONTROL
+#define RTS_FLOW_CONTROL	1
+#endif
 #define PIN_CTS	2
 #define PIN_RTS	3
 
-#define PORTS_IN	1	// host-side MIDI in (USB TX)
+#define PORTS_IN	2	// host-side MIDI in (USB TX)
 #define PORTS_OUT	4	// host-side MIDI out (USB RX)
 
-static const uint8_t USB_EVT_LEN[0x10] =
+// USB -> Serial packets are queued per port, so that messages for the same port can be sent
+// in batches with a single Port Select command.
+// A message can be overtaken by less than PORT_REORDER_WINDOW messages (for other ports) that arrived after it.
+// The order of messages for the same port is never changed.
+#define PORT_QUEUE_SIZE		8	// packets per port, must be a power of 2
+#define PORT_REORDER_WINDOW	32	// must be < 128
+#define USB_IN_BATCH		16	// number of packets fetched from USBMultiMIDI at once (16 = 1 USB bank)
+
+// Serial -> USB: USB MIDI In cable for the data after "F5 nn" (index = nn)
+// Ports that aren't listed here use cable 0. All cables must be < PORTS_IN.
+static const uint8_t SERIAL_IN_PORT_MAP[] =
 {
-	0, 0, 2, 3, 3, 1, 2, 3,
-	3, 3, 3, 3, 2, 2, 3, 1,
+	0,			// no Port Select received yet
+	0, 0, 0, 0,	// F5 01..04: data from the device itself (ports A..D)
+	1,			// F5 05: data from the device's MIDI In (e.g. Roland SC-8820)
 };
-static const uint8_t MIDI_USB_EVT_TYPE_MAIN[0x10] =
+
+// Bridge commands: SysEx messages "F0 7D 55 cmd ... F7" from the host are handled by the bridge
+// instead of being sent to the device. (7D = manufacturer ID for non-commercial use)
+#define BRIDGE_SYSEX_ID			0x55
+#define BRIDGE_CMD_GET_STATS	0x01	// reply: F0 7D 55 11 <version> <count> <counters> F7
+#define BRIDGE_CMD_RESET_STATS	0x02
+#define BRIDGE_CMD_SET_RT_FILTER	0x03	// F0 7D 55 03 <message - F8> <RTF_xx policy> F7
+#define BRIDGE_REPLY_STATS		0x11
+#define BRIDGE_REPLY_CABLE		0	// USB MIDI In cable for replies
+#define STATS_VERSION			0x04
+// Each counter is sent as 5 bytes with 7 bits each, least significant bits first.
+// 16 global counters, then the bytes sent to each port of the device, then the bytes received for each USB MIDI In cable.
+#define STATS_COUNT		(16 + PORTS_OUT + PORTS_IN)
+#define STATS_REPLY_LEN	(6 + STATS_COUNT * 5 + 1)
+static_assert(STATS_REPLY_LEN <= 0xFF, "too many ports for the stats reply");
+
+// Serial -> USB filter for System Real Time messages (F8..FF)
+// Modules that send Active Sensing or Clock all the time would otherwise cause a USB transfer every few milliseconds.
+#define RTF_PASS		0x00
+#define RTF_DROP		0x01
+#define RTF_KEEPALIVE	0x02	// pass at most one message per RT_KEEPALIVE_TIME
+#define RT_KEEPALIVE_TIME	250	// [ms], less than the 300 ms timeout of Active Sensing
+// default policies, can be changed by the host with BRIDGE_CMD_SET_RT_FILTER
+static const uint8_t RT_FILTER_DEFAULT[8] =
 {
-	0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F,	// for invalid commands, just assume "single byte" USB command
-	0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x00,	// MIDI 8x..Ex = USB 08..0E, MIDI Fx is special
+	RTF_PASS,		// F8 Timing Clock
+	RTF_DROP,		// F9 (undefined)
+	RTF_PASS,		// FA Start
+	RTF_PASS,		// FB Continue
+	RTF_PASS,		// FC Stop
+	RTF_DROP,		// FD (undefined)
+	RTF_KEEPALIVE,	// FE Active Sensing
+	RTF_PASS,		// FF System Reset
 };
-static const uint8_t MIDI_USB_EVT_TYPE_FX[0x10] =
+
+static const uint8_t USB_EVT_LEN[0x10] =
 {
-	0xF0, 0x02, 0x03, 0x02, 0x00, 0x02, 0x05, 0xF0,	// System Common messages
-	0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F,	// System Real Time messages
+	0, 0, 2, 3, 3, 1, 2, 3,
+	3, 3, 3, 3, 2, 2, 3, 1,
 };
 
-static void FlushSrlUsbData(void);
 static void ProcessSerialData(uint8_t data);
+static void ForwardRealtime(void);
+static void ReadUsbPackets(void);
+static uint8_t SelectOutPort(void);
+static void SendPortQueues(void);
+static uint8_t HandleBridgeSysEx(const midiEventPacket_t* pkt);
+static void SendStatsReply(void);
+static uint32_t GetStatsCounter(uint8_t idx);
+static uint8_t GetStatsReplyByte(uint8_t pos);
+static void ResetStats(void);
+static uint8_t FilterRealtime(uint8_t data);
+
+typedef struct
+{
+	midiEventPacket_t pkt[PORT_QUEUE_SIZE];
+	uint8_t seq[PORT_QUEUE_SIZE];	// arrival number of each packet
+	uint8_t head;	// free-running indices, the number of packets is (head - tail)
+	uint8_t tail;
+} PortQueue;
 
 
-static USBMultiMIDI midiMod(PORTS_OUT, PORTS_IN);
+static USBMultiMIDI<PORTS_OUT, PORTS_IN> midiMod;
 static int lastPort = -1;
 static unsigned long ledOffTime = 0;
 
 // status variables for Serial -> USB
-static uint8_t suCurCmd = 0x00;
-static uint8_t suRunStatus = 0x00;
-static uint8_t suRemLen = 0x00;
-static uint8_t suBufPos = 0x00;
-static midiEventPacket_t suPkt;
+static MidiParser suParser;
+static uint32_t suCableBytes[PORTS_IN];	// bytes received for each USB MIDI In cable
+static uint8_t rtFilter[8];	// RTF_xx policy for F8..FF
+static uint16_t rtLastPass[8];	// millis() when the last message was passed, for RTF_KEEPALIVE
+static uint32_t rtSuppressed = 0;	// number of filtered System Real Time messages
+#if TRACE_ENABLE
+static uint8_t suPort = 0x00;
+static uint8_t suErrors = 0;
+#endif
+
+// status variables for USB -> Serial
+static PortQueue usQueue[PORTS_OUT];
+static midiEventPacket_t usInBuf[USB_IN_BATCH];	// packets read from USB that aren't queued yet
+static uint8_t usInPos = 0;
+static uint8_t usInCnt = 0;
+static uint8_t usSeqNum = 0;	// arrival number of the next packet
+static uint8_t usInSysEx = 0;	// the current port is in the middle of a SysEx message
+static uint32_t usPortBytes[PORTS_OUT];	// bytes sent to each port of the device (without Port Select)
+static uint8_t usCtrlPort = 0xFF;	// port that is sending a bridge command, 0xFF = none
+static uint8_t usCtrlData[3];	// command + parameters
+static uint8_t usCtrlLen = 0;
+
+static uint8_t statsReplyPending = 0;
+static uint8_t statsReplyPos = 0;	// next byte of the stats reply, the reply is sent over multiple loop() calls
+static uint32_t statsReplyValue;	// counter that is currently being sent
+static unsigned long loopTimeMax = 0;	// longest loop() call [us]
 
 void setup()
 {
@@ -66,205 +154,410 @@ void setup()
 	//	CTS: This is usually kept LOW.
 	//	RTS: LOW = can send data, HIGH = suspend data stream
 	digitalWrite(PIN_RTS, LOW);	// Roland SC devices wait for it to go LOW before sending data
-	Serial1.begin(38400);
+	// With CTS flow control, sending is paused in the background while CTS is HIGH.
+	// With RTS flow control, RTS goes HIGH while the receive buffer is nearly full.
+	MidiSerial_Begin(38400, CTS_FLOW_CONTROL, RTS_FLOW_CONTROL);
 	
 	// When there are more than 1 port, enforce sending Port Select before the first actual command.
 	lastPort = (PORTS_OUT > 1) ? -1 : 0;
-	suPkt.hdr.cn = 0;	// default to first port
+	MidiParser_Init(&suParser);
+	MidiParser_SetPortMap(&suParser, SERIAL_IN_PORT_MAP, sizeof(SERIAL_IN_PORT_MAP));
+	memcpy(rtFilter, RT_FILTER_DEFAULT, sizeof(rtFilter));
 	
 	return;
 }
 
-static void WriteSerial(const uint8_t* data, uint8_t len)
+static void ProcessSerialData(uint8_t data)
 {
-#if ! CTS_FLOW_CONTROL
-	Serial1.write(data, len);
-	int state = digitalRead(PIN_CTS);
-	if (state == HIGH)
+	uint8_t pktData[MIDIPARSER_MAX_PACKETS * 4];
+	midiEventPacket_t pkts[MIDIPARSER_MAX_PACKETS];
+	uint8_t pktCnt;
+	uint8_t sendCnt;
+	uint8_t curPkt;
+	
+	if (suParser.cable < PORTS_IN)
+		suCableBytes[suParser.cable] ++;
+	pktCnt = MidiParser_Feed(&suParser, data, pktData);
+#if TRACE_ENABLE
+	if (suParser.port != suPort)
 	{
-		//Serial.print("CTS state: ");	Serial.println(state);
-		if (! ledOffTime)	// don't need to turn on when it's already on
-			digitalWrite(LED_BUILTIN, state);
-		ledOffTime = millis() + 100;	// keep on for 100 ms
+		suPort = suParser.port;
+		TRACE(TRC_SERIAL_PORT, suPort);
 	}
-#else
-	// send while taking CTS into account
-	// TODO: Can this be done more efficiently? (I don't like the explicit flushing here.)
-	uint8_t pos;
-	for (pos = 0; pos < len; pos ++)
+	if (suParser.errors != suErrors)
+	{
+		suErrors = suParser.errors;
+		TRACE(TRC_PARSER_RESYNC, data);
+	}
+#endif
+	if (! pktCnt)
+		return;
+	
+	sendCnt = 0;
+	for (curPkt = 0; curPkt < pktCnt; curPkt ++)
+	{
+		const uint8_t* src = &pktData[curPkt * 4];
+		if ((src[0] & 0x0F) == 0x0F && src[1] >= 0xF8 && ! FilterRealtime(src[1]))
+			continue;
+		pkts[sendCnt].header = src[0];
+		pkts[sendCnt].data[0] = src[1];
+		pkts[sendCnt].data[1] = src[2];
+		pkts[sendCnt].data[2] = src[3];
+		sendCnt ++;
+	}
+	if (sendCnt)
+		midiMod.sendMIDI(pkts, sendCnt);	// USBMultiMIDI collects the packets and sends them in batches
+	return;
+}
+
+static uint8_t FilterRealtime(uint8_t data)	// returns 1 if the message should be sent to the host
+{
+	uint8_t idx = data - 0xF8;
+	uint16_t timeMS;
+	
+	switch(rtFilter[idx])
 	{
-		Serial1.flush();
-		int state = digitalRead(PIN_CTS);
-		if (state == HIGH)
+	case RTF_PASS:
+		return 1;
+	case RTF_KEEPALIVE:
+		timeMS = (uint16_t)millis();
+		if ((uint16_t)(timeMS - rtLastPass[idx]) >= RT_KEEPALIVE_TIME)
 		{
-			if (! ledOffTime)	// don't need to turn on when it's already on
-				digitalWrite(LED_BUILTIN, state);
-			ledOffTime = millis() + 100;	// keep on for 100 ms
+			rtLastPass[idx] = timeMS;
+			return 1;
 		}
+		break;
+	}
+	rtSuppressed ++;
+	return 0;
+}
 
-		// poll port until CTS gets LOW (== ready)
-		while(state == HIGH)
-			state = digitalRead(PIN_CTS);
-		// then send the data
-		Serial1.write(data[pos]);
+static uint8_t HandleBridgeSysEx(const midiEventPacket_t* pkt)	// returns 1 when the packet was used by the bridge
+{
+	uint8_t cin = pkt->hdr.cin;
+	uint8_t pos;
+	
+	if (usCtrlPort == 0xFF)
+	{
+		// SysEx start packets always contain 3 bytes.
+		if (cin != 0x04 || pkt->data[0] != 0xF0 || pkt->data[1] != 0x7D || pkt->data[2] != BRIDGE_SYSEX_ID)
+			return 0;
+		usCtrlPort = pkt->hdr.cn;
+		usCtrlLen = 0;
+		return 1;
 	}
-#endif
+	if (pkt->hdr.cn != usCtrlPort || (cin == 0x0F && pkt->data[0] >= 0xF8))
+		return 0;	// (System Real Time messages may appear within SysEx)
+	
+	if (cin < 0x04 || cin > 0x07)
+	{
+		usCtrlPort = 0xFF;	// SysEx was aborted - send the packet to the device as usual
+		return 0;
+	}
+	for (pos = 0; pos < USB_EVT_LEN[cin] && pkt->data[pos] != 0xF7; pos ++)
+	{
+		if (usCtrlLen < sizeof(usCtrlData))
+			usCtrlData[usCtrlLen ++] = pkt->data[pos];
+	}
+	if (cin == 0x04)
+		return 1;	// wait for the end of the message
+	
+	usCtrlPort = 0xFF;
+	if (! usCtrlLen)
+		return 1;
+	if (usCtrlData[0] == BRIDGE_CMD_GET_STATS)
+		statsReplyPending = 1;
+	else if (usCtrlData[0] == BRIDGE_CMD_RESET_STATS)
+		ResetStats();
+	else if (usCtrlData[0] == BRIDGE_CMD_SET_RT_FILTER && usCtrlLen >= 3 && usCtrlData[1] < 8 && usCtrlData[2] <= RTF_KEEPALIVE)
+		rtFilter[usCtrlData[1]] = usCtrlData[2];
+	return 1;
+}
+
+static void SendStatsReply(void)
+{
+	// Send only as much as fits into the USB buffer, so that loop() never has to wait for the host.
+	// The rest is sent by the next calls.
+	midiEventPacket_t pkt;
+	uint8_t len;
+	
+	while(statsReplyPos < STATS_REPLY_LEN && midiMod.txSpace() > 0)
+	{
+		// split into USB MIDI packets: 3 bytes each, the last one with CIN 5/6/7
+		len = (STATS_REPLY_LEN - statsReplyPos > 3) ? 3 : (STATS_REPLY_LEN - statsReplyPos);
+		pkt.header = (BRIDGE_REPLY_CABLE << 4) | ((statsReplyPos + 3 < STATS_REPLY_LEN) ? 0x04 : (0x04 + len));
+		pkt.data[0] = GetStatsReplyByte(statsReplyPos);
+		pkt.data[1] = (len > 1) ? GetStatsReplyByte(statsReplyPos + 1) : 0x00;
+		pkt.data[2] = (len > 2) ? GetStatsReplyByte(statsReplyPos + 2) : 0x00;
+		midiMod.sendMIDI(pkt);
+		statsReplyPos += len;
+	}
+	if (statsReplyPos >= STATS_REPLY_LEN)
+	{
+		statsReplyPos = 0;
+		statsReplyPending = 0;
+	}
+	return;
+}
+
+static uint8_t GetStatsReplyByte(uint8_t pos)
+{
+	uint8_t cntPos;
+	
+	switch(pos)
+	{
+	case 0:	return 0xF0;
+	case 1:	return 0x7D;
+	case 2:	return BRIDGE_SYSEX_ID;
+	case 3:	return BRIDGE_REPLY_STATS;
+	case 4:	return STATS_VERSION;
+	case 5:	return STATS_COUNT;
+	case STATS_REPLY_LEN - 1:	return 0xF7;
+	}
+	cntPos = (pos - 6) % 5;
+	if (cntPos == 0)
+		statsReplyValue = GetStatsCounter((pos - 6) / 5);	// read each counter once
+	return (uint8_t)(statsReplyValue >> (cntPos * 7)) & 0x7F;
+}
+
+static uint32_t GetStatsCounter(uint8_t idx)
+{
+	const USBMidiStats& usbStats = midiMod.getStats();
+	MidiSerialStats serStats;
+	
+	if (idx >= 16 + PORTS_OUT)
+		return suCableBytes[idx - 16 - PORTS_OUT];
+	if (idx >= 16)
+		return usPortBytes[idx - 16];
+	MidiSerial_GetStats(&serStats);
+	switch(idx)
+	{
+	case 0:	return usbStats.rxPackets;
+	case 1:	return usbStats.txPackets;
+	case 2:	return usbStats.rxDropped;
+	case 3:	return usbStats.txDropped;
+	case 4:	return usbStats.rxHighWater;
+	case 5:	return serStats.rxBytes;
+	case 6:	return serStats.txBytes;
+	case 7:	return serStats.rxHighWater;
+	case 8:	return serStats.txHighWater;
+	case 9:	return serStats.ctsHighTime;
+	case 10:	return loopTimeMax;
+	case 11:	return serStats.rxOverruns;
+	case 12:	return serStats.rxFrameErrors;
+	case 13:	return serStats.rxDropped;
+	case 14:	return serStats.rtsHighCount;
+	default:	return rtSuppressed;
+	}
+}
+
+static void ResetStats(void)
+{
+	midiMod.resetStats();
+	MidiSerial_ResetStats();
+	memset(suCableBytes, 0x00, sizeof(suCableBytes));
+	memset(usPortBytes, 0x00, sizeof(usPortBytes));
+	loopTimeMax = 0;
+	rtSuppressed = 0;
 	return;
 }
 
-static void FlushSrlUsbData(void)	// flush Serial -> USB data packet
+static void ForwardRealtime(void)
 {
-	midiMod.sendMIDI(suPkt);
-	midiMod.flush();
+	// System Real Time messages from the host (e.g. MIDI clock) skip the port queues
+	// and are sent before all data that waits for the serial port, so their timing is kept.
+	// They don't depend on a port, so they don't need a Port Select and can be put into other messages.
+	midiEventPacket_t pkts[MIDISERIAL_RT_BUFFER_SIZE];
+	uint8_t pktCnt;
+	uint8_t curPkt;
 	
-	suBufPos = 0x00;
-	memset(suPkt.data, 0x00, 0x03);
+	pktCnt = midiMod.readRealtime(pkts, MidiSerial_RealtimeSpace());
+	for (curPkt = 0; curPkt < pktCnt; curPkt ++)
+	{
+		if (pkts[curPkt].hdr.cn >= PORTS_OUT)
+			continue;	// no such port - ignore
+		MidiSerial_WriteRealtime(pkts[curPkt].data[0]);
+		usPortBytes[pkts[curPkt].hdr.cn] ++;
+	}
 	return;
 }
 
-static void ProcessSerialData(uint8_t data)
+static void ReadUsbPackets(void)
 {
-	if (suCurCmd == 0xF0)
+	while(true)
 	{
-		if (data < 0xF0 || data == 0xF7)
+		const midiEventPacket_t* pkt;
+		PortQueue* q;
+		
+		if (usInPos >= usInCnt)
 		{
-			suPkt.data[suBufPos] = data;
-			suBufPos ++;
-			if (data == 0xF7)	// SysEx End
-			{
-				suRemLen = 0x00;
-				suCurCmd = 0x00;	// stop special SysEx handling
-				suPkt.hdr.cin = 0x04 + suBufPos;	// SysEx End: command 5/6/7, depending on length
-				FlushSrlUsbData();
-			}
-			else if (suBufPos >= 0x03)
-			{
-				suPkt.hdr.cin = 0x04;	// SysEx start/continue
-				FlushSrlUsbData();
-			}
-			return;
+			ForwardRealtime();	// check the new packets before they are copied
+			usInPos = 0;
+			usInCnt = midiMod.readBatch(usInBuf, USB_IN_BATCH);
+			if (! usInCnt)
+				return;	// no more data
 		}
 		
-		// handle transition from SysEx to other commands
-		if (suBufPos > 0)
+		pkt = &usInBuf[usInPos];
+		if (pkt->hdr.cn >= PORTS_OUT || ! USB_EVT_LEN[pkt->hdr.cin])
 		{
-			suPkt.hdr.cin = 0x04 + suBufPos;	// SysEx End: command 5/6/7, depending on length
-			FlushSrlUsbData();
+			usInPos ++;	// no such port / no MIDI data - ignore
+			continue;
 		}
-		suRemLen = 0x00;
-		// then fall through
-	}
-	
-	if (suRemLen)
-	{
-		// process remaining bytes of Channel message
-		suPkt.data[suBufPos] = data;
-		suBufPos ++;
-		suRemLen --;
-		if (! suRemLen)
+		if (HandleBridgeSysEx(pkt))
 		{
-			if (suPkt.data[0] == 0xF5)
-			{
-				Serial.print("Serial In: Port = ");	Serial.println(suPkt.data[1], DEC);
-				suPkt.hdr.cn = 0x00;	// all on port 0 for now
-				suBufPos = 0x00;
-				memset(suPkt.data, 0x00, 0x03);
-				return;
-			}
-			FlushSrlUsbData();
+			usInPos ++;
+			continue;
 		}
-		return;
+		q = &usQueue[pkt->hdr.cn];
+		if ((uint8_t)(q->head - q->tail) >= PORT_QUEUE_SIZE)
+			return;	// queue full - leave the remaining packets in the buffers
+		q->pkt[q->head & (PORT_QUEUE_SIZE - 1)] = *pkt;
+		q->seq[q->head & (PORT_QUEUE_SIZE - 1)] = usSeqNum;
+		q->head ++;
+		usSeqNum ++;
+		usInPos ++;
 	}
+}
+
+static uint8_t SelectOutPort(void)	// returns the port to send the next packet to, 0xFF = nothing to send
+{
+	uint8_t curPort = (lastPort < 0) ? 0xFF : (uint8_t)lastPort;
+	uint8_t oldPort = 0xFF;	// other port with the oldest waiting packet
+	uint8_t oldSeq = 0x00;
+	uint8_t port;
 	
-	if (data >= 0xF8)	// quick handling of System Real Time messages
+	for (port = 0; port < PORTS_OUT; port ++)
 	{
-		// They are all single-byte and don't change any status bytes.
-		suPkt.hdr.cin = MIDI_USB_EVT_TYPE_FX[data & 0x0F];
-		suPkt.data[0] = data;
-		FlushSrlUsbData();
-		return;
+		const PortQueue* q = &usQueue[port];
+		uint8_t seq;
+		
+		if (port == curPort || q->head == q->tail)
+			continue;
+		seq = q->seq[q->tail & (PORT_QUEUE_SIZE - 1)];
+		if (oldPort == 0xFF || (int8_t)(seq - oldSeq) < 0)
+		{
+			oldPort = port;
+			oldSeq = seq;
+		}
 	}
+	if (curPort == 0xFF)
+		return oldPort;
 	
-	suBufPos = 0x00;
-	if (data & 0x80)
+	if (usQueue[curPort].head != usQueue[curPort].tail)
 	{
-		if (data < 0xF0)
-			suRunStatus = data;
-		else if (data < 0xF8)
-			suRunStatus = 0x00;
-		// keep suRunStatus for F8..FF
+		const PortQueue* q = &usQueue[curPort];
+		uint8_t curSeq = q->seq[q->tail & (PORT_QUEUE_SIZE - 1)];
 		
-		suCurCmd = MIDI_USB_EVT_TYPE_MAIN[data >> 4];
-		if (! suCurCmd)	// handle Fx commands
-			suCurCmd = MIDI_USB_EVT_TYPE_FX[data & 0x0F];
-		suRemLen = USB_EVT_LEN[suCurCmd & 0x0F];
+		// Stay on the current port while its packets are within the reordering window.
+		// Also never put a Port Select into a SysEx message.
+		if (usInSysEx || oldPort == 0xFF || (int8_t)(curSeq - oldSeq) < PORT_REORDER_WINDOW)
+			return curPort;
 	}
-	else if (suRunStatus)
+	else if (usInSysEx && usInPos >= usInCnt)
 	{
-		// handle running staus for 80..EF events
-		suCurCmd = MIDI_USB_EVT_TYPE_MAIN[suRunStatus >> 4];
-		suRemLen = USB_EVT_LEN[suCurCmd];
-		
-		// in USB MIDI, there doesn't seem to be a "Running Status", so insert the missing command byte
-		suPkt.data[suBufPos] = suRunStatus;
-		suBufPos ++;
-		suRemLen --;	// all events are assumed to have at least 1 parameter byte here
+		// wait for the rest of the SysEx message
+		// (When reading from USB is blocked by a packet for another port, the host interleaved ports within
+		// the SysEx message and waiting would never end, so the port is switched in that case.)
+		return 0xFF;
 	}
-	else
+	return oldPort;
+}
+
+static void SendPortQueues(void)
+{
+	// Only send packets when they fit into the send buffer. (Port Select + 3 data bytes)
+	while(MidiSerial_WriteSpace() >= 5)
 	{
-		suCurCmd = MIDI_USB_EVT_TYPE_MAIN[0x00];
-		suRemLen = USB_EVT_LEN[suCurCmd];
+		uint8_t port = SelectOutPort();
+		PortQueue* q;
+		const midiEventPacket_t* pkt;
+		
+		if (port == 0xFF)
+			return;
+		if (port != lastPort)
+		{
+			uint8_t portSel[2] = {0xF5, (uint8_t)(1 + port)};	// yes, it's 1-based
+			//char portSel[2] = {0xF5, (uint8_t)port};	// TODO: has port 0 a special meaning?
+			MidiSerial_Write(portSel, 2);
+			TRACE(TRC_USB_PORT, port);
+			lastPort = port;
+			usInSysEx = 0;
+		}
+		
+		q = &usQueue[port];
+		pkt = &q->pkt[q->tail & (PORT_QUEUE_SIZE - 1)];
+		MidiSerial_Write(pkt->data, USB_EVT_LEN[pkt->hdr.cin]);
+		usPortBytes[port] += USB_EVT_LEN[pkt->hdr.cin];
+		//Serial.print("OUT Cmd: ");	Serial.println(pkt->hdr.cin, HEX);
+		if (pkt->hdr.cin == 0x04)
+			usInSysEx = 1;	// SysEx start/continue
+		else if (pkt->hdr.cin >= 0x05 && pkt->hdr.cin <= 0x07)
+			usInSysEx = 0;	// SysEx end
+		q->tail ++;
 	}
-	
-	suPkt.hdr.cin = suCurCmd;
-	suPkt.data[suBufPos] = data;
-	suBufPos ++;
-	suRemLen --;
-	if (suRemLen == 0)
-		FlushSrlUsbData();
 	return;
 }
 
 void loop()
 {
-	midiEventPacket_t usPkt;
+	unsigned long loopStart = micros();
+	unsigned long loopTime;
 	
-	while(Serial1.available())
+	// When the host doesn't take the data, it stays in the receive buffer, which raises RTS.
+	// Data from the device also waits while the stats reply is being sent, so that it can't get into the reply.
+	while(MidiSerial_Available() && ! statsReplyPos && midiMod.txSpace() >= MIDIPARSER_MAX_PACKETS)
 	{
-		uint8_t data = Serial1.read();
+		uint8_t data = MidiSerial_Read();
 		//if (data >= 0xF0)
 		//{
 		//	Serial.print("IN: ");	Serial.println(data, HEX);
 		//}
 		ProcessSerialData(data);
 	}
+	// (The reply must not be put into a SysEx message from the device.)
+	if (statsReplyPos || (statsReplyPending && ! (suParser.inSysEx && suParser.cable == BRIDGE_REPLY_CABLE)))
+		SendStatsReply();
+	midiMod.update();
+	
+	// When the queues are full, the packets stay in the USB buffer and the host has to wait,
+	// while Serial -> USB keeps running.
+	ForwardRealtime();
+	ReadUsbPackets();
+	SendPortQueues();
 	
-	usPkt = midiMod.read();
-	while(usPkt.header != 0x00)
+#if TRACE_ENABLE
+	if (Serial.available() && Serial.read() == 'T')
+		Trace_Dump(Serial);
+#endif
+
+	// show CTS state on the LED
+	if (MidiSerial_CtsEvent())
 	{
-		if (usPkt.hdr.cn != lastPort)
-		{
-			uint8_t portSel[2] = {0xF5, (uint8_t)(1 + usPkt.hdr.cn)};	// yes, it's 1-based
-			//char portSel[2] = {0xF5, (uint8_t)usPkt.hdr.cn};	// TODO: has port 0 a special meaning?
-			WriteSerial(portSel, 2);
-			lastPort = usPkt.hdr.cn;
-		}
-		WriteSerial(usPkt.data, USB_EVT_LEN[usPkt.hdr.cin]);
-		//Serial.print("OUT Cmd: ");	Serial.println(usPkt.hdr.cin, HEX);
-		
-		usPkt = midiMod.read();
+		if (! ledOffTime)	// don't need to turn on when it's already on
+			digitalWrite(LED_BUILTIN, HIGH);
+		ledOffTime = millis() + 100;	// keep on for 100 ms
 	}
-
 	// turn CTS LED off after timeout
 	if (ledOffTime)
 	{
 		unsigned long timeMS = millis();
 		if (timeMS >= ledOffTime)
 		{
-			ledOffTime = 0;
-			digitalWrite(LED_BUILTIN, LOW);
+			if (MidiSerial_GetCts())
+			{
+				ledOffTime = timeMS + 100;	// still HIGH - keep it on
+			}
+			else
+			{
+				ledOffTime = 0;
+				digitalWrite(LED_BUILTIN, LOW);
+			}
 		}
 	}
 	
+	loopTime = micros() - loopStart;
+	if (loopTime > loopTimeMax)
+		loopTimeMax = loopTime;
 	return;
 }
@@ -0,0 +1,52 @@
+// Arduino API for the firmware simulator
+// Emulates an Arduino Leonardo (ATmega32U4, 16 MHz) with the parts of the core that the firmware uses.
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define ARDUINO	10813
+#define ARDUINO_ARCH_AVR
+#define ARDUINO_AVR_LEONARDO
+#define USBCON
+#ifndef F_CPU
+#define F_CPU	16000000UL
+#endif
+
+#define HIGH	0x1
+#define LOW		0x0
+
+#define INPUT			0x0
+#define OUTPUT			0x1
+#define INPUT_PULLUP	0x2
+
+#define LED_BUILTIN	13
+
+#define lowByte(w)	((uint8_t)((w) & 0xFF))
+#define highByte(w)	((uint8_t)((w) >> 8))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// implemented by the sketch
+void setup(void);
+void loop(void);
+
+#include "HardwareSerial.h"
+#include "USBAPI.h"
+
+#endif	// Arduino_h
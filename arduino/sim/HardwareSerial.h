@@ -0,0 +1,42 @@
+// Arduino HardwareSerial for the firmware simulator
+// This follows the AVR core implementation and runs on the emulated USART1 registers.
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include <stdint.h>
+#include "Print.h"
+
+#define SERIAL_TX_BUFFER_SIZE	64
+#define SERIAL_RX_BUFFER_SIZE	64
+
+class HardwareSerial : public Print
+{
+public:
+	HardwareSerial(void);
+	void begin(unsigned long baud);
+	void end(void);
+	int available(void);
+	int peek(void);
+	int read(void);
+	int availableForWrite(void);
+	void flush(void);
+	size_t write(uint8_t data);
+	using Print::write;
+	operator bool()	{ return true; }
+	
+	// interrupt handlers
+	void _rx_complete_irq(void);
+	void _tx_udr_empty_irq(void);
+private:
+	volatile uint8_t _rx_buffer_head;
+	volatile uint8_t _rx_buffer_tail;
+	volatile uint8_t _tx_buffer_head;
+	volatile uint8_t _tx_buffer_tail;
+	bool _written;
+	uint8_t _rx_buffer[SERIAL_RX_BUFFER_SIZE];
+	uint8_t _tx_buffer[SERIAL_TX_BUFFER_SIZE];
+};
+
+extern HardwareSerial Serial1;
+
+#endif	// HardwareSerial_h
@@ -0,0 +1,55 @@
+// Arduino AVR PluggableUSB for the firmware simulator
+#ifndef PUSB_h
+#define PUSB_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "USBAPI.h"
+#include "USBCore.h"
+
+class PluggableUSBModule
+{
+public:
+	PluggableUSBModule(uint8_t numEps, uint8_t numIfs, uint8_t* epType) :
+		numEndpoints(numEps), numInterfaces(numIfs), endpointType(epType)
+	{ }
+	virtual ~PluggableUSBModule() {}
+protected:
+	virtual bool setup(USBSetup& setup) = 0;
+	virtual int getInterface(uint8_t* interfaceCount) = 0;
+	virtual int getDescriptor(USBSetup& setup) = 0;
+	virtual uint8_t getShortName(char* name)	{ name[0] = 'A' + pluggedInterface; return 1; }
+	
+	uint8_t pluggedInterface;
+	uint8_t pluggedEndpoint;
+	
+	const uint8_t numEndpoints;
+	const uint8_t numInterfaces;
+	const uint8_t* endpointType;
+	
+	PluggableUSBModule* next = NULL;
+	
+	friend class PluggableUSB_;
+};
+
+class PluggableUSB_
+{
+public:
+	PluggableUSB_(void);
+	bool plug(PluggableUSBModule* node);
+	int getInterface(uint8_t* interfaceCount);
+	int getDescriptor(USBSetup& setup);
+	bool setup(USBSetup& setup);
+	void getShortName(char* iSerialNum);
+	
+	// simulator extension: find the module that owns an endpoint, returns its endpoint type or 0
+	uint8_t getEndpointType(uint8_t ep);
+private:
+	uint8_t lastIf;
+	uint8_t lastEp;
+	PluggableUSBModule* rootNode;
+};
+
+PluggableUSB_& PluggableUSB(void);
+
+#endif	// PUSB_h
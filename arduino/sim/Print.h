@@ -0,0 +1,41 @@
+// Arduino Print class for the firmware simulator
+#ifndef Print_h
+#define Print_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DEC	10
+#define HEX	16
+#define OCT	8
+#define BIN	2
+
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t data) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size);
+	size_t write(const char* str);
+	
+	size_t print(const char str[]);
+	size_t print(char c);
+	size_t print(unsigned char val, int base = DEC);
+	size_t print(int val, int base = DEC);
+	size_t print(unsigned int val, int base = DEC);
+	size_t print(long val, int base = DEC);
+	size_t print(unsigned long val, int base = DEC);
+	
+	size_t println(void);
+	size_t println(const char str[]);
+	size_t println(char c);
+	size_t println(unsigned char val, int base = DEC);
+	size_t println(int val, int base = DEC);
+	size_t println(unsigned int val, int base = DEC);
+	size_t println(long val, int base = DEC);
+	size_t println(unsigned long val, int base = DEC);
+private:
+	size_t printNumber(unsigned long val, uint8_t base);
+};
+
+#endif	// Print_h
@@ -0,0 +1,269 @@
+// Firmware Simulator - Arduino core functions
+
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include <Arduino.h>
+#include "SimCore.hpp"
+
+
+struct PinDef
+{
+	SimReg8* pinReg;
+	SimReg8* ddrReg;
+	SimReg8* portReg;
+	uint8_t bit;
+};
+
+static const PinDef* GetPin(uint8_t pin);
+
+
+// Arduino Leonardo pin mapping (only the pins the firmware uses)
+static const PinDef PIN_MAP[] =
+{
+	{&PIND, &DDRD, &PORTD, PD2},	// D0 = RX1
+	{&PIND, &DDRD, &PORTD, PD3},	// D1 = TX1
+	{&PIND, &DDRD, &PORTD, PD1},	// D2 = INT1
+	{&PIND, &DDRD, &PORTD, PD0},	// D3 = INT0
+};
+static const PinDef PIN_LED = {&PINC, &DDRC, &PORTC, PC7};	// D13
+
+Serial_ Serial;
+
+static std::deque<uint8_t> cdcIn;	// data from the host that the firmware didn't read yet
+static std::vector<uint8_t> cdcFinalReq;	// sent by the host after all MIDI traffic was handled
+static std::vector<uint8_t> cdcOut;	// all data written by the firmware
+
+
+// --- digital I/O and timing ---
+static const PinDef* GetPin(uint8_t pin)
+{
+	if (pin < sizeof(PIN_MAP) / sizeof(PIN_MAP[0]))
+		return &PIN_MAP[pin];
+	else if (pin == LED_BUILTIN)
+		return &PIN_LED;
+	return NULL;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	const PinDef* pDef = GetPin(pin);
+	
+	Sim_Advance(SIM_CYC_DIGITALIO);
+	if (pDef == NULL)
+		return;
+	if (mode == OUTPUT)
+		pDef->ddrReg->value |= _BV(pDef->bit);
+	else
+		pDef->ddrReg->value &= ~_BV(pDef->bit);
+	return;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	const PinDef* pDef = GetPin(pin);
+	uint8_t portVal;
+	
+	Sim_Advance(SIM_CYC_DIGITALIO - 2 * SIM_CYC_REGISTER);
+	if (pDef == NULL)
+		return;
+	portVal = *pDef->portReg;
+	if (val == LOW)
+		*pDef->portReg = portVal & ~_BV(pDef->bit);
+	else
+		*pDef->portReg = portVal | _BV(pDef->bit);
+	return;
+}
+
+int digitalRead(uint8_t pin)
+{
+	const PinDef* pDef = GetPin(pin);
+	
+	Sim_Advance(SIM_CYC_DIGITALIO - SIM_CYC_REGISTER);
+	if (pDef == NULL)
+		return LOW;
+	return (*pDef->pinReg & _BV(pDef->bit)) ? HIGH : LOW;
+}
+
+unsigned long millis(void)
+{
+	Sim_Advance(SIM_CYC_MILLIS);
+	return (unsigned long)(simTime / SIM_CYC_PER_MS);
+}
+
+unsigned long micros(void)
+{
+	Sim_Advance(SIM_CYC_MILLIS);
+	return (unsigned long)(simTime / SIM_CYC_PER_US);
+}
+
+void delay(unsigned long ms)
+{
+	Sim_Advance(ms * SIM_CYC_PER_MS);
+	return;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	Sim_Advance(us * SIM_CYC_PER_US);
+	return;
+}
+
+
+// --- Print ---
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+	size_t n = 0;
+	
+	while(size --)
+	{
+		if (! write(*buffer++))
+			break;
+		n ++;
+	}
+	return n;
+}
+
+size_t Print::write(const char* str)
+{
+	if (str == NULL)
+		return 0;
+	return write((const uint8_t*)str, strlen(str));
+}
+
+size_t Print::printNumber(unsigned long val, uint8_t base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char* str = &buf[sizeof(buf) - 1];
+	
+	*str = '\0';
+	if (base < 2)
+		base = 10;
+	do
+	{
+		char c = val % base;
+		val /= base;
+		*--str = (c < 10) ? (c + '0') : (c + 'A' - 10);
+	} while(val);
+	return write(str);
+}
+
+size_t Print::print(const char str[])	{ return write(str); }
+size_t Print::print(char c)	{ return write((uint8_t)c); }
+size_t Print::print(unsigned char val, int base)	{ return print((unsigned long)val, base); }
+size_t Print::print(int val, int base)	{ return print((long)val, base); }
+size_t Print::print(unsigned int val, int base)	{ return print((unsigned long)val, base); }
+size_t Print::print(unsigned long val, int base)	{ return printNumber(val, base); }
+
+size_t Print::print(long val, int base)
+{
+	if (base == 10 && val < 0)
+		return print('-') + printNumber(-val, 10);
+	return printNumber(val, base);
+}
+
+size_t Print::println(void)	{ return write("\r\n"); }
+size_t Print::println(const char str[])	{ return print(str) + println(); }
+size_t Print::println(char c)	{ return print(c) + println(); }
+size_t Print::println(unsigned char val, int base)	{ return print(val, base) + println(); }
+size_t Print::println(int val, int base)	{ return print(val, base) + println(); }
+size_t Print::println(unsigned int val, int base)	{ return print(val, base) + println(); }
+size_t Print::println(long val, int base)	{ return print(val, base) + println(); }
+size_t Print::println(unsigned long val, int base)	{ return print(val, base) + println(); }
+
+
+// --- CDC serial port ---
+void Serial_::begin(unsigned long baud)
+{
+	return;
+}
+
+void Serial_::end(void)
+{
+	return;
+}
+
+int Serial_::available(void)
+{
+	Sim_Advance(SIM_CYC_REGISTER);
+	return (int)cdcIn.size();
+}
+
+int Serial_::read(void)
+{
+	uint8_t data;
+	
+	Sim_Advance(SIM_CYC_REGISTER);
+	if (cdcIn.empty())
+		return -1;
+	data = cdcIn.front();
+	cdcIn.pop_front();
+	return data;
+}
+
+void Serial_::flush(void)
+{
+	return;
+}
+
+size_t Serial_::write(uint8_t data)
+{
+	return write(&data, 1);
+}
+
+size_t Serial_::write(const uint8_t* buffer, size_t size)
+{
+	// Each write is a USB transfer on the CDC endpoint that the firmware waits for.
+	Sim_Advance(SIM_CYC_CDC_WRITE);
+	simStats.cdcWrites ++;
+	SimCdc_Write(buffer, size);
+	return size;
+}
+
+void SimCdc_Write(const uint8_t* data, size_t size)
+{
+	static std::string line;
+	size_t pos;
+	
+	cdcOut.insert(cdcOut.end(), data, data + size);
+	for (pos = 0; pos < size; pos ++)
+	{
+		if (data[pos] == '\n')
+		{
+			Sim_Log("CDC: %s\n", line.c_str());
+			line.clear();
+		}
+		else if (data[pos] != '\r')
+		{
+			line += (char)data[pos];
+		}
+	}
+	return;
+}
+
+bool SimCdc_IsIdle(void)
+{
+	return cdcIn.empty();
+}
+
+bool SimCdc_SendFinalRequest(void)
+{
+	if (cdcFinalReq.empty())
+		return false;
+	cdcIn.insert(cdcIn.end(), cdcFinalReq.begin(), cdcFinalReq.end());
+	cdcFinalReq.clear();
+	return true;
+}
+
+void SimHost_SendCdcAtEnd(const std::vector<uint8_t>& data)
+{
+	cdcFinalReq = data;
+	return;
+}
+
+const std::vector<uint8_t>& SimHost_GetCdcData(void)
+{
+	return cdcOut;
+}
@@ -0,0 +1,774 @@
+// Firmware Simulator - CPU, USART1 and the MIDI module
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+
+#include <Arduino.h>
+#include "SimCore.hpp"
+
+
+// interrupt handlers, defined by the firmware or the Arduino core (NULL when missing)
+extern "C" void INT1_vect(void) __attribute__((weak));
+extern "C" void USART1_RX_vect(void) __attribute__((weak));
+extern "C" void USART1_UDRE_vect(void) __attribute__((weak));
+extern "C" void USART1_TX_vect(void) __attribute__((weak));
+
+struct ModTxByte
+{
+	uint64_t time;	// earliest time to send the byte
+	uint8_t data;
+	int32_t msgID;	// index into modSent for the last byte of a message, else -1
+};
+
+static uint64_t NextEventTime(void);
+static void ProcessEvents(void);
+static void ServiceInterrupts(void);
+static bool IsIdle(void);
+static uint32_t UartByteCycles(void);
+static void Uart_TxDone(void);
+static void Uart_RxByte(uint8_t data);
+static void SetCts(bool level);
+static void Module_RxByte(uint8_t data);
+static void Module_UpdateBuffer(void);
+static uint64_t Module_NextEventTime(void);
+static void Module_ProcessEvents(void);
+
+static uint8_t Reg_SREG_Read(void);
+static void Reg_SREG_Write(uint8_t value);
+static uint8_t Reg_PIND_Read(void);
+static void Reg_PORTD_Write(uint8_t value);
+static void Reg_EIFR_Write(uint8_t value);
+static uint8_t Reg_UCSR1A_Read(void);
+static void Reg_UCSR1A_Write(uint8_t value);
+static uint8_t Reg_UDR1_Read(void);
+static void Reg_UDR1_Write(uint8_t value);
+
+
+uint64_t simTime = 0;
+SimStats simStats;
+bool simVerbose = false;
+
+static bool sregI = false;	// global interrupt enable
+static bool inISR = false;
+
+SimReg8 SREG(Reg_SREG_Read, Reg_SREG_Write);
+SimReg8 PINC, DDRC, PORTC;
+SimReg8 PIND(Reg_PIND_Read, NULL), DDRD, PORTD(NULL, Reg_PORTD_Write);
+SimReg8 EICRA, EIMSK, EIFR(NULL, Reg_EIFR_Write);
+SimReg8 UCSR1A(Reg_UCSR1A_Read, Reg_UCSR1A_Write), UCSR1B, UCSR1C, UCSR1D;
+SimReg8 UBRR1L, UBRR1H;
+SimReg16 UBRR1(UBRR1H, UBRR1L);
+SimReg8 UDR1(Reg_UDR1_Read, Reg_UDR1_Write);
+
+// USART1 state that isn't visible as plain register
+static struct
+{
+	uint8_t ctrlA;			// U2X1, MPCM1
+	bool txc;
+	bool udrFull;			// transmit buffer (UDR1) holds a byte
+	uint8_t udrData;
+	bool shifting;			// transmit shift register is busy
+	uint8_t shiftData;
+	uint64_t shiftEnd;
+	uint8_t rxFifo[2];		// receive FIFO
+	uint8_t rxFlags[2];		// FE1/DOR1 of each received byte
+	uint8_t rxCount;
+	uint8_t rxLast;
+} uart;
+
+static bool ctsLevel = false;
+static uint64_t ctsHighStart;
+
+// the MIDI module, connected to USART1 and the CTS/RTS lines
+static struct
+{
+	// receiving (bridge -> module)
+	SimSerialParser parser;
+	std::vector<SimMidiMsg> rcvd;
+	uint16_t bufSize;	// 0 = no CTS
+	uint16_t bufHigh;
+	uint16_t bufLow;
+	uint32_t drainCycles;
+	uint16_t bufFill;
+	uint64_t drainTime;	// time of the last processed byte
+	// sending (module -> bridge)
+	std::deque<ModTxByte> txQueue;
+	bool txBusy;
+	ModTxByte txCur;
+	uint64_t txEnd;
+	uint8_t txPort;
+	bool honorRts;
+	std::vector<SimMidiMsg> sent;
+} mod;
+
+
+// --- registers ---
+SimReg8::SimReg8(ReadFunc readFunc, WriteFunc writeFunc) :
+	value(0x00),
+	_read(readFunc),
+	_write(writeFunc)
+{
+	return;
+}
+
+SimReg8::operator uint8_t() const
+{
+	Sim_Advance(SIM_CYC_REGISTER);
+	return _read ? _read() : value;
+}
+
+SimReg8& SimReg8::operator=(uint8_t newValue)
+{
+	Sim_Advance(SIM_CYC_REGISTER);
+	if (_write)
+		_write(newValue);
+	else
+		value = newValue;
+	return *this;
+}
+
+SimReg8& SimReg8::operator=(const SimReg8& reg)
+{
+	return *this = (uint8_t)reg;
+}
+
+SimReg8& SimReg8::operator|=(uint8_t bits)
+{
+	return *this = (uint8_t)(*this | bits);
+}
+
+SimReg8& SimReg8::operator&=(uint8_t bits)
+{
+	return *this = (uint8_t)(*this & bits);
+}
+
+SimReg8& SimReg8::operator^=(uint8_t bits)
+{
+	return *this = (uint8_t)(*this ^ bits);
+}
+
+SimReg16::SimReg16(SimReg8& regH, SimReg8& regL) :
+	_regH(regH),
+	_regL(regL)
+{
+	return;
+}
+
+SimReg16::operator uint16_t() const
+{
+	uint8_t low = _regL;
+	return (_regH << 8) | low;
+}
+
+SimReg16& SimReg16::operator=(uint16_t newValue)
+{
+	_regH = (uint8_t)(newValue >> 8);
+	_regL = (uint8_t)(newValue >> 0);
+	return *this;
+}
+
+static uint8_t Reg_SREG_Read(void)
+{
+	return sregI ? _BV(SREG_I) : 0x00;
+}
+
+static void Reg_SREG_Write(uint8_t value)
+{
+	sregI = (value & _BV(SREG_I)) != 0;
+	return;
+}
+
+void Sim_Cli(void)
+{
+	sregI = false;
+	return;
+}
+
+void Sim_Sei(void)
+{
+	sregI = true;
+	return;
+}
+
+static uint8_t Reg_PIND_Read(void)
+{
+	uint8_t value;
+	
+	value = PORTD.value & DDRD.value;
+	value |= _BV(PD2) | _BV(PD3);	// idle UART lines
+	if (ctsLevel)
+		value |= _BV(PD1);
+	return value;
+}
+
+static void Reg_PORTD_Write(uint8_t value)
+{
+	PORTD.value = value;	// PD0 = RTS
+	return;
+}
+
+static void Reg_EIFR_Write(uint8_t value)
+{
+	EIFR.value &= ~value;	// flags are cleared by writing 1
+	return;
+}
+
+static uint8_t Reg_UCSR1A_Read(void)
+{
+	uint8_t value = uart.ctrlA;
+	
+	if (uart.rxCount > 0)
+		value |= _BV(RXC1) | uart.rxFlags[0];
+	if (uart.txc)
+		value |= _BV(TXC1);
+	if (! uart.udrFull)
+		value |= _BV(UDRE1);
+	return value;
+}
+
+static void Reg_UCSR1A_Write(uint8_t value)
+{
+	uart.ctrlA = value & (_BV(U2X1) | _BV(MPCM1));
+	if (value & _BV(TXC1))
+		uart.txc = false;
+	return;
+}
+
+static uint8_t Reg_UDR1_Read(void)
+{
+	if (uart.rxCount == 0)
+		return uart.rxLast;
+	
+	uart.rxLast = uart.rxFifo[0];
+	uart.rxFifo[0] = uart.rxFifo[1];
+	uart.rxFlags[0] = uart.rxFlags[1];
+	uart.rxFlags[1] = 0x00;
+	uart.rxCount --;
+	return uart.rxLast;
+}
+
+static void Reg_UDR1_Write(uint8_t value)
+{
+	if (! (UCSR1B.value & _BV(TXEN1)) || uart.udrFull)
+		return;	// ignored by the hardware
+	
+	uart.txc = false;
+	if (! uart.shifting)
+	{
+		uart.shifting = true;
+		uart.shiftData = value;
+		uart.shiftEnd = simTime + UartByteCycles();
+	}
+	else
+	{
+		uart.udrFull = true;
+		uart.udrData = value;
+	}
+	return;
+}
+
+
+// --- USART1 ---
+static uint32_t UartByteCycles(void)
+{
+	uint16_t ubrr = (UBRR1H.value << 8) | UBRR1L.value;
+	uint32_t bitCycles = (ubrr + 1) * ((uart.ctrlA & _BV(U2X1)) ? 8 : 16);
+	
+	return bitCycles * 10;	// start bit + 8 data bits + stop bit
+}
+
+static void Uart_TxDone(void)
+{
+	Module_RxByte(uart.shiftData);
+	simStats.uartTxBytes ++;
+	if (uart.udrFull)
+	{
+		uart.udrFull = false;
+		uart.shiftData = uart.udrData;
+		uart.shiftEnd += UartByteCycles();
+	}
+	else
+	{
+		uart.shifting = false;
+		uart.txc = true;
+	}
+	
+	return;
+}
+
+static void Uart_RxByte(uint8_t data)
+{
+	if (! (UCSR1B.value & _BV(RXEN1)))
+		return;
+	
+	simStats.uartRxBytes ++;
+	if (uart.rxCount >= 2)
+	{
+		// The byte in the shift register gets lost.
+		uart.rxFlags[1] |= _BV(DOR1);
+		simStats.uartRxOverruns ++;
+		return;
+	}
+	uart.rxFifo[uart.rxCount] = data;
+	uart.rxFlags[uart.rxCount] = 0x00;
+	uart.rxCount ++;
+	
+	return;
+}
+
+static void SetCts(bool level)
+{
+	uint8_t intMode;
+	
+	if (level == ctsLevel)
+		return;
+	
+	ctsLevel = level;
+	if (level)
+		ctsHighStart = simTime;
+	else
+		simStats.ctsHighCycles += simTime - ctsHighStart;
+	
+	// INT1 edge detection
+	intMode = (EICRA.value >> ISC10) & 0x03;
+	if (intMode == 0x01 || (intMode == 0x02 && ! level) || (intMode == 0x03 && level))
+		EIFR.value |= _BV(INTF1);
+	
+	return;
+}
+
+
+// --- MIDI module ---
+void SimModule_SetCtsBuffer(uint16_t bufSize, uint16_t highMark, uint16_t lowMark, uint32_t drainCycles)
+{
+	mod.bufSize = bufSize;
+	mod.bufHigh = highMark;
+	mod.bufLow = lowMark;
+	mod.drainCycles = drainCycles;
+	mod.bufFill = 0;
+	return;
+}
+
+void SimModule_SetHonorRts(bool honorRts)
+{
+	mod.honorRts = honorRts;
+	return;
+}
+
+void SimModule_SendRaw(uint64_t time, const std::vector<uint8_t>& data)
+{
+	size_t curByte;
+	
+	for (curByte = 0; curByte < data.size(); curByte ++)
+	{
+		ModTxByte txb = {time, data[curByte], -1};
+		mod.txQueue.push_back(txb);
+	}
+	return;
+}
+
+void SimModule_SendMsg(uint64_t time, uint8_t port, const std::vector<uint8_t>& msg)
+{
+	SimMidiMsg sMsg;
+	
+	if (port != SIM_PORT_REALTIME && port != mod.txPort)
+	{
+		std::vector<uint8_t> portSel;
+		portSel.push_back(0xF5);
+		portSel.push_back(1 + port);
+		SimModule_SendRaw(time, portSel);
+		mod.txPort = port;
+	}
+	SimModule_SendRaw(time, msg);
+	
+	sMsg.time = 0;
+	sMsg.port = (msg[0] >= 0xF8) ? SIM_PORT_REALTIME : mod.txPort;
+	sMsg.data = msg;
+	mod.txQueue.back().msgID = (int32_t)mod.sent.size();
+	mod.sent.push_back(sMsg);
+	
+	return;
+}
+
+const std::vector<SimMidiMsg>& SimModule_GetSent(void)
+{
+	return mod.sent;
+}
+
+const std::vector<SimMidiMsg>& SimModule_GetReceived(void)
+{
+	return mod.rcvd;
+}
+
+uint32_t SimModule_GetPortSelBytes(void)
+{
+	return mod.parser.portSelBytes;
+}
+
+uint32_t SimModule_GetParseErrors(void)
+{
+	return mod.parser.errors;
+}
+
+static void Module_UpdateBuffer(void)
+{
+	if (! mod.bufSize)
+		return;
+	
+	if (mod.bufFill == 0)
+	{
+		mod.drainTime = simTime;
+		return;
+	}
+	while(mod.bufFill > 0 && simTime - mod.drainTime >= mod.drainCycles)
+	{
+		mod.bufFill --;
+		mod.drainTime += mod.drainCycles;
+	}
+	if (ctsLevel && mod.bufFill <= mod.bufLow)
+		SetCts(false);
+	
+	return;
+}
+
+static void Module_RxByte(uint8_t data)
+{
+	SimMidiMsg msg;
+	
+	if (mod.bufSize)
+	{
+		Module_UpdateBuffer();
+		if (mod.bufFill >= mod.bufSize)
+		{
+			simStats.moduleOverflows ++;	// the module ignored CTS, so it loses the byte
+			return;
+		}
+		mod.bufFill ++;
+		if (mod.bufFill >= mod.bufHigh)
+			SetCts(true);
+	}
+	
+	if (mod.parser.Feed(data, msg))
+	{
+		msg.time = simTime;
+		mod.rcvd.push_back(msg);
+	}
+	
+	return;
+}
+
+static uint64_t Module_NextEventTime(void)
+{
+	uint64_t evtTime = UINT64_MAX;
+	
+	if (mod.txBusy)
+		evtTime = mod.txEnd;
+	else if (! mod.txQueue.empty() && ! (mod.honorRts && (PORTD.value & _BV(PD0))))
+		evtTime = (mod.txQueue.front().time > simTime) ? mod.txQueue.front().time : simTime;
+	
+	if (ctsLevel && mod.bufSize)
+	{
+		// time when the buffer has drained down to the low-water mark
+		uint64_t ctsTime = mod.drainTime + (uint64_t)(mod.bufFill - mod.bufLow) * mod.drainCycles;
+		if (ctsTime < evtTime)
+			evtTime = ctsTime;
+	}
+	
+	return evtTime;
+}
+
+static void Module_ProcessEvents(void)
+{
+	if (mod.txBusy && mod.txEnd <= simTime)
+	{
+		mod.txBusy = false;
+		Uart_RxByte(mod.txCur.data);
+		if (mod.txCur.msgID >= 0)
+			mod.sent[mod.txCur.msgID].time = simTime;
+	}
+	if (! mod.txBusy && ! mod.txQueue.empty() && mod.txQueue.front().time <= simTime)
+	{
+		// RTS HIGH = the bridge wants us to suspend the data stream
+		if (! (mod.honorRts && (PORTD.value & _BV(PD0))))
+		{
+			mod.txCur = mod.txQueue.front();
+			mod.txQueue.pop_front();
+			mod.txBusy = true;
+			mod.txEnd = simTime + SIM_MODULE_BYTE_CYC;
+		}
+	}
+	
+	if (ctsLevel)
+		Module_UpdateBuffer();
+	
+	return;
+}
+
+
+// --- simulation control ---
+static uint64_t NextEventTime(void)
+{
+	uint64_t evtTime = UINT64_MAX;
+	uint64_t subTime;
+	
+	if (uart.shifting)
+		evtTime = uart.shiftEnd;
+	subTime = Module_NextEventTime();
+	if (subTime < evtTime)
+		evtTime = subTime;
+	subTime = SimUsb_NextEventTime();
+	if (subTime < evtTime)
+		evtTime = subTime;
+	
+	return evtTime;
+}
+
+static void ProcessEvents(void)
+{
+	if (uart.shifting && uart.shiftEnd <= simTime)
+		Uart_TxDone();
+	Module_ProcessEvents();
+	SimUsb_ProcessEvents();
+	
+	return;
+}
+
+static void ServiceInterrupts(void)
+{
+	// Interrupts are checked in order of their vector number, like the AVR does.
+	while(sregI && ! inISR)
+	{
+		void (*isrFunc)(void);
+		const char* isrName;
+		uint8_t intMode = (EICRA.value >> ISC10) & 0x03;
+		
+		if ((EIMSK.value & _BV(INT1)) && (intMode ? (EIFR.value & _BV(INTF1)) : ! ctsLevel))
+		{
+			EIFR.value &= ~_BV(INTF1);
+			isrFunc = INT1_vect;	isrName = "INT1";
+		}
+		else if ((UCSR1B.value & _BV(RXCIE1)) && uart.rxCount > 0)
+		{
+			isrFunc = USART1_RX_vect;	isrName = "USART1_RX";
+		}
+		else if ((UCSR1B.value & _BV(UDRIE1)) && ! uart.udrFull)
+		{
+			isrFunc = USART1_UDRE_vect;	isrName = "USART1_UDRE";
+		}
+		else if ((UCSR1B.value & _BV(TXCIE1)) && uart.txc)
+		{
+			uart.txc = false;
+			isrFunc = USART1_TX_vect;	isrName = "USART1_TX";
+		}
+		else
+		{
+			break;
+		}
+		if (isrFunc == NULL)
+		{
+			// The AVR would jump to __bad_interrupt and reset.
+			fprintf(stderr, "Error: %s interrupt enabled without handler!\n", isrName);
+			exit(2);
+		}
+		
+		inISR = true;
+		sregI = false;
+		simTime += SIM_CYC_ISR;
+		isrFunc();
+		sregI = true;	// RETI
+		inISR = false;
+	}
+	
+	return;
+}
+
+void Sim_Advance(uint32_t cycles)
+{
+	uint64_t endTime = simTime + cycles;
+	
+	while(true)
+	{
+		uint64_t evtTime = NextEventTime();
+		if (evtTime > endTime)
+			break;
+		if (evtTime > simTime)
+			simTime = evtTime;
+		ProcessEvents();
+		ServiceInterrupts();
+	}
+	if (simTime < endTime)
+		simTime = endTime;
+	ServiceInterrupts();
+	
+	return;
+}
+
+static bool IsIdle(void)
+{
+	if (uart.shifting || uart.rxCount > 0)
+		return false;
+	if (mod.txBusy || ! mod.txQueue.empty())
+		return false;
+	if (! SimCdc_IsIdle())
+		return false;
+	return SimUsb_IsIdle();
+}
+
+bool Sim_Run(uint64_t timeout, uint64_t settleTime)
+{
+	uint64_t idleStart = 0;
+	
+	sei();	// done by init() in the Arduino core
+	SimUsb_Enumerate();
+	setup();
+	while(simTime < timeout)
+	{
+		uint64_t loopStart = simTime;
+		
+		loop();
+		simStats.loops ++;
+		if (simTime - loopStart > simStats.loopMaxCycles)
+			simStats.loopMaxCycles = simTime - loopStart;
+		Sim_Advance(SIM_CYC_LOOP);
+		
+		if (! IsIdle())
+			idleStart = 0;
+		else if (! idleStart)
+			idleStart = simTime;
+		else if (simTime - idleStart >= settleTime)
+		{
+			if (! SimCdc_SendFinalRequest())
+				break;
+			idleStart = 0;
+		}
+	}
+	if (ctsLevel)
+		simStats.ctsHighCycles += simTime - ctsHighStart;
+	
+	return (simTime < timeout);
+}
+
+void Sim_Log(const char* format, ...)
+{
+	va_list args;
+	
+	if (! simVerbose)
+		return;
+	
+	fprintf(stderr, "[%9.3f ms] ", simTime / (double)SIM_CYC_PER_MS);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	
+	return;
+}
+
+
+// --- MIDI stream parser ---
+SimSerialParser::SimSerialParser(void) :
+	errors(0),
+	portSelBytes(0),
+	_port(0),
+	_runStatus(0x00),
+	_remLen(0),
+	_portSel(false),
+	_sysEx(false)
+{
+	return;
+}
+
+bool SimSerialParser::Feed(uint8_t data, SimMidiMsg& msg)
+{
+	if (data >= 0xF8)
+	{
+		// System Real Time messages may appear anywhere and don't affect the state.
+		msg.port = SIM_PORT_REALTIME;
+		msg.data.assign(1, data);
+		return true;
+	}
+	if (_portSel)
+	{
+		_portSel = false;
+		if (data < 0x80)
+		{
+			_port = data ? (data - 1) : 0;
+			portSelBytes += 2;
+			return false;
+		}
+		errors ++;
+	}
+	
+	if (data & 0x80)
+	{
+		if (_sysEx && data == 0xF7)
+		{
+			_sysEx = false;
+			_msg.push_back(data);
+			msg.port = _port;
+			msg.data = _msg;
+			return true;
+		}
+		if (_sysEx || _remLen > 0)
+			errors ++;	// message was interrupted
+		_sysEx = false;
+		_remLen = 0;
+		_msg.assign(1, data);
+		
+		if (data < 0xF0)
+		{
+			_runStatus = data;
+			_remLen = ((data & 0xE0) == 0xC0) ? 1 : 2;
+			return false;
+		}
+		_runStatus = 0x00;
+		switch(data)
+		{
+		case 0xF0:
+			_sysEx = true;
+			return false;
+		case 0xF5:
+			_portSel = true;
+			return false;
+		case 0xF1:
+		case 0xF3:
+			_remLen = 1;
+			return false;
+		case 0xF2:
+			_remLen = 2;
+			return false;
+		case 0xF7:
+			errors ++;	// SysEx End without SysEx
+			return false;
+		default:	// F4, F6
+			msg.port = _port;
+			msg.data = _msg;
+			return true;
+		}
+	}
+	
+	if (_sysEx)
+	{
+		_msg.push_back(data);
+		return false;
+	}
+	if (_remLen == 0)
+	{
+		if (! _runStatus)
+		{
+			errors ++;
+			return false;
+		}
+		_msg.assign(1, _runStatus);
+		_remLen = ((_runStatus & 0xE0) == 0xC0) ? 1 : 2;
+	}
+	_msg.push_back(data);
+	_remLen --;
+	if (_remLen > 0)
+		return false;
+	msg.port = _port;
+	msg.data = _msg;
+	return true;
+}
@@ -0,0 +1,111 @@
+#ifndef SIMCORE_HPP
+#define SIMCORE_HPP
+
+#include <stdint.h>
+#include <vector>
+
+// All times are in CPU cycles of a 16 MHz ATmega32U4.
+#define SIM_CYC_PER_US		16
+#define SIM_CYC_PER_MS		16000
+
+#define SIM_MODULE_BYTE_CYC	4167	// one byte (10 bits) at 38400 baud, sent by the MIDI module
+
+// CPU time of the emulated Arduino API, estimated for the AVR core
+#define SIM_CYC_LOOP		40		// returning from loop() to main() and calling it again
+#define SIM_CYC_ISR			60		// interrupt entry/exit, including register saving
+#define SIM_CYC_REGISTER	2		// I/O register access
+#define SIM_CYC_DIGITALIO	60		// digitalRead/digitalWrite (pin table lookup)
+#define SIM_CYC_MILLIS		30
+#define SIM_CYC_USB_CALL	120		// USB_Send/USB_Recv/USB_Flush call, selecting the endpoint
+#define SIM_CYC_USB_BYTE	8		// each byte copied from/to the USB FIFO
+#define SIM_CYC_CDC_WRITE	3200	// Serial.print: one USB transfer on the CDC endpoint
+
+#define SIM_PORT_REALTIME	0xFF	// "port" of System Real Time messages, which aren't tied to a port
+
+struct SimMidiMsg
+{
+	uint64_t time;	// sender: when the message was sent, receiver: when it was complete
+	uint8_t port;	// serial port (set by F5) or USB cable number
+	std::vector<uint8_t> data;
+};
+
+struct SimStats
+{
+	// USART1
+	uint32_t uartTxBytes;
+	uint32_t uartRxBytes;
+	uint32_t uartRxOverruns;	// bytes lost because the 2-byte receive FIFO was full
+	uint64_t ctsHighCycles;		// time the module held CTS high
+	uint32_t moduleOverflows;	// bytes the module lost, because they were sent while CTS was high
+	// USB
+	uint32_t usbOutTxns;		// bulk OUT transactions (host -> device)
+	uint32_t usbInTxns;			// bulk IN transactions (device -> host), including zero-length packets
+	uint64_t usbOutWaitMax;		// longest time a host packet waited for a free OUT bank
+	uint64_t usbOutWaitSum;
+	uint32_t usbInStalls;		// USB_Send had to wait for a free IN bank
+	// firmware
+	uint32_t loops;
+	uint64_t loopMaxCycles;		// longest single loop() call
+	uint32_t cdcWrites;
+};
+
+extern uint64_t simTime;
+extern SimStats simStats;
+extern bool simVerbose;
+
+// --- simulation control ---
+void Sim_Advance(uint32_t cycles);	// let time pass, running hardware and interrupts
+bool Sim_Run(uint64_t timeout, uint64_t settleTime);	// run the firmware until all traffic was handled, returns false on timeout
+void Sim_Log(const char* format, ...);
+
+// --- MIDI module on the serial side ---
+// CTS model: the module has a receive buffer of "bufSize" bytes that is processed at one byte per "drainCycles".
+// CTS is raised when the buffer fills up to "highMark" and released when it drains down to "lowMark".
+void SimModule_SetCtsBuffer(uint16_t bufSize, uint16_t highMark, uint16_t lowMark, uint32_t drainCycles);
+void SimModule_SetHonorRts(bool honorRts);	// pause sending while the bridge holds RTS high
+void SimModule_SendMsg(uint64_t time, uint8_t port, const std::vector<uint8_t>& msg);	// port 0xFF = don't send Port Select
+void SimModule_SendRaw(uint64_t time, const std::vector<uint8_t>& data);
+const std::vector<SimMidiMsg>& SimModule_GetSent(void);	// time = when the last byte reached the bridge
+const std::vector<SimMidiMsg>& SimModule_GetReceived(void);
+uint32_t SimModule_GetPortSelBytes(void);	// F5 xx bytes received
+uint32_t SimModule_GetParseErrors(void);
+
+// --- USB host ---
+void SimHost_SendMsg(uint64_t time, uint8_t cable, const std::vector<uint8_t>& msg);
+void SimHost_PauseIn(uint64_t startTime, uint64_t endTime);	// the host doesn't read data from the device (e.g. busy application)
+const std::vector<SimMidiMsg>& SimHost_GetSent(void);	// time = when the host queued the message
+const std::vector<SimMidiMsg>& SimHost_GetReceived(void);
+const std::vector<uint8_t>& SimHost_GetConfigDescriptor(void);	// data sent by PluggableUSB during enumeration
+uint32_t SimHost_GetParseErrors(void);
+// The data is sent to the CDC serial port when all MIDI traffic was handled. The simulation continues until it was read.
+void SimHost_SendCdcAtEnd(const std::vector<uint8_t>& data);
+const std::vector<uint8_t>& SimHost_GetCdcData(void);	// everything the firmware wrote to the CDC serial port
+
+// --- internal interface between the simulator modules ---
+void SimUsb_Enumerate(void);
+uint64_t SimUsb_NextEventTime(void);
+void SimUsb_ProcessEvents(void);
+bool SimUsb_IsIdle(void);
+void SimCdc_Write(const uint8_t* data, size_t size);
+bool SimCdc_IsIdle(void);
+bool SimCdc_SendFinalRequest(void);	// returns true when there was a request to send
+
+// MIDI stream parser that accepts Port Select (F5 xx) and Running Status
+class SimSerialParser
+{
+public:
+	SimSerialParser(void);
+	bool Feed(uint8_t data, SimMidiMsg& msg);	// returns true when "msg" received a complete message
+	
+	uint32_t errors;
+	uint32_t portSelBytes;
+private:
+	uint8_t _port;
+	uint8_t _runStatus;
+	uint8_t _remLen;
+	bool _portSel;
+	bool _sysEx;
+	std::vector<uint8_t> _msg;
+};
+
+#endif	// SIMCORE_HPP
@@ -0,0 +1,830 @@
+// USB-Serial MIDI Firmware Simulator
+// Runs the firmware against virtual hardware and reports latency and throughput of the bridge.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "SimCore.hpp"
+#include "MidiParser.hpp"
+#include "Trace.hpp"
+
+
+#define MS(x)	((uint64_t)(x) * SIM_CYC_PER_MS)
+#define US(x)	((uint64_t)(x) * SIM_CYC_PER_US)
+
+#define RUN_TIMEOUT	MS(60000)
+#define RUN_SETTLE	MS(20)
+
+// exit codes of the scenario processes
+#define RES_OK			0
+#define RES_FAILED		1
+#define RES_KNOWN_ISSUE	2	// data loss in a scenario that isn't lossless yet - not passed, but doesn't fail the run
+
+struct Scenario
+{
+	const char* name;
+	const char* desc;
+	void (*init)(void);
+	bool lossless;	// fail when data is lost (else the loss is reported as known issue)
+};
+
+struct StreamResult
+{
+	uint32_t sent;
+	uint32_t rcvd;
+	uint32_t lost;
+	uint32_t bad;	// received messages that weren't sent
+	uint64_t latSum;
+	uint64_t latMax;
+	uint64_t firstTime;
+	uint64_t lastTime;
+};
+
+static std::vector<uint8_t> Msg(uint8_t b1, uint8_t b2, uint8_t b3);
+static std::vector<uint8_t> Msg(uint8_t b1, uint8_t b2);
+static std::vector<uint8_t> SysExMsg(size_t len, uint8_t seed);
+static void Init_UsbBurst(void);
+static void Init_UsbPaced(void);
+static void Init_UsbCts(void);
+static void Init_UsbMixed(void);
+static void Init_SerialSysEx(void);
+static void Init_BidirCts(void);
+static void Init_SerialPorts(void);
+static void Init_StatsQuery(void);
+static void Init_SerialStall(void);
+static void Init_SerialRts(void);
+static void Init_SerialRealtime(void);
+static void Init_UsbClock(void);
+static bool IsBridgeSysEx(const std::vector<uint8_t>& data);
+static bool PrintStatsReply(const std::vector<uint8_t>& data);
+static void Init_StatsQuery(void)
+{
+	std::vector<uint8_t> query(5);
+	uint32_t curMsg;
+	
+	SimModule_SetCtsBuffer(32, 24, 8, US(500));
+	for (curMsg = 0; curMsg < 500; curMsg ++)
+	{
+		uint8_t port = (curMsg / 4) % 3;
+		uint8_t note = 0x30 + (curMsg / 2) % 0x30;
+		SimHost_SendMsg(MS(1), port, Msg(0x90 | port, note, 0x40));
+		if (curMsg < 200)
+			SimModule_SendMsg(MS(1) + MS(1) * curMsg, (curMsg & 0x10) ? 4 : 0, Msg(0x80, note, 0x40));
+	}
+	SimModule_SendMsg(MS(150), 0, SysExMsg(128, 0x33));
+	
+	// bridge command "get counters" after all traffic was handled: F0 7D 55 01 F7
+	query[0] = 0xF0;	query[1] = 0x7D;	query[2] = 0x55;	query[3] = 0x01;	query[4] = 0xF7;
+	SimHost_SendMsg(MS(1500), 1, query);
+	return;
+}
+
+static uint8_t SerialPortToCable(uint8_t port);
+static StreamResult CompareStreams(const std::vector<SimMidiMsg>& sent, const std::vector<SimMidiMsg>& rcvd);
+static void PrintStream(const char* title, const StreamResult& res);
+static int RunScenario(const Scenario& scen);
+static void DumpDescriptor(void);
+static int BenchParser(void);
+static void PrintTrace(void);
+
+
+static const Scenario SCENARIOS[] =
+{
+	{"usb-burst", "2000 notes on 4 ports, queued at once", Init_UsbBurst, true},
+	{"usb-paced", "2000 notes on 1 port, one per ms", Init_UsbPaced, true},
+	{"usb-cts", "1000 notes, module raises CTS when busy", Init_UsbCts, true},
+	{"usb-mixed", "SysEx on 2 ports and notes on 2 ports, queued at once", Init_UsbMixed, true},
+	{"serial-sysex", "16 SysEx messages (256 bytes) from the module", Init_SerialSysEx, true},
+	{"bidir-cts", "SysEx from the module while sending notes with CTS", Init_BidirCts, true},
+	{"serial-ports", "notes and SysEx from the module on 3 ports, sent to 2 USB cables", Init_SerialPorts, true},
+	{"serial-stall", "SysEx dump from the module, the host stops reading for 200 ms", Init_SerialStall, false},
+	{"serial-rts", "like serial-stall, with a module that pauses while RTS is HIGH", Init_SerialRts, true},
+	{"serial-realtime", "notes, clock and Active Sensing from the module, Active Sensing is reduced", Init_SerialRealtime, true},
+	{"usb-clock", "MIDI clock from the host while SysEx dumps are sent to two ports", Init_UsbClock, true},
+	{"stats-query", "notes in both directions, then the host reads the bridge's counters", Init_StatsQuery, true},
+};
+static const size_t SCENARIO_COUNT = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+
+static bool traceDump = false;
+
+int main(int argc, char* argv[])
+{
+	int argbase;
+	bool dumpDesc = false;
+	std::vector<const Scenario*> runList;
+	size_t curScen;
+	int failCount;
+	int knownCount;
+	std::string knownNames;	// scenarios with known issues
+	
+	printf("USB-Serial MIDI Firmware Simulator\n");
+	printf("----------------------------------\n");
+	
+	argbase = 1;
+	while(argbase < argc && argv[argbase][0] == '-')
+	{
+		if (! strcmp(argv[argbase], "-v"))
+		{
+			simVerbose = true;
+		}
+		else if (! strcmp(argv[argbase], "-d"))
+		{
+			dumpDesc = true;
+		}
+		else if (! strcmp(argv[argbase], "-t"))
+		{
+#if TRACE_ENABLE
+			traceDump = true;
+#else
+			printf("The firmware was built without event trace. Build it with \"make TRACE=1\".\n");
+			return 1;
+#endif
+		}
+		else if (! strcmp(argv[argbase], "-p"))
+		{
+			return BenchParser();
+		}
+		else if (! strcmp(argv[argbase], "-l"))
+		{
+			for (curScen = 0; curScen < SCENARIO_COUNT; curScen ++)
+				printf("%-14s %s\n", SCENARIOS[curScen].name, SCENARIOS[curScen].desc);
+			return 0;
+		}
+		else
+		{
+			printf("Usage: %s [-v] [-d] [-t] [-p] [-l] [scenario ...]\n", argv[0]);
+			printf("Options:\n");
+			printf("    -v  verbose: show firmware debug output\n");
+			printf("    -d  dump the USB configuration descriptor\n");
+			printf("    -t  request the firmware's event trace after each scenario (requires TRACE=1)\n");
+			printf("    -p  benchmark the Serial -> USB parser (MidiParser.cpp) on the PC\n");
+			printf("    -l  list scenarios\n");
+			return 1;
+		}
+		argbase ++;
+	}
+	if (dumpDesc)
+	{
+		DumpDescriptor();
+		return 0;
+	}
+	
+	for (; argbase < argc; argbase ++)
+	{
+		for (curScen = 0; curScen < SCENARIO_COUNT; curScen ++)
+		{
+			if (! strcmp(argv[argbase], SCENARIOS[curScen].name))
+				break;
+		}
+		if (curScen >= SCENARIO_COUNT)
+		{
+			printf("Unknown scenario: %s\n", argv[argbase]);
+			return 1;
+		}
+		runList.push_back(&SCENARIOS[curScen]);
+	}
+	if (runList.empty())
+	{
+		for (curScen = 0; curScen < SCENARIO_COUNT; curScen ++)
+			runList.push_back(&SCENARIOS[curScen]);
+	}
+	
+	// Each scenario runs in its own process, so that it starts with a freshly initialized firmware.
+	failCount = 0;
+	knownCount = 0;
+	for (curScen = 0; curScen < runList.size(); curScen ++)
+	{
+		pid_t pid;
+		int status;
+		
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+		{
+			printf("fork failed\n");
+			return 2;
+		}
+		if (pid == 0)
+			_exit(RunScenario(*runList[curScen]));
+		if (waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status))
+			failCount ++;
+		else if (WEXITSTATUS(status) == RES_KNOWN_ISSUE)
+		{
+			knownCount ++;
+			knownNames += " ";
+			knownNames += runList[curScen]->name;
+		}
+		else if (WEXITSTATUS(status) != RES_OK)
+			failCount ++;
+	}
+	
+	printf("\n%u/%u scenarios passed", (unsigned)(runList.size() - knownCount - failCount), (unsigned)runList.size());
+	if (knownCount > 0)
+		printf(", %u known %s:%s", (unsigned)knownCount, (knownCount == 1) ? "issue" : "issues", knownNames.c_str());
+	printf("\n");
+	return failCount ? 1 : 0;
+}
+
+static std::vector<uint8_t> Msg(uint8_t b1, uint8_t b2, uint8_t b3)
+{
+	std::vector<uint8_t> msg(3);
+	msg[0] = b1;	msg[1] = b2;	msg[2] = b3;
+	return msg;
+}
+
+static std::vector<uint8_t> Msg(uint8_t b1, uint8_t b2)
+{
+	std::vector<uint8_t> msg(2);
+	msg[0] = b1;	msg[1] = b2;
+	return msg;
+}
+
+static std::vector<uint8_t> SysExMsg(size_t len, uint8_t seed)
+{
+	// Roland-style data set: F0 41 10 42 12 <data> F7
+	std::vector<uint8_t> msg(len);
+	size_t pos;
+	
+	msg[0] = 0xF0;	msg[1] = 0x41;	msg[2] = 0x10;	msg[3] = 0x42;	msg[4] = 0x12;
+	for (pos = 5; pos < len - 1; pos ++)
+		msg[pos] = (uint8_t)(seed + pos * 7) & 0x7F;
+	msg[len - 1] = 0xF7;
+	return msg;
+}
+
+static void Init_UsbBurst(void)
+{
+	uint32_t curMsg;
+	
+	for (curMsg = 0; curMsg < 2000; curMsg ++)
+	{
+		uint8_t port = curMsg % 4;
+		uint8_t note = 0x30 + (curMsg / 8) % 0x30;
+		uint8_t evt = (curMsg & 0x04) ? 0x80 : 0x90;
+		SimHost_SendMsg(MS(1), port, Msg(evt | (curMsg % 16), note, 0x40));
+	}
+	return;
+}
+
+static void Init_UsbPaced(void)
+{
+	uint32_t curMsg;
+	
+	for (curMsg = 0; curMsg < 2000; curMsg ++)
+	{
+		uint8_t note = 0x30 + (curMsg / 2) % 0x30;
+		uint8_t evt = (curMsg & 0x01) ? 0x80 : 0x90;
+		SimHost_SendMsg(MS(1 + curMsg), 0, Msg(evt, note, 0x40));
+	}
+	return;
+}
+
+static void Init_UsbCts(void)
+{
+	uint32_t curMsg;
+	
+	// The module processes 2000 bytes/s, which is less than the serial bandwidth.
+	SimModule_SetCtsBuffer(32, 24, 8, US(500));
+	for (curMsg = 0; curMsg < 1000; curMsg ++)
+	{
+		uint8_t note = 0x30 + (curMsg / 2) % 0x30;
+		uint8_t evt = (curMsg & 0x01) ? 0x80 : 0x90;
+		SimHost_SendMsg(MS(1) + US(500) * curMsg, 0, Msg(evt, note, 0x40));
+	}
+	return;
+}
+
+static void Init_UsbMixed(void)
+{
+	uint32_t curMsg;
+	
+	// SysEx messages must not be interrupted by Port Select commands.
+	for (curMsg = 0; curMsg < 400; curMsg ++)
+	{
+		uint8_t port = curMsg % 4;
+		if (port < 2)
+		{
+			SimHost_SendMsg(MS(1), port, SysExMsg(24, (uint8_t)curMsg));
+		}
+		else
+		{
+			uint8_t note = 0x30 + (curMsg / 8) % 0x30;
+			SimHost_SendMsg(MS(1), port, Msg(0x90 | port, note, 0x40));
+		}
+	}
+	return;
+}
+
+static void Init_SerialSysEx(void)
+{
+	uint32_t curMsg;
+	
+	for (curMsg = 0; curMsg < 16; curMsg ++)
+		SimModule_SendMsg(MS(1), 0, SysExMsg(256, (uint8_t)curMsg));
+	return;
+}
+
+static void Init_BidirCts(void)
+{
+	uint32_t curMsg;
+	
+	// a busy module, which raises CTS often
+	SimModule_SetCtsBuffer(16, 12, 4, MS(1));
+	for (curMsg = 0; curMsg < 16; curMsg ++)
+		SimModule_SendMsg(MS(1), 0, SysExMsg(256, (uint8_t)curMsg));
+	for (curMsg = 0; curMsg < 1000; curMsg ++)
+	{
+		uint8_t port = (curMsg / 16) % 2;
+		uint8_t note = 0x30 + (curMsg / 2) % 0x30;
+		SimHost_SendMsg(MS(1 + curMsg), port, Msg(0xC0 | (curMsg % 16), note));
+	}
+	return;
+}
+
+static void Init_SerialPorts(void)
+{
+	static const uint8_t PORTS[3] = {0, 1, 4};	// F5 01, F5 02, F5 05
+	uint32_t curMsg;
+	
+	for (curMsg = 0; curMsg < 600; curMsg ++)
+	{
+		uint8_t port = PORTS[(curMsg / 3) % 3];
+		uint8_t note = 0x30 + (curMsg / 2) % 0x30;
+		if (curMsg % 50 == 49)
+			SimModule_SendMsg(MS(1) + US(500) * curMsg, port, SysExMsg(32, (uint8_t)curMsg));
+		else
+			SimModule_SendMsg(MS(1) + US(500) * curMsg, port, Msg(0x90 | port, note, 0x40));
+	}
+	return;
+}
+
+static void Init_SerialStall(void)
+{
+	uint32_t curMsg;
+	
+	// 8 KB of SysEx data at full speed
+	for (curMsg = 0; curMsg < 32; curMsg ++)
+		SimModule_SendMsg(MS(1), 0, SysExMsg(256, (uint8_t)curMsg));
+	SimHost_PauseIn(MS(500), MS(700));
+	return;
+}
+
+static void Init_SerialRts(void)
+{
+	Init_SerialStall();
+	SimModule_SetHonorRts(true);
+	return;
+}
+
+static void Init_SerialRealtime(void)
+{
+	std::vector<uint8_t> query(5);
+	uint32_t curTime;
+	
+	// Active Sensing every 10 ms, clock every 20 ms and a note every 50 ms, for 2 seconds
+	for (curTime = 0; curTime < 2000; curTime += 10)
+	{
+		SimModule_SendMsg(MS(1 + curTime), SIM_PORT_REALTIME, std::vector<uint8_t>(1, 0xFE));
+		if (curTime % 20 == 0)
+			SimModule_SendMsg(MS(1 + curTime), SIM_PORT_REALTIME, std::vector<uint8_t>(1, 0xF8));
+		if (curTime % 50 == 0)
+			SimModule_SendMsg(MS(1 + curTime), 0, Msg(0x90, 0x30 + (curTime / 50) % 0x30, 0x40));
+	}
+	query[0] = 0xF0;	query[1] = 0x7D;	query[2] = 0x55;	query[3] = 0x01;	query[4] = 0xF7;
+	SimHost_SendMsg(MS(2100), 0, query);
+	return;
+}
+
+static void Init_UsbClock(void)
+{
+	uint32_t curTick;
+	
+	// 24 clocks per quarter note at 120 BPM for 2 seconds, with a 256-byte SysEx message every 100 ms,
+	// which keeps the serial port busy 70% of the time
+	for (curTick = 0; curTick < 96; curTick ++)
+	{
+		if (curTick % 5 == 0)
+			SimHost_SendMsg(MS(1) + US(20833) * curTick, (curTick / 5) % 2, SysExMsg(256, (uint8_t)curTick));
+		SimHost_SendMsg(MS(2) + US(20833) * curTick, 0, std::vector<uint8_t>(1, 0xF8));
+	}
+	return;
+}
+
+static uint8_t SerialPortToCable(uint8_t port)
+{
+	// must match SERIAL_IN_PORT_MAP in UsbSerialMidi.ino (port = nn - 1 for "F5 nn")
+	if (port == SIM_PORT_REALTIME)
+		return port;
+	return (port == 4) ? 1 : 0;
+}
+
+static bool IsBridgeSysEx(const std::vector<uint8_t>& data)
+{
+	return (data.size() >= 5 && data[0] == 0xF0 && data[1] == 0x7D && data[2] == 0x55);
+}
+
+static bool PrintStatsReply(const std::vector<uint8_t>& data)
+{
+	// reply format: see BRIDGE_CMD_GET_STATS in UsbSerialMidi.ino
+	std::vector<uint32_t> cntrs;
+	size_t pos;
+	bool ok;
+	
+	if (data.size() < 7 || data[3] != 0x11 || data.size() != 6 + data[5] * 5 + 1u)
+	{
+		printf("  %-12s invalid reply (%u bytes)\n", "Counters:", (unsigned)data.size());
+		return false;
+	}
+	for (pos = 6; pos + 5 <= data.size() - 1; pos += 5)
+	{
+		uint32_t val = 0;
+		uint8_t curByte;
+		for (curByte = 0; curByte < 5; curByte ++)
+			val |= (uint32_t)data[pos + curByte] << (curByte * 7);
+		cntrs.push_back(val);
+	}
+	if (cntrs.size() < 16)
+	{
+		printf("  %-12s only %u values\n", "Counters:", (unsigned)cntrs.size());
+		return false;
+	}
+	printf("  %-12s USB %u packets in (%u dropped, buffer max. %u), %u out (%u dropped)\n", "Counters:",
+		cntrs[0], cntrs[2], cntrs[4], cntrs[1], cntrs[3]);
+	printf("  %-12s UART %u bytes in (buffer max. %u), %u out (buffer max. %u), CTS high for %.1f ms, longest loop %.3f ms\n", "",
+		cntrs[5], cntrs[7], cntrs[6], cntrs[8], cntrs[9] / 1000.0, cntrs[10] / 1000.0);
+	printf("  %-12s UART receive errors: %u overruns, %u framing errors, %u bytes dropped (buffer full), RTS raised %u times\n", "",
+		cntrs[11], cntrs[12], cntrs[13], cntrs[14]);
+	printf("  %-12s %u System Real Time messages filtered\n", "", cntrs[15]);
+	printf("  %-12s bytes per port:", "");
+	for (pos = 16; pos < cntrs.size(); pos ++)
+		printf(" %u", cntrs[pos]);
+	printf("\n");
+	
+	// The request is sent after all MIDI traffic, so the serial counters must match the simulation.
+	// (Bytes that were lost before the interrupt read them aren't counted by the firmware.)
+	ok = (cntrs[5] + cntrs[11] + cntrs[13] == simStats.uartRxBytes && cntrs[6] == simStats.uartTxBytes && cntrs[11] == simStats.uartRxOverruns);
+	if (! ok)
+		printf("  %-12s UART counters don't match (simulation: %u in, %u out, %u overruns)\n", "",
+			simStats.uartRxBytes, simStats.uartTxBytes, simStats.uartRxOverruns);
+	return ok;
+}
+
+static StreamResult CompareStreams(const std::vector<SimMidiMsg>& sent, const std::vector<SimMidiMsg>& rcvd)
+{
+	StreamResult res;
+	std::vector<size_t> sentPos(0x100, 0);	// search position in "sent" for each port
+	size_t curMsg;
+	
+	memset(&res, 0x00, sizeof(StreamResult));
+	res.sent = (uint32_t)sent.size();
+	res.rcvd = (uint32_t)rcvd.size();
+	res.firstTime = sent.empty() ? 0 : sent.front().time;
+	for (curMsg = 0; curMsg < sent.size(); curMsg ++)
+	{
+		if (sent[curMsg].time < res.firstTime)
+			res.firstTime = sent[curMsg].time;
+	}
+	
+	// The order of messages must be kept for each port, but ports may be interleaved differently.
+	// Every received message must match the next sent message of its port. Skipped messages were lost.
+	for (curMsg = 0; curMsg < rcvd.size(); curMsg ++)
+	{
+		const SimMidiMsg& rMsg = rcvd[curMsg];
+		size_t pos;
+		
+		// (messages can't arrive before they were sent)
+		for (pos = sentPos[rMsg.port]; pos < sent.size() && sent[pos].time <= rMsg.time; pos ++)
+		{
+			if (sent[pos].port == rMsg.port && sent[pos].data == rMsg.data)
+				break;
+		}
+		if (pos >= sent.size() || sent[pos].time > rMsg.time)
+		{
+			res.bad ++;
+			continue;
+		}
+		sentPos[rMsg.port] = pos + 1;
+		
+		uint64_t latency = rMsg.time - sent[pos].time;
+		res.latSum += latency;
+		if (latency > res.latMax)
+			res.latMax = latency;
+		if (rMsg.time > res.lastTime)
+			res.lastTime = rMsg.time;
+	}
+	res.lost = res.sent - (res.rcvd - res.bad);
+	
+	return res;
+}
+
+static void PrintStream(const char* title, const StreamResult& res)
+{
+	uint32_t matched = res.rcvd - res.bad;
+	
+	printf("  %-12s %u sent, %u received, %u lost, %u bad", title, res.sent, res.rcvd, res.lost, res.bad);
+	if (matched > 0)
+	{
+		printf(" | latency avg %.2f ms, max %.2f ms",
+			res.latSum / (double)matched / SIM_CYC_PER_MS, res.latMax / (double)SIM_CYC_PER_MS);
+		if (res.lastTime > res.firstTime)
+			printf(" | %.0f msg/s", matched * (double)SIM_CYC_PER_MS * 1000.0 / (res.lastTime - res.firstTime));
+	}
+	printf("\n");
+	return;
+}
+
+static int RunScenario(const Scenario& scen)
+{
+	StreamResult usRes;	// USB -> Serial
+	StreamResult suRes;	// Serial -> USB
+	bool finished;
+	bool dataOK;
+	int result;
+	uint32_t parseErrs;
+	std::vector<SimMidiMsg> hostSent;
+	std::vector<SimMidiMsg> hostRcvd;
+	std::vector<SimMidiMsg> modSent;
+	std::vector<SimMidiMsg> bridgeReplies;
+	uint32_t bridgeCmds = 0;
+	bool repliesOK = true;
+	uint32_t senseSent = 0;
+	uint32_t senseRcvd = 0;
+	uint64_t senseLast = 0;
+	uint64_t senseGapMax = 0;
+	std::vector<uint64_t> clockSent;
+	size_t clockRcvd = 0;
+	uint64_t clockLatMin = 0;
+	uint64_t clockLatMax = 0;
+	size_t curMsg;
+	
+	printf("\n[%s] %s\n", scen.name, scen.desc);
+	scen.init();
+	if (traceDump)
+		SimHost_SendCdcAtEnd(std::vector<uint8_t>(1, 'T'));
+	finished = Sim_Run(RUN_TIMEOUT, RUN_SETTLE);
+	
+	// Bridge commands and their replies aren't part of the MIDI streams.
+	for (curMsg = 0; curMsg < SimHost_GetSent().size(); curMsg ++)
+	{
+		const SimMidiMsg& msg = SimHost_GetSent()[curMsg];
+		if (IsBridgeSysEx(msg.data))
+			bridgeCmds += (msg.data[3] == 0x01) ? 1 : 0;	// only "get counters" is answered
+		else
+			hostSent.push_back(msg);
+	}
+	for (curMsg = 0; curMsg < SimHost_GetReceived().size(); curMsg ++)
+	{
+		const SimMidiMsg& msg = SimHost_GetReceived()[curMsg];
+		if (IsBridgeSysEx(msg.data))
+			bridgeReplies.push_back(msg);
+		else
+			hostRcvd.push_back(msg);
+	}
+	// The firmware maps the module's ports onto USB cables.
+	// Active Sensing is thinned out by the firmware, so it is checked separately.
+	for (curMsg = 0; curMsg < SimModule_GetSent().size(); curMsg ++)
+	{
+		SimMidiMsg msg = SimModule_GetSent()[curMsg];
+		if (msg.data[0] == 0xFE)
+		{
+			senseSent ++;
+			continue;
+		}
+		msg.port = SerialPortToCable(msg.port);
+		modSent.push_back(msg);
+	}
+	for (curMsg = 0; curMsg < hostRcvd.size(); )
+	{
+		if (hostRcvd[curMsg].data[0] != 0xFE)
+		{
+			curMsg ++;
+			continue;
+		}
+		if (senseRcvd > 0 && hostRcvd[curMsg].time - senseLast > senseGapMax)
+			senseGapMax = hostRcvd[curMsg].time - senseLast;
+		senseLast = hostRcvd[curMsg].time;
+		senseRcvd ++;
+		hostRcvd.erase(hostRcvd.begin() + curMsg);
+	}
+	
+	// clock latency from the host to the module (MIDI clock can't be lost, so the n-th clock belongs to the n-th one)
+	for (curMsg = 0; curMsg < hostSent.size(); curMsg ++)
+	{
+		if (hostSent[curMsg].data[0] == 0xF8)
+			clockSent.push_back(hostSent[curMsg].time);
+	}
+	for (curMsg = 0; curMsg < SimModule_GetReceived().size(); curMsg ++)
+	{
+		const SimMidiMsg& msg = SimModule_GetReceived()[curMsg];
+		uint64_t latency;
+		
+		if (msg.data[0] != 0xF8 || clockRcvd >= clockSent.size())
+			continue;
+		latency = msg.time - clockSent[clockRcvd];
+		if (! clockRcvd || latency < clockLatMin)
+			clockLatMin = latency;
+		if (latency > clockLatMax)
+			clockLatMax = latency;
+		clockRcvd ++;
+	}
+	
+	usRes = CompareStreams(hostSent, SimModule_GetReceived());
+	suRes = CompareStreams(modSent, hostRcvd);
+	parseErrs = SimModule_GetParseErrors() + SimHost_GetParseErrors();
+	
+	if (usRes.sent > 0)
+		PrintStream("USB->Serial:", usRes);
+	if (suRes.sent > 0)
+		PrintStream("Serial->USB:", suRes);
+	printf("  %-12s %u bytes sent (%u for Port Select), %u received, %u RX overruns, CTS high for %.1f ms",
+		"UART:", simStats.uartTxBytes, SimModule_GetPortSelBytes(), simStats.uartRxBytes, simStats.uartRxOverruns,
+		simStats.ctsHighCycles / (double)SIM_CYC_PER_MS);
+	if (simStats.moduleOverflows)
+		printf(", %u bytes sent during CTS", simStats.moduleOverflows);
+	printf("\n");
+	printf("  %-12s %u OUT transactions (max. wait %.2f ms), %u IN transactions, %u IN stalls\n",
+		"USB:", simStats.usbOutTxns, simStats.usbOutWaitMax / (double)SIM_CYC_PER_MS,
+		simStats.usbInTxns, simStats.usbInStalls);
+	printf("  %-12s %u loop() calls, longest %.3f ms, %u debug prints, %.1f ms simulated\n",
+		"Firmware:", simStats.loops, simStats.loopMaxCycles / (double)SIM_CYC_PER_MS,
+		simStats.cdcWrites, simTime / (double)SIM_CYC_PER_MS);
+	if (clockRcvd > 0)
+	{
+		printf("  %-12s latency min %.3f ms, max %.3f ms, jitter %.3f ms\n", "MIDI clock:",
+			clockLatMin / (double)SIM_CYC_PER_MS, clockLatMax / (double)SIM_CYC_PER_MS,
+			(clockLatMax - clockLatMin) / (double)SIM_CYC_PER_MS);
+	}
+	if (senseSent > 0)
+	{
+		// The host must still receive Active Sensing within its 300 ms timeout.
+		printf("  %-12s %u sent, %u received, max. interval %.1f ms\n", "Act.Sensing:",
+			senseSent, senseRcvd, senseGapMax / (double)SIM_CYC_PER_MS);
+		if (! senseRcvd || senseGapMax > MS(300))
+			repliesOK = false;
+	}
+	for (curMsg = 0; curMsg < bridgeReplies.size(); curMsg ++)
+	{
+		if (! PrintStatsReply(bridgeReplies[curMsg].data))
+			repliesOK = false;
+	}
+	if (bridgeReplies.size() != bridgeCmds)
+	{
+		printf("  %-12s %u requests, %u replies\n", "Counters:", bridgeCmds, (unsigned)bridgeReplies.size());
+		repliesOK = false;
+	}
+	if (traceDump)
+		PrintTrace();
+	
+	// Lost bytes usually result in corrupted messages and parse errors, so all of them count as data loss.
+	dataOK = (usRes.lost == 0 && usRes.bad == 0 && suRes.lost == 0 && suRes.bad == 0 && parseErrs == 0 && repliesOK);
+	if (! finished)
+		result = RES_FAILED;
+	else if (! dataOK)
+		result = scen.lossless ? RES_FAILED : RES_KNOWN_ISSUE;
+	else
+		result = RES_OK;
+	if (! finished)
+		printf("  Result: FAILED (timeout)\n");
+	else if (! dataOK)
+		printf("  Result: %s (%u messages dropped, %u corrupted, %u parse errors%s)\n",
+			(result == RES_KNOWN_ISSUE) ? "known issue" : "FAILED", usRes.lost + suRes.lost, usRes.bad + suRes.bad,
+			parseErrs, repliesOK ? "" : ", wrong replies");
+	else
+		printf("  Result: OK\n");
+	fflush(stdout);
+	
+	return result;
+}
+
+static void DumpDescriptor(void)
+{
+	SimUsb_Enumerate();
+	const std::vector<uint8_t>& desc = SimHost_GetConfigDescriptor();
+	size_t pos;
+	
+	// one descriptor per line
+	for (pos = 0; pos < desc.size() && desc[pos] > 0; pos += desc[pos])
+	{
+		size_t curByte;
+		printf("%03X:", (unsigned)pos);
+		for (curByte = 0; curByte < desc[pos] && pos + curByte < desc.size(); curByte ++)
+			printf(" %02X", desc[pos + curByte]);
+		printf("\n");
+	}
+	return;
+}
+
+static int BenchParser(void)
+{
+	// a mix of what MIDI modules send: notes with running status, controllers, SysEx, Port Select and clock
+	std::vector<uint8_t> stream;
+	std::vector<uint8_t> sysEx = SysExMsg(64, 0x11);
+	SimSerialParser refParser;
+	SimMidiMsg refMsg;
+	MidiParser mp;
+	uint8_t pkts[MIDIPARSER_MAX_PACKETS * 4];
+	uint32_t refCount;
+	uint32_t msgCount;
+	uint32_t pktCount;
+	uint32_t curRep;
+	size_t pos;
+	struct timespec tStart;
+	struct timespec tEnd;
+	double nsPerByte;
+	
+	while(stream.size() < 0x100000)
+	{
+		uint8_t note = 0x30 + (stream.size() / 16) % 0x30;
+		static const uint8_t MSG_BLOCK[] =
+		{
+			0x90, 0x3C, 0x40, 0x40, 0x40, 0x43, 0x40, 0xF8, 0x3C, 0x00,	// notes with running status + clock
+			0xB1, 0x07, 0x64, 0x0A, 0x40, 0xC1, 0x05, 0xE1, 0x00, 0x40,
+			0xF5, 0x02, 0x90, 0x3C, 0x40, 0xF5, 0x01,
+		};
+		stream.insert(stream.end(), MSG_BLOCK, MSG_BLOCK + sizeof(MSG_BLOCK));
+		stream.push_back(0x80);	stream.push_back(note);	stream.push_back(0x40);
+		if ((stream.size() & 0x3FF) < sizeof(MSG_BLOCK))
+			stream.insert(stream.end(), sysEx.begin(), sysEx.end());
+	}
+	
+	// compare the number of messages with the simulator's own parser
+	refCount = 0;
+	for (pos = 0; pos < stream.size(); pos ++)
+	{
+		if (refParser.Feed(stream[pos], refMsg))
+			refCount ++;
+	}
+	MidiParser_Init(&mp);
+	msgCount = 0;
+	for (pos = 0; pos < stream.size(); pos ++)
+	{
+		uint8_t pktCnt = MidiParser_Feed(&mp, stream[pos], pkts);
+		uint8_t curPkt;
+		for (curPkt = 0; curPkt < pktCnt; curPkt ++)
+		{
+			if ((pkts[curPkt * 4] & 0x0F) != 0x04)	// count everything except SysEx start/continue
+				msgCount ++;
+		}
+	}
+	
+	pktCount = 0;
+	clock_gettime(CLOCK_MONOTONIC, &tStart);
+	for (curRep = 0; curRep < 20; curRep ++)
+	{
+		MidiParser_Init(&mp);
+		for (pos = 0; pos < stream.size(); pos ++)
+			pktCount += MidiParser_Feed(&mp, stream[pos], pkts);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tEnd);
+	nsPerByte = ((tEnd.tv_sec - tStart.tv_sec) * 1e9 + (tEnd.tv_nsec - tStart.tv_nsec)) / (20.0 * stream.size());
+	
+	printf("Parser benchmark: %u bytes, %u USB MIDI packets\n", (unsigned)stream.size(), (unsigned)(pktCount / 20));
+	printf("Messages: %u (reference parser: %u, %u errors)\n", (unsigned)msgCount, (unsigned)refCount, (unsigned)refParser.errors);
+	printf("%.2f ns per byte on this PC\n", nsPerByte);
+	return (msgCount == refCount && ! refParser.errors) ? 0 : 1;
+}
+
+static void PrintTrace(void)
+{
+	// the trace dump is the last thing that the firmware sent over the CDC serial port
+	static const char* EVT_NAMES[] =
+	{
+		"?", "Port Select from device", "Port Select to device", "CTS high", "CTS low",
+		"RX buffer overflow", "parser resync", "RX error", "RTS high", "RTS low",
+	};
+	const std::vector<uint8_t>& cdc = SimHost_GetCdcData();
+	size_t pos;
+	uint8_t evtCnt;
+	uint8_t curEvt;
+	
+	for (pos = cdc.size(); pos >= 5; pos --)
+	{
+		if (! memcmp(&cdc[pos - 5], "TRC", 3) && (pos - 5) + 5 + cdc[pos - 2] * 6 == cdc.size())
+			break;
+	}
+	if (pos < 5)
+	{
+		printf("  %-12s no dump received\n", "Trace:");
+		return;
+	}
+	pos -= 5;
+	evtCnt = cdc[pos + 3];
+	printf("  %-12s %u events, %u overwritten\n", "Trace:", evtCnt, cdc[pos + 4]);
+	pos += 5;
+	for (curEvt = 0; curEvt < evtCnt; curEvt ++, pos += 6)
+	{
+		uint32_t time = cdc[pos + 0] | (cdc[pos + 1] << 8) | (cdc[pos + 2] << 16) | ((uint32_t)cdc[pos + 3] << 24);
+		uint8_t evt = cdc[pos + 4];
+		
+		printf("    [%9.3f ms] %s (%02X)\n", time / 1000.0,
+			EVT_NAMES[(evt < sizeof(EVT_NAMES) / sizeof(EVT_NAMES[0])) ? evt : 0], cdc[pos + 5]);
+	}
+	return;
+}
@@ -0,0 +1,187 @@
+// Firmware Simulator - Arduino Serial1 (HardwareSerial on USART1)
+// This follows the AVR core. It is a separate object in the simulator library,
+// so that it is only linked when the firmware uses Serial1, like with the Arduino core.
+// (Its interrupt handlers would conflict with handlers defined by the firmware.)
+
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "SimCore.hpp"
+
+
+HardwareSerial Serial1;
+
+ISR(USART1_RX_vect)
+{
+	Serial1._rx_complete_irq();
+}
+
+ISR(USART1_UDRE_vect)
+{
+	Serial1._tx_udr_empty_irq();
+}
+
+HardwareSerial::HardwareSerial(void) :
+	_rx_buffer_head(0),
+	_rx_buffer_tail(0),
+	_tx_buffer_head(0),
+	_tx_buffer_tail(0),
+	_written(false)
+{
+	return;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+	// try U2X mode first
+	uint16_t baud_setting = (F_CPU / 4 / baud - 1) / 2;
+	
+	UCSR1A = _BV(U2X1);
+	UBRR1H = baud_setting >> 8;
+	UBRR1L = (uint8_t)baud_setting;
+	_written = false;
+	UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);	// 8N1
+	UCSR1B |= _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);
+	UCSR1B &= ~_BV(UDRIE1);
+	return;
+}
+
+void HardwareSerial::end(void)
+{
+	flush();
+	UCSR1B &= (uint8_t)~(_BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1) | _BV(UDRIE1));
+	_rx_buffer_head = _rx_buffer_tail;
+	return;
+}
+
+int HardwareSerial::available(void)
+{
+	Sim_Advance(8);
+	return ((unsigned int)(SERIAL_RX_BUFFER_SIZE + _rx_buffer_head - _rx_buffer_tail)) % SERIAL_RX_BUFFER_SIZE;
+}
+
+int HardwareSerial::peek(void)
+{
+	if (_rx_buffer_head == _rx_buffer_tail)
+		return -1;
+	return _rx_buffer[_rx_buffer_tail];
+}
+
+int HardwareSerial::read(void)
+{
+	Sim_Advance(12);
+	if (_rx_buffer_head == _rx_buffer_tail)
+		return -1;
+	
+	uint8_t c = _rx_buffer[_rx_buffer_tail];
+	_rx_buffer_tail = (uint8_t)(_rx_buffer_tail + 1) % SERIAL_RX_BUFFER_SIZE;
+	return c;
+}
+
+int HardwareSerial::availableForWrite(void)
+{
+	uint8_t head;
+	uint8_t tail;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		head = _tx_buffer_head;
+		tail = _tx_buffer_tail;
+	}
+	if (head >= tail)
+		return SERIAL_TX_BUFFER_SIZE - 1 - head + tail;
+	return tail - head - 1;
+}
+
+void HardwareSerial::flush(void)
+{
+	// If we have never written a byte, no need to flush.
+	if (! _written)
+		return;
+	
+	while(bit_is_set(UCSR1B, UDRIE1) || bit_is_clear(UCSR1A, TXC1))
+	{
+		if (bit_is_clear(SREG, SREG_I) && bit_is_set(UCSR1B, UDRIE1))
+		{
+			// Interrupts are globally disabled, but the DR empty interrupt should be enabled, so poll it.
+			if (bit_is_set(UCSR1A, UDRE1))
+				_tx_udr_empty_irq();
+		}
+	}
+	return;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+	_written = true;
+	Sim_Advance(10);
+	
+	// If the buffer and the data register is empty, just write the byte to the data register and be done.
+	if (_tx_buffer_head == _tx_buffer_tail && bit_is_set(UCSR1A, UDRE1))
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			UDR1 = c;
+			UCSR1A = (UCSR1A & (_BV(U2X1) | _BV(MPCM1))) | _BV(TXC1);
+		}
+		return 1;
+	}
+	
+	uint8_t i = (_tx_buffer_head + 1) % SERIAL_TX_BUFFER_SIZE;
+	// If the output buffer is full, there's nothing for it other than to wait for the interrupt handler to empty it a bit.
+	while(i == _tx_buffer_tail)
+	{
+		if (bit_is_clear(SREG, SREG_I))
+		{
+			// Interrupts are disabled, so we'll have to poll the data register empty flag ourselves.
+			if (bit_is_set(UCSR1A, UDRE1))
+				_tx_udr_empty_irq();
+		}
+	}
+	
+	_tx_buffer[_tx_buffer_head] = c;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		_tx_buffer_head = i;
+		UCSR1B |= _BV(UDRIE1);
+	}
+	return 1;
+}
+
+void HardwareSerial::_rx_complete_irq(void)
+{
+	if (bit_is_clear(UCSR1A, UPE1))
+	{
+		uint8_t c = UDR1;
+		uint8_t i = (unsigned int)(_rx_buffer_head + 1) % SERIAL_RX_BUFFER_SIZE;
+		
+		// If we should be storing the received character into the location just before the tail
+		// (meaning that the head would advance to the current location of the tail),
+		// we're about to overflow the buffer and so we don't write the character or advance the head.
+		if (i != _rx_buffer_tail)
+		{
+			_rx_buffer[_rx_buffer_head] = c;
+			_rx_buffer_head = i;
+		}
+	}
+	else
+	{
+		// Parity error, read byte but discard it
+		(void)(uint8_t)UDR1;
+	}
+	return;
+}
+
+void HardwareSerial::_tx_udr_empty_irq(void)
+{
+	// If interrupts are enabled, there must be more data in the output buffer. Send the next byte.
+	uint8_t c = _tx_buffer[_tx_buffer_tail];
+	_tx_buffer_tail = (_tx_buffer_tail + 1) % SERIAL_TX_BUFFER_SIZE;
+	
+	UDR1 = c;
+	// clear the TXC bit -- "can be cleared by writing a one to its bit location"
+	UCSR1A = (UCSR1A & (_BV(U2X1) | _BV(MPCM1))) | _BV(TXC1);
+	
+	if (_tx_buffer_head == _tx_buffer_tail)
+		UCSR1B &= ~_BV(UDRIE1);	// Buffer empty, so disable interrupts
+	return;
+}
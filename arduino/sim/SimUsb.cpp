@@ -0,0 +1,523 @@
+// Firmware Simulator - USB device controller and host
+
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#include <Arduino.h>
+#include <PluggableUSB.h>
+#include "SimCore.hpp"
+
+
+#define USB_BANKS			2		// the ATmega32U4 endpoints are double-buffered
+#define USB_TXN_CYC			(60 * SIM_CYC_PER_US)	// one bulk transaction with 64 bytes at full speed
+
+// Interface/endpoint numbers used by the CDC serial port, PluggableUSB modules start after it.
+#define CDC_INTERFACE_END	2
+#define CDC_ENDPOINT_END	4
+
+struct HostPacket
+{
+	uint64_t time;	// when the host queued the packet
+	uint8_t data[4];
+};
+
+static uint64_t NextFrameTime(void);
+static uint64_t InPollTime(void);
+static void Host_SendOutTxn(void);
+static void Host_ReceiveInTxn(void);
+static void Host_ParsePacket(const uint8_t* pkt);
+
+
+static struct
+{
+	// OUT endpoint (host -> device)
+	std::deque<HostPacket> outQueue;
+	bool outTxnActive;
+	uint64_t outTxnEnd;
+	std::vector<uint8_t> outTxnData;
+	std::deque<std::vector<uint8_t> > outBanks;	// banks that hold received data
+	size_t outReadPos;							// read position in outBanks.front()
+	// IN endpoint (device -> host)
+	std::vector<uint8_t> inFifo;				// bank that is currently filled by the firmware
+	std::deque<std::vector<uint8_t> > inBanks;	// banks that were released to the host
+	uint64_t inNextPoll;						// the host won't poll before this time
+	uint64_t inPauseStart;						// the host doesn't poll the IN endpoint in this time range
+	uint64_t inPauseEnd;
+	// host
+	std::vector<SimMidiMsg> sent;
+	std::vector<SimMidiMsg> rcvd;
+	std::vector<uint8_t> sysEx[0x10];			// incomplete SysEx messages per cable
+	uint32_t parseErrors;
+	std::vector<uint8_t> cfgDesc;
+} usb;
+
+
+// --- PluggableUSB ---
+PluggableUSB_& PluggableUSB(void)
+{
+	// constructed on first use, because modules plug themselves in from their static constructors
+	static PluggableUSB_ obj;
+	return obj;
+}
+
+PluggableUSB_::PluggableUSB_(void) :
+	lastIf(CDC_INTERFACE_END),
+	lastEp(CDC_ENDPOINT_END),
+	rootNode(NULL)
+{
+	return;
+}
+
+bool PluggableUSB_::plug(PluggableUSBModule* node)
+{
+	if (lastEp + node->numEndpoints > 7)	// USB_ENDPOINTS on the ATmega32U4
+		return false;
+	
+	if (rootNode == NULL)
+	{
+		rootNode = node;
+	}
+	else
+	{
+		PluggableUSBModule* current = rootNode;
+		while(current->next != NULL)
+			current = current->next;
+		current->next = node;
+	}
+	
+	node->pluggedInterface = lastIf;
+	node->pluggedEndpoint = lastEp;
+	lastIf += node->numInterfaces;
+	lastEp += node->numEndpoints;
+	return true;
+}
+
+int PluggableUSB_::getInterface(uint8_t* interfaceCount)
+{
+	PluggableUSBModule* node;
+	int sent = 0;
+	
+	for (node = rootNode; node != NULL; node = node->next)
+	{
+		int res = node->getInterface(interfaceCount);
+		if (res < 0)
+			return -1;
+		sent += res;
+	}
+	return sent;
+}
+
+int PluggableUSB_::getDescriptor(USBSetup& setup)
+{
+	PluggableUSBModule* node;
+	
+	for (node = rootNode; node != NULL; node = node->next)
+	{
+		int ret = node->getDescriptor(setup);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+bool PluggableUSB_::setup(USBSetup& setup)
+{
+	PluggableUSBModule* node;
+	
+	for (node = rootNode; node != NULL; node = node->next)
+	{
+		if (node->setup(setup))
+			return true;
+	}
+	return false;
+}
+
+void PluggableUSB_::getShortName(char* iSerialNum)
+{
+	PluggableUSBModule* node;
+	
+	for (node = rootNode; node != NULL; node = node->next)
+		iSerialNum += node->getShortName(iSerialNum);
+	*iSerialNum = 0;
+	return;
+}
+
+uint8_t PluggableUSB_::getEndpointType(uint8_t ep)
+{
+	PluggableUSBModule* node;
+	
+	for (node = rootNode; node != NULL; node = node->next)
+	{
+		if (ep >= node->pluggedEndpoint && ep < node->pluggedEndpoint + node->numEndpoints)
+			return node->endpointType[ep - node->pluggedEndpoint];
+	}
+	return 0x00;
+}
+
+
+// --- device side ---
+int USB_SendControl(uint8_t flags, const void* d, int len)
+{
+	const uint8_t* data = (const uint8_t*)d;
+	
+	usb.cfgDesc.insert(usb.cfgDesc.end(), data, data + len);
+	return len;
+}
+
+uint8_t USB_Available(uint8_t ep)
+{
+	Sim_Advance(SIM_CYC_USB_CALL / 2);
+	if (PluggableUSB().getEndpointType(ep & 0x07) != EP_TYPE_BULK_OUT || usb.outBanks.empty())
+		return 0;
+	return (uint8_t)(usb.outBanks.front().size() - usb.outReadPos);
+}
+
+int USB_Recv(uint8_t ep, void* data, int len)
+{
+	uint8_t* dataPtr = (uint8_t*)data;
+	int avail;
+	
+	Sim_Advance(SIM_CYC_USB_CALL);
+	if (PluggableUSB().getEndpointType(ep & 0x07) != EP_TYPE_BULK_OUT)
+		return -1;
+	if (usb.outBanks.empty())
+		return 0;
+	
+	avail = (int)(usb.outBanks.front().size() - usb.outReadPos);
+	if (len > avail)
+		len = avail;
+	memcpy(dataPtr, &usb.outBanks.front()[usb.outReadPos], len);
+	usb.outReadPos += len;
+	Sim_Advance(len * SIM_CYC_USB_BYTE);
+	if (usb.outReadPos >= usb.outBanks.front().size())
+	{
+		// bank is empty - release it to the host
+		usb.outBanks.pop_front();
+		usb.outReadPos = 0;
+	}
+	return len;
+}
+
+int USB_Recv(uint8_t ep)
+{
+	uint8_t data;
+	
+	if (USB_Recv(ep, &data, 1) != 1)
+		return -1;
+	return data;
+}
+
+uint8_t USB_SendSpace(uint8_t ep)
+{
+	if (usb.inBanks.size() >= USB_BANKS)
+		return 0;
+	return (uint8_t)(USB_EP_SIZE - usb.inFifo.size());
+}
+
+int USB_Send(uint8_t ep, const void* d, int len)
+{
+	// This follows the AVR core, including the zero-length packet after a full bank.
+	const uint8_t* data = (const uint8_t*)d;
+	int r = len;
+	uint8_t timeout = 250;	// ms
+	bool sendZlp = false;
+	
+	Sim_Advance(SIM_CYC_USB_CALL);
+	if (PluggableUSB().getEndpointType(ep & 0x07) != EP_TYPE_BULK_IN)
+		return -1;
+	
+	while(len || sendZlp)
+	{
+		int n = USB_SendSpace(ep);
+		if (n == 0 && (len || usb.inBanks.size() >= USB_BANKS))
+		{
+			simStats.usbInStalls ++;
+			if (! (--timeout))
+				return -1;
+			delay(1);
+			continue;
+		}
+		if (n > len)
+			n = len;
+		
+		len -= n;
+		usb.inFifo.insert(usb.inFifo.end(), data, data + n);
+		data += n;
+		Sim_Advance(n * SIM_CYC_USB_BYTE);
+		if (sendZlp)
+		{
+			usb.inBanks.push_back(usb.inFifo);
+			usb.inFifo.clear();
+			sendZlp = false;
+		}
+		else if (usb.inFifo.size() >= USB_EP_SIZE)
+		{
+			usb.inBanks.push_back(usb.inFifo);
+			usb.inFifo.clear();
+			if (len == 0)
+				sendZlp = true;
+		}
+		else if (len == 0 && (ep & TRANSFER_RELEASE))
+		{
+			usb.inBanks.push_back(usb.inFifo);
+			usb.inFifo.clear();
+		}
+	}
+	
+	return r;
+}
+
+void USB_Flush(uint8_t ep)
+{
+	Sim_Advance(SIM_CYC_USB_CALL / 2);
+	if (usb.inBanks.size() >= USB_BANKS || usb.inFifo.empty())
+		return;
+	usb.inBanks.push_back(usb.inFifo);
+	usb.inFifo.clear();
+	return;
+}
+
+
+// --- host side ---
+void SimUsb_Enumerate(void)
+{
+	uint8_t intfCount = 0;
+	size_t pos;
+	
+	usb.cfgDesc.clear();
+	PluggableUSB().getInterface(&intfCount);
+	// check the descriptor chain
+	for (pos = 0; pos < usb.cfgDesc.size(); pos += usb.cfgDesc[pos])
+	{
+		if (usb.cfgDesc[pos] < 2)
+			break;
+	}
+	if (pos != usb.cfgDesc.size())
+		fprintf(stderr, "Warning: Invalid descriptor length at offset 0x%02X!\n", (unsigned)pos);
+	Sim_Log("USB enumeration: %u interfaces, %u bytes of descriptors\n", intfCount, (unsigned)usb.cfgDesc.size());
+	
+	return;
+}
+
+static uint64_t NextFrameTime(void)
+{
+	return (simTime / SIM_CYC_PER_MS + 1) * SIM_CYC_PER_MS;
+}
+
+static uint64_t InPollTime(void)
+{
+	uint64_t pollTime = (usb.inNextPoll > simTime) ? usb.inNextPoll : simTime;
+	
+	if (pollTime >= usb.inPauseStart && pollTime < usb.inPauseEnd)
+		pollTime = usb.inPauseEnd;
+	return pollTime;
+}
+
+uint64_t SimUsb_NextEventTime(void)
+{
+	uint64_t evtTime = UINT64_MAX;
+	
+	if (usb.outTxnActive)
+		evtTime = usb.outTxnEnd;
+	else if (! usb.outQueue.empty() && usb.outBanks.size() < USB_BANKS)
+		evtTime = (usb.outQueue.front().time > simTime) ? usb.outQueue.front().time : simTime;
+	
+	if (! usb.inBanks.empty())
+	{
+		uint64_t pollTime = InPollTime();
+		if (pollTime < evtTime)
+			evtTime = pollTime;
+	}
+	
+	return evtTime;
+}
+
+void SimUsb_ProcessEvents(void)
+{
+	if (usb.outTxnActive && usb.outTxnEnd <= simTime)
+	{
+		usb.outTxnActive = false;
+		usb.outBanks.push_back(usb.outTxnData);
+	}
+	if (! usb.outTxnActive && ! usb.outQueue.empty() && usb.outQueue.front().time <= simTime &&
+		usb.outBanks.size() < USB_BANKS)
+		Host_SendOutTxn();
+	
+	if (! usb.inBanks.empty() && InPollTime() <= simTime)
+		Host_ReceiveInTxn();
+	
+	return;
+}
+
+bool SimUsb_IsIdle(void)
+{
+	return usb.outQueue.empty() && ! usb.outTxnActive && usb.outBanks.empty() && usb.inBanks.empty();
+}
+
+static void Host_SendOutTxn(void)
+{
+	// send all queued packets that fit into one bank
+	usb.outTxnData.clear();
+	while(! usb.outQueue.empty() && usb.outQueue.front().time <= simTime && usb.outTxnData.size() < USB_EP_SIZE)
+	{
+		const HostPacket& pkt = usb.outQueue.front();
+		uint64_t waitTime = simTime - pkt.time;
+		
+		usb.outTxnData.insert(usb.outTxnData.end(), pkt.data, pkt.data + 4);
+		simStats.usbOutWaitSum += waitTime;
+		if (waitTime > simStats.usbOutWaitMax)
+			simStats.usbOutWaitMax = waitTime;
+		usb.outQueue.pop_front();
+	}
+	usb.outTxnActive = true;
+	usb.outTxnEnd = simTime + USB_TXN_CYC;
+	simStats.usbOutTxns ++;
+	
+	return;
+}
+
+static void Host_ReceiveInTxn(void)
+{
+	const std::vector<uint8_t>& bank = usb.inBanks.front();
+	size_t pos;
+	
+	for (pos = 0; pos + 4 <= bank.size(); pos += 4)
+		Host_ParsePacket(&bank[pos]);
+	if (bank.size() % 4)
+		usb.parseErrors ++;
+	simStats.usbInTxns ++;
+	
+	// A short packet ends the transfer and the host driver has to submit a new one.
+	// That usually happens in the next USB frame.
+	if (bank.size() < USB_EP_SIZE)
+		usb.inNextPoll = NextFrameTime();
+	else
+		usb.inNextPoll = simTime + USB_TXN_CYC;
+	usb.inBanks.pop_front();
+	
+	return;
+}
+
+static void Host_ParsePacket(const uint8_t* pkt)
+{
+	static const uint8_t CIN_LEN[0x10] = {0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+	uint8_t cable = pkt[0] >> 4;
+	uint8_t cin = pkt[0] & 0x0F;
+	std::vector<uint8_t>& sysEx = usb.sysEx[cable];
+	SimMidiMsg msg;
+	
+	if (cin < 0x02)
+		return;	// reserved - ignored by hosts
+	
+	msg.time = simTime;
+	msg.port = cable;
+	if (cin == 0x04 || (cin >= 0x05 && cin <= 0x07 && ! sysEx.empty()) || (cin <= 0x07 && pkt[1] == 0xF0))
+	{
+		// SysEx start/continue/end
+		if (cin == 0x04 && pkt[1] == 0xF0 && ! sysEx.empty())
+		{
+			usb.parseErrors ++;	// new SysEx without end of the previous one
+			sysEx.clear();
+		}
+		sysEx.insert(sysEx.end(), &pkt[1], &pkt[1 + CIN_LEN[cin]]);
+		if (cin == 0x04)
+			return;
+		msg.data = sysEx;
+		sysEx.clear();
+		if (msg.data.front() != 0xF0 || msg.data.back() != 0xF7)
+		{
+			usb.parseErrors ++;
+			return;
+		}
+	}
+	else
+	{
+		msg.data.assign(&pkt[1], &pkt[1 + CIN_LEN[cin]]);
+		if (msg.data[0] >= 0xF8)
+			msg.port = SIM_PORT_REALTIME;
+		else if (! (msg.data[0] & 0x80))
+		{
+			usb.parseErrors ++;
+			return;
+		}
+	}
+	usb.rcvd.push_back(msg);
+	
+	return;
+}
+
+void SimHost_SendMsg(uint64_t time, uint8_t cable, const std::vector<uint8_t>& msg)
+{
+	HostPacket pkt;
+	SimMidiMsg sMsg;
+	size_t pos;
+	
+	pkt.time = time;
+	if (msg[0] == 0xF0)
+	{
+		// SysEx: 3 bytes per packet, the final packet tells the number of remaining bytes
+		for (pos = 0; pos < msg.size(); pos += 3)
+		{
+			size_t remLen = msg.size() - pos;
+			if (remLen > 3)
+			{
+				pkt.data[0] = (cable << 4) | 0x04;
+				remLen = 3;
+			}
+			else
+			{
+				pkt.data[0] = (cable << 4) | (uint8_t)(0x04 + remLen);
+			}
+			memset(&pkt.data[1], 0x00, 3);
+			memcpy(&pkt.data[1], &msg[pos], remLen);
+			usb.outQueue.push_back(pkt);
+		}
+	}
+	else
+	{
+		if (msg[0] < 0xF0)
+			pkt.data[0] = (cable << 4) | (msg[0] >> 4);
+		else if (msg[0] >= 0xF8 || msg[0] == 0xF6)
+			pkt.data[0] = (cable << 4) | ((msg[0] == 0xF6) ? 0x05 : 0x0F);
+		else
+			pkt.data[0] = (cable << 4) | (uint8_t)((msg.size() == 3) ? 0x03 : 0x02);
+		memset(&pkt.data[1], 0x00, 3);
+		memcpy(&pkt.data[1], &msg[0], msg.size());
+		usb.outQueue.push_back(pkt);
+	}
+	
+	sMsg.time = time;
+	sMsg.port = (msg[0] >= 0xF8) ? SIM_PORT_REALTIME : cable;
+	sMsg.data = msg;
+	usb.sent.push_back(sMsg);
+	
+	return;
+}
+
+void SimHost_PauseIn(uint64_t startTime, uint64_t endTime)
+{
+	usb.inPauseStart = startTime;
+	usb.inPauseEnd = endTime;
+	return;
+}
+
+const std::vector<SimMidiMsg>& SimHost_GetSent(void)
+{
+	return usb.sent;
+}
+
+const std::vector<SimMidiMsg>& SimHost_GetReceived(void)
+{
+	return usb.rcvd;
+}
+
+const std::vector<uint8_t>& SimHost_GetConfigDescriptor(void)
+{
+	return usb.cfgDesc;
+}
+
+uint32_t SimHost_GetParseErrors(void)
+{
+	return usb.parseErrors;
+}
@@ -0,0 +1,52 @@
+// Arduino AVR USB API for the firmware simulator
+#ifndef __USBAPI__
+#define __USBAPI__
+
+#include <stdint.h>
+#include "Print.h"
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned long u32;
+
+#define USB_EP_SIZE	64
+
+// flags for USB_Send/USB_SendControl
+#define TRANSFER_PGM		0x80
+#define TRANSFER_RELEASE	0x40
+#define TRANSFER_ZERO		0x20
+
+class Serial_ : public Print	// CDC serial port, output goes to the simulator log
+{
+public:
+	void begin(unsigned long baud);
+	void end(void);
+	int available(void);
+	int read(void);
+	void flush(void);
+	size_t write(uint8_t data);
+	size_t write(const uint8_t* buffer, size_t size);
+	using Print::write;
+	operator bool()	{ return true; }
+};
+extern Serial_ Serial;
+
+typedef struct
+{
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint8_t wValueL;
+	uint8_t wValueH;
+	uint16_t wIndex;
+	uint16_t wLength;
+} USBSetup;
+
+int USB_SendControl(uint8_t flags, const void* d, int len);
+uint8_t USB_Available(uint8_t ep);
+uint8_t USB_SendSpace(uint8_t ep);
+int USB_Send(uint8_t ep, const void* data, int len);
+int USB_Recv(uint8_t ep, void* data, int len);
+int USB_Recv(uint8_t ep);
+void USB_Flush(uint8_t ep);
+
+#endif	// __USBAPI__
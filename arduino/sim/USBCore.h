@@ -0,0 +1,69 @@
+// Arduino AVR USB descriptors for the firmware simulator
+#ifndef __USBCORE_H__
+#define __USBCORE_H__
+
+#include <stdint.h>
+#include "USBAPI.h"
+
+#define USB_ENDPOINT_DIRECTION_MASK	0x80
+#define USB_ENDPOINT_OUT(addr)		(lowByte((addr) | 0x00))
+#define USB_ENDPOINT_IN(addr)		(lowByte((addr) | 0x80))
+
+#define USB_ENDPOINT_TYPE_MASK			0x03
+#define USB_ENDPOINT_TYPE_CONTROL		0x00
+#define USB_ENDPOINT_TYPE_ISOCHRONOUS	0x01
+#define USB_ENDPOINT_TYPE_BULK			0x02
+#define USB_ENDPOINT_TYPE_INTERRUPT		0x03
+
+// UECFG0X values of the ATmega32U4 (EPTYPE1 = bulk, EPDIR = IN)
+#define EP_TYPE_BULK_IN		0x81
+#define EP_TYPE_BULK_OUT	0x80
+
+// The AVR has no alignment requirements, so the descriptors must be packed on the PC.
+#pragma pack(push, 1)
+
+typedef struct
+{
+	u8 len;		// 9
+	u8 dtype;	// 4
+	u8 number;
+	u8 alternate;
+	u8 numEndpoints;
+	u8 interfaceClass;
+	u8 interfaceSubClass;
+	u8 protocol;
+	u8 iInterface;
+} InterfaceDescriptor;
+
+typedef struct
+{
+	u8 len;		// 7
+	u8 dtype;	// 5
+	u8 addr;
+	u8 attr;
+	u16 packetSize;
+	u8 interval;
+} EndpointDescriptor;
+
+typedef struct	// Interface Association Descriptor
+{
+	u8 len;		// 8
+	u8 type;	// 11
+	u8 firstInterface;
+	u8 interfaceCount;
+	u8 functionClass;
+	u8 funtionSubClass;
+	u8 functionProtocol;
+	u8 iInterface;
+} IADDescriptor;
+
+#pragma pack(pop)
+
+#define D_INTERFACE(_n, _numEndpoints, _class, _subClass, _protocol) \
+	{ 9, 4, _n, 0, _numEndpoints, _class, _subClass, _protocol, 0 }
+#define D_ENDPOINT(_addr, _attr, _packetSize, _interval) \
+	{ 7, 5, _addr, _attr, _packetSize, _interval }
+#define D_IAD(_firstInterface, _count, _class, _subClass, _protocol) \
+	{ 8, 11, _firstInterface, _count, _class, _subClass, _protocol, 0 }
+
+#endif	// __USBCORE_H__
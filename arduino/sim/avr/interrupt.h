@@ -0,0 +1,14 @@
+// AVR interrupt handling for the firmware simulator
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+// Interrupt vectors are plain C functions that the simulator calls when the interrupt fires.
+#define ISR(vector, ...)	extern "C" void vector(void); extern "C" void vector(void)
+
+void Sim_Cli(void);
+void Sim_Sei(void);
+
+#define cli()	Sim_Cli()
+#define sei()	Sim_Sei()
+
+#endif	// _AVR_INTERRUPT_H_
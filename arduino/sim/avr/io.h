@@ -0,0 +1,103 @@
+// AVR I/O registers for the firmware simulator
+// Only the ATmega32U4 registers that the firmware uses are emulated.
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit)	(1 << (bit))
+#define bit_is_set(sfr, bit)	((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit)	(! ((sfr) & _BV(bit)))
+
+// An I/O register. Reading and writing it takes CPU time and may trigger hardware actions.
+class SimReg8
+{
+public:
+	typedef uint8_t (*ReadFunc)(void);
+	typedef void (*WriteFunc)(uint8_t value);
+	
+	SimReg8(ReadFunc readFunc = 0, WriteFunc writeFunc = 0);
+	operator uint8_t() const;
+	SimReg8& operator=(uint8_t value);
+	SimReg8& operator=(const SimReg8& reg);
+	SimReg8& operator|=(uint8_t value);
+	SimReg8& operator&=(uint8_t value);
+	SimReg8& operator^=(uint8_t value);
+	
+	uint8_t value;	// storage for registers without read/write function
+private:
+	ReadFunc _read;
+	WriteFunc _write;
+};
+
+class SimReg16	// 16-bit register pair, e.g. UBRR1 = UBRR1H:UBRR1L
+{
+public:
+	SimReg16(SimReg8& regH, SimReg8& regL);
+	operator uint16_t() const;
+	SimReg16& operator=(uint16_t value);
+private:
+	SimReg8& _regH;
+	SimReg8& _regL;
+};
+
+extern SimReg8 SREG;
+extern SimReg8 PINC, DDRC, PORTC;
+extern SimReg8 PIND, DDRD, PORTD;
+extern SimReg8 EICRA, EIMSK, EIFR;
+extern SimReg8 UCSR1A, UCSR1B, UCSR1C, UCSR1D;
+extern SimReg8 UBRR1L, UBRR1H;
+extern SimReg16 UBRR1;
+extern SimReg8 UDR1;
+
+// SREG
+#define SREG_I	7
+
+// port bits
+#define PC7	7
+#define PD0	0
+#define PD1	1
+#define PD2	2
+#define PD3	3
+
+// EICRA
+#define ISC11	3
+#define ISC10	2
+#define ISC01	1
+#define ISC00	0
+// EIMSK
+#define INT1	1
+#define INT0	0
+// EIFR
+#define INTF1	1
+#define INTF0	0
+
+// UCSR1A
+#define RXC1	7
+#define TXC1	6
+#define UDRE1	5
+#define FE1		4
+#define DOR1	3
+#define UPE1	2
+#define U2X1	1
+#define MPCM1	0
+// UCSR1B
+#define RXCIE1	7
+#define TXCIE1	6
+#define UDRIE1	5
+#define RXEN1	4
+#define TXEN1	3
+#define UCSZ12	2
+#define RXB81	1
+#define TXB81	0
+// UCSR1C
+#define UMSEL11	7
+#define UMSEL10	6
+#define UPM11	5
+#define UPM10	4
+#define USBS1	3
+#define UCSZ11	2
+#define UCSZ10	1
+#define UCPOL1	0
+
+#endif	// _AVR_IO_H_
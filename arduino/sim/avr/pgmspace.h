@@ -0,0 +1,22 @@
+// AVR program memory access for the firmware simulator
+// On the PC, "flash" data is ordinary memory.
+#ifndef _AVR_PGMSPACE_H_
+#define _AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P	const char*
+#define PSTR(s)	(s)
+
+#define pgm_read_byte(addr)		(*(const uint8_t*)(addr))
+#define pgm_read_word(addr)		(*(const uint16_t*)(addr))
+#define pgm_read_dword(addr)	(*(const uint32_t*)(addr))
+#define pgm_read_ptr(addr)		(*(void* const*)(addr))
+
+#define memcpy_P	memcpy
+#define strlen_P	strlen
+#define strcpy_P	strcpy
+
+#endif	// _AVR_PGMSPACE_H_
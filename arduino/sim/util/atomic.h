@@ -0,0 +1,25 @@
+// AVR atomic blocks for the firmware simulator
+#ifndef _UTIL_ATOMIC_H_
+#define _UTIL_ATOMIC_H_
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE	0
+#define ATOMIC_FORCEON		1
+
+class SimAtomicBlock	// disables interrupts for the lifetime of the object
+{
+public:
+	SimAtomicBlock(int type) : _sreg(SREG), _type(type), _done(false)	{ cli(); }
+	~SimAtomicBlock()	{ if (_type == ATOMIC_FORCEON) sei(); else SREG = _sreg; }
+	bool Once(void)	{ bool first = ! _done; _done = true; return first; }
+private:
+	uint8_t _sreg;
+	int _type;
+	bool _done;
+};
+
+#define ATOMIC_BLOCK(type)	for (SimAtomicBlock _simAtomic(type); _simAtomic.Once(); )
+
+#endif	// _UTIL_ATOMIC_H_
@@ -5,14 +5,30 @@
 #include <fstream>
 #include <string>
 #include <math.h>
+#include <vector>
+#include <algorithm>
 
-#include <windows.h>
-#include <conio.h>
+#include <string.h>
 
 #include "stdtype.h"
+#include "Platform.hpp"
 #include "MidiLib.hpp"
+#include "MidiState.hpp"
+#include "OutputQueue.hpp"
+#include "OutScheduler.hpp"
+#include "OutEncoder.hpp"
+#include "../arduino/MidiParser.hpp"
 
-struct TrackState
+struct PlayEvent	// event of the merged timeline
+{
+	UINT64 time;	// timestamp in timer ticks, relative to the start of the song
+	UINT32 tick;
+	UINT16 trkID;
+	UINT8 portID;
+	const MidiEvent* evt;
+};
+
+struct TrackCursor	// state of a track while merging
 {
 	UINT16 trkID;
 	UINT8 portID;
@@ -20,64 +36,100 @@ struct TrackState
 	midevt_const_it evtPos;
 };
 
+struct TrackCursorOrder
+{
+	// The heap functions return the "largest" element first, so invert the comparison to get the earliest event.
+	// Tracks with lower IDs win when events have the same tick.
+	bool operator()(const TrackCursor& a, const TrackCursor& b) const
+	{
+		if (a.evtPos->tick != b.evtPos->tick)
+			return a.evtPos->tick > b.evtPos->tick;
+		return a.trkID > b.trkID;
+	}
+};
+
 
-UINT8 OpenCOMPort(const char* port);
-void CloseCOMPort(void);
 static void printms(double time);
-static void RefreshTickTime(void);
+static UINT64 MicrosToTimer(UINT64 micros);
+static UINT64 TimerToMicros(UINT64 time);
+static void PrepareTimeline(void);
+static void PrepareChaseSnapshots(void);
+static UINT64 GetSongTime(void);
 static double GetPlaybackPos(void);
+static void PrintOutputStats(void);
+static void PrintSchedStats(void);
+static void PrintEncoderStats(void);
+static void ReceiveData(void);
+static void PrintRecvStats(void);
 void Start(void);
 void Stop(void);
-static void SendShortEvt(UINT8 portID, const MidiEvent* midiEvt);
-static void SendLongEvt(UINT8 portID, const MidiEvent* midiEvt);
-void DoEvent(TrackState* trkState, const MidiEvent* midiEvt);
+void SetPause(bool pause);
+void SeekTo(UINT64 songTime);
+static void SendAllNotesOff(void);
+static void FlushOutput(void);
+static UINT32 CountPortSwitches(const std::vector<const PlayEvent*>& evts, UINT8 curPort);
+static void SortTickEvents(std::vector<const PlayEvent*>& evts);
+static void QueueChunk(const OutChunk& chunk);
+static void SendShortEvt(UINT64 time, UINT8 portID, const MidiEvent* midiEvt);
+static void SendLongEvt(UINT64 time, UINT8 portID, const MidiEvent* midiEvt);
+void DoEvent(const PlayEvent* playEvt);
 void DoPlaybackStep(void);
 
 
 static MidiFile CMidi;
-static std::vector<TrackState> _trkStates;
+static MidiTempoMap _tempoMap;
+static std::vector<PlayEvent> _playEvts;	// events of all tracks, sorted by time
+static size_t _playPos;		// index of the next event to be played
 static UINT64 _tmrFreq;		// number of virtual timer ticks for 1 second
-static UINT64 _tmrStep;		// timestamp: next update of sequence processor
-static UINT64 _tmrMinStart;	// timestamp when the song should start playing (for initialization delay)
-static UINT32 _midiTempo;
-static UINT32 _curEvtTick;
-static UINT32 _nextEvtTick;
-static UINT64 _curTickTime;	// time for 1 MIDI tick at current tempo
+static UINT64 _tmrStart;	// timestamp of the song's tick 0
+static UINT64 _tmrPause;	// timestamp when playback was paused
 static bool _paused;
 static bool _playing;
-static bool _breakMidiProc;
 
-#define MAX_PORTS	4
-static HANDLE hComPort;
-static UINT8 lastPort = (UINT8)-1;
-static UINT8 maxUsedPort = 0;
+// Events are handed to the output thread this much ahead of time, so that console I/O
+// and scheduling in the main thread don't affect the timing.
+#define OUT_LOOKAHEAD_MS	50
+#define OUT_SPIN_US			200	// busy-wait time with "-spin" option
+#define OUT_TARGET_US		100	// target for the scheduling error
+static OutputQueue _outQueue;
+static OutScheduler _sched;
+static OutEncoder _encoder;
+static MidiParser _rxParser;	// parses data sent back by the device
+static UINT32 _rxMsgs;		// number of received messages (SysEx counts once)
+static UINT32 _rxSysEx;
+static UINT32 _rxRealtime;
+static std::vector<const PlayEvent*> _tickEvts;	// events that are sent at the same time
 
-static UINT64 Timer_GetFrequency(void)
-{
-	LARGE_INTEGER TempLInt;
-	QueryPerformanceFrequency(&TempLInt);
-	return TempLInt.QuadPart;
-}
-
-static UINT64 Timer_GetTime(void)
-{
-	LARGE_INTEGER lgInt;
-	QueryPerformanceCounter(&lgInt);
-	return (UINT64)lgInt.QuadPart;
-}
+#define MAX_PORTS	4
 
-static inline UINT32 ReadBE24(const UINT8* data)
-{
-	return (data[0x00] << 16) | (data[0x01] << 8) | (data[0x02] << 0);
-}
+#define CHASE_SNAP_INTERVAL	0x400	// number of events between two state snapshots
+static std::vector<MidiPortState> _chaseSnaps;	// MAX_PORTS states before every CHASE_SNAP_INTERVAL-th event
+static MidiPortState _liveState[MAX_PORTS];	// state of the MIDI module, according to the events we sent
+static UINT16 _usedChns[MAX_PORTS];	// channels that the song sends events to (bit mask)
+static UINT32 _chnQueuePos[MAX_PORTS][0x10];	// push count of the last chunk that changed the state of a channel
 
 int main(int argc, char* argv[])
 {
 	std::cout << "COM-Port MIDI Player\n";
 	std::cout << "--------------------\n";
-	if (argc < 3)
+	int argbase = 1;
+	UINT32 spinMicros = 0;
+	bool noteOffConv = false;
+	
+	for (; argbase < argc && argv[argbase][0] == '-'; argbase ++)
+	{
+		if (! strcmp(argv[argbase], "-spin"))
+			spinMicros = OUT_SPIN_US;
+		else if (! strcmp(argv[argbase], "-vel0"))
+			noteOffConv = true;
+		else
+			std::cout << "Unknown option: " << argv[argbase] << "\n";
+	}
+	if (argc < argbase + 2)
 	{
-		std::cout << "Usage: " << argv[0] << " COMPort input.mid\n";
+		std::cout << "Usage: " << argv[0] << " [-spin] [-vel0] COMPort input.mid\n";
+		std::cout << "    -spin   busy-wait for the last " << OUT_SPIN_US << " us before each event for more precise timing\n";
+		std::cout << "    -vel0   send Note Off as Note On with velocity 0 (allows running status to be used more often)\n";
 #ifdef _DEBUG
 		getchar();
 #endif
@@ -87,7 +139,7 @@ int main(int argc, char* argv[])
 	UINT8 RetVal;
 	
 	std::cout << "Opening ...\n";
-	RetVal = CMidi.LoadFile(argv[2]);
+	RetVal = CMidi.LoadFile(argv[argbase + 1]);
 	if (RetVal)
 	{
 		std::cout << "Error opening file!\n";
@@ -96,53 +148,76 @@ int main(int argc, char* argv[])
 	}
 	
 	_tmrFreq = Timer_GetFrequency();
+	PrepareTimeline();
+	std::cout << "Song length: ";
+	printms(_playEvts.empty() ? 0.0 : _tempoMap.TickToMicros(_playEvts.back().tick) / 1000000.0);
+	std::cout << "\n";
 	
-	RetVal = OpenCOMPort(argv[1]);
+	RetVal = ComPort_Open(argv[argbase + 0], COMFLOW_CTSRTS);
 	if (RetVal & 0x80)
 	{
 		std::cout << "Error opening COM Port!\n";
 		return 2;
 	}
-	
+	if (strcmp(ComPort_GetName(), argv[argbase + 0]))
+		std::cout << "Serial data is sent to " << ComPort_GetName() << "\n";
+	
+	_sched.Reset(_tmrFreq, COM_BAUDRATE);
+	_encoder.SetNoteOffConversion(noteOffConv);
+	_outQueue.SetSpinTime(spinMicros);
+	if (_outQueue.Start())
+		std::cout << "Note: The output thread runs without real-time priority.\n";
+	
+	MidiParser_Init(&_rxParser);
+	_rxMsgs = _rxSysEx = _rxRealtime = 0;
+	Console_Init();
 	Start();
 	
+	UINT64 nextPrintTime = 0;
 	std::cout << "Playing.\n";
 	while(_playing)
 	{
-		Sleep(1);
-		if (_kbhit())
+		// The output thread does the precise timing, so the main thread only needs to
+		// refill the queue well within the lookahead time.
+		Timer_Sleep(5);
+		if (Console_KeyHit())
 		{
-			int key = _getch();
+			int key = Console_GetKey();
 			if (key == 0x1B || key == 'Q' || key == 'q')
 			{
 				break;
 			}
 			else if (key == ' ')
 			{
-				_paused = ! _paused;
-				_tmrStep = 0;
+				SetPause(! _paused);
+			}
+			else if (key == ',' || key == '.')
+			{
+				// seek backwards/forwards by 5 seconds
+				INT64 seekTime = (INT64)GetSongTime() + ((key == '.') ? 5 : -5) * (INT64)_tmrFreq;
+				SeekTo((seekTime < 0) ? 0 : (UINT64)seekTime);
 			}
 		}
 		
-#if 0
-		{
-			DWORD comErrs;
-			COMSTAT comStat;
-			BOOL retB = ClearCommError(hComPort, &comErrs, &comStat);
-			if (! retB)
-				printf("ClearCommError failed\n");
-			printf("ComStat: fCtsHold %u, fDsrHold %u, fRlsdHold %u, fXoffHold %u, fXoffSent %u, fEof %u, fTxim %u  \r",
-				comStat.fCtsHold, comStat.fDsrHold, comStat.fRlsdHold, comStat.fXoffHold, comStat.fXoffSent, comStat.fEof, comStat.fTxim);
-		}
-#endif
-		PurgeComm(hComPort, PURGE_RXCLEAR);	// we don't want to receive data, so just always clear the input buffer
+		ReceiveData();
 		DoPlaybackStep();
 		
-		printms(GetPlaybackPos());	printf("    \r");
+		if (Timer_GetTime() >= nextPrintTime)
+		{
+			printms(GetPlaybackPos());	printf("    \r");
+			fflush(stdout);
+			nextPrintTime = Timer_GetTime() + _tmrFreq / 20;
+		}
 	}
 	Stop();
+	Console_Deinit();
 	
-	CloseCOMPort();
+	_outQueue.Stop();	// waits for all remaining data to be sent
+	ComPort_Close();
+	PrintEncoderStats();
+	PrintSchedStats();
+	PrintOutputStats();
+	PrintRecvStats();
 	
 	std::cout << "Cleaning ...\n";
 	CMidi.ClearAll();
@@ -154,78 +229,6 @@ int main(int argc, char* argv[])
 	return 0;
 }
 
-UINT8 OpenCOMPort(const char* port)
-{
-	BOOL retB;
-	
-	std::string fullPath = std::string("\\\\.\\") + port;
-	hComPort = CreateFileA(fullPath.c_str(), GENERIC_WRITE, 0x00, NULL, OPEN_EXISTING, /*FILE_FLAG_OVERLAPPED*/0, NULL);
-	if (hComPort == INVALID_HANDLE_VALUE)
-		return 0xFF;
-	
-	retB = SetupComm(hComPort, 1024, 1024);
-	if (! retB)
-		printf("SetupComm failed\n");
-	retB = PurgeComm(hComPort, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
-	if (! retB)
-		printf("PurgeComm failed\n");
-	
-	COMMTIMEOUTS cto;
-	cto.ReadIntervalTimeout = -1;
-	cto.ReadTotalTimeoutMultiplier = -1;
-	cto.ReadTotalTimeoutConstant = 6;
-	cto.WriteTotalTimeoutMultiplier = 0;
-	cto.WriteTotalTimeoutConstant = 0;
-	retB = SetCommTimeouts(hComPort, &cto);
-	if (! retB)
-		printf("SetCommTimeouts failed\n");
-	
-	DCB dcb;
-	GetCommState(hComPort, &dcb);
-	memset(&dcb, 0x00, sizeof(DCB));
-	dcb.DCBlength = sizeof(DCB);
-	dcb.BaudRate = 38400;
-	dcb.fBinary = 1;
-	if (0)	// Yamaha - no CTS flow control used
-	{
-		dcb.fOutxCtsFlow = 0;
-		dcb.fRtsControl = RTS_CONTROL_DISABLE;
-	}
-	else if (1)	// Roland - requires CTS/RTS flow control
-	{
-		dcb.fOutxCtsFlow = 1;
-		dcb.fRtsControl = RTS_CONTROL_ENABLE;
-	}
-	dcb.ByteSize = 8;
-	dcb.StopBits = ONESTOPBIT;
-	dcb.XoffLim = 512;
-	retB = SetCommState(hComPort, &dcb);
-	if (! retB)
-		printf("SetCommState failed\n");
-	
-	//COMMPROP comProp;
-	//retB = GetCommProperties(hComPort, &comProp);
-	//if (! retB)
-	//	printf("GetCommProperties failed\n");
-	
-	//DWORD comErrs;
-	//COMSTAT comStat;
-	//retB = ClearCommError(hComPort, &comErrs, &comStat);
-	//if (! retB)
-	//	printf("ClearCommError failed\n");
-	//printf("Initial CTS: %u\n", ! comStat.fCtsHold);
-	
-	return 0x00;
-}
-
-void CloseCOMPort(void)
-{
-	CloseHandle(hComPort);
-	hComPort = NULL;
-	
-	return;
-}
-
 static void printms(double time)
 {
 	static const UINT8 secondDigits = 2;
@@ -252,159 +255,541 @@ static void printms(double time)
 	return;
 }
 
-static void RefreshTickTime(void)
+static UINT64 MicrosToTimer(UINT64 micros)
 {
-	UINT64 tmrMul;
-	UINT64 tmrDiv;
-	
-	tmrMul = _tmrFreq * _midiTempo;
-	tmrDiv = (UINT64)1000000 * CMidi.GetMidiResolution();
-	if (tmrDiv == 0)
-		tmrDiv = 1000000;
-	_curTickTime = (tmrMul + tmrDiv / 2) / tmrDiv;
-	return;
+	// split into seconds and the remainder to prevent overflows with high-frequency timers
+	return (micros / 1000000) * _tmrFreq + ((micros % 1000000) * _tmrFreq + 500000) / 1000000;
 }
 
-static double GetPlaybackPos(void)
+static UINT64 TimerToMicros(UINT64 time)
 {
-	UINT64 curTime = Timer_GetTime();
-	INT64 tmrTick = curTime - _tmrMinStart;
-	return (double)tmrTick / (double)_tmrFreq;
+	return (time / _tmrFreq) * 1000000 + ((time % _tmrFreq) * 1000000 + _tmrFreq / 2) / _tmrFreq;
 }
 
-void Start(void)
+static void PrepareTimeline(void)
 {
-	size_t curTrk;
+	std::vector<TrackCursor> trkHeap;
+	size_t evtCount;
+	UINT16 curTrk;
 	
-	_trkStates.clear();
+	// merge all tracks into a single list of events sorted by tick
+	evtCount = 0;
 	for (curTrk = 0; curTrk < CMidi.GetTrackCount(); curTrk ++)
 	{
 		MidiTrack* mTrk = CMidi.GetTrack(curTrk);
-		TrackState mTS;
+		TrackCursor mTC;
+		
+		evtCount += mTrk->GetEventCount();
+		mTC.trkID = curTrk;
+		mTC.portID = 0;
+		mTC.endPos = mTrk->GetEventEnd();
+		mTC.evtPos = mTrk->GetEventBegin();
+		if (mTC.evtPos != mTC.endPos)
+			trkHeap.push_back(mTC);
+	}
+	std::make_heap(trkHeap.begin(), trkHeap.end(), TrackCursorOrder());
+	_tempoMap.Build(&CMidi);
+	
+	_playEvts.clear();
+	_playEvts.reserve(evtCount);
+	while(! trkHeap.empty())
+	{
+		std::pop_heap(trkHeap.begin(), trkHeap.end(), TrackCursorOrder());
+		TrackCursor* mTC = &trkHeap.back();
+		const MidiEvent* midiEvt = &*mTC->evtPos;
+		PlayEvent pEvt;
+		bool trkEnd = false;
+		
+		if (midiEvt->evtType == 0xFF)
+		{
+			switch(midiEvt->evtValA)
+			{
+			case 0x21:	// MIDI Port
+				if (midiEvt->evtDataLen >= 1)
+					mTC->portID = midiEvt->evtData[0] % MAX_PORTS;
+				break;
+			case 0x2F:	// Track End
+				trkEnd = true;
+				break;
+			}
+		}
+		
+		// tempo changes are resolved using the tempo map
+		pEvt.time = MicrosToTimer(_tempoMap.TickToMicros(midiEvt->tick));
+		pEvt.tick = midiEvt->tick;
+		pEvt.trkID = mTC->trkID;
+		pEvt.portID = mTC->portID;
+		pEvt.evt = midiEvt;
+		_playEvts.push_back(pEvt);
+		
+		++mTC->evtPos;
+		if (trkEnd || mTC->evtPos == mTC->endPos)
+			trkHeap.pop_back();
+		else
+			std::push_heap(trkHeap.begin(), trkHeap.end(), TrackCursorOrder());
+	}
+	
+	PrepareChaseSnapshots();
+	
+	return;
+}
+
+static void PrepareChaseSnapshots(void)
+{
+	MidiPortState portStates[MAX_PORTS];
+	size_t curEvt;
+	UINT8 curPort;
+	
+	// The snapshots contain only what the song has set, so that seeking doesn't send anything else.
+	for (curPort = 0; curPort < MAX_PORTS; curPort ++)
+	{
+		portStates[curPort].Invalidate();
+		_usedChns[curPort] = 0x0000;
+	}
+	_chaseSnaps.clear();
+	_chaseSnaps.reserve((_playEvts.size() / CHASE_SNAP_INTERVAL + 1) * MAX_PORTS);
+	for (curEvt = 0; curEvt < _playEvts.size(); curEvt ++)
+	{
+		const PlayEvent* pEvt = &_playEvts[curEvt];
+		
+		if ((curEvt % CHASE_SNAP_INTERVAL) == 0)
+			_chaseSnaps.insert(_chaseSnaps.end(), portStates, portStates + MAX_PORTS);
+		if (pEvt->evt->evtType < 0xF0)
+		{
+			portStates[pEvt->portID].ApplyEvent(pEvt->evt);
+			_usedChns[pEvt->portID] |= 1 << (pEvt->evt->evtType & 0x0F);
+		}
+	}
+	
+	return;
+}
+
+static bool PlayEventTickOrder(const PlayEvent& pEvt, UINT32 tick)
+{
+	return pEvt.tick < tick;
+}
+
+static bool PlayEventPrioOrder(const PlayEvent* a, const PlayEvent* b)
+{
+	UINT8 prioA = OutScheduler::GetPriority(a->evt);
+	UINT8 prioB = OutScheduler::GetPriority(b->evt);
+	
+	if (prioA != prioB)
+		return prioA < prioB;
+	// Keep events of the same port together to save port selection commands.
+	// The port that is currently selected comes first.
+	UINT8 curPort = _encoder.GetCurrentPort();
+	return (UINT8)(a->portID - curPort) < (UINT8)(b->portID - curPort);
+}
+
+static UINT64 GetSongTime(void)
+{
+	UINT64 curTime = _paused ? _tmrPause : Timer_GetTime();
+	return (curTime < _tmrStart) ? 0 : (curTime - _tmrStart);
+}
+
+static double GetPlaybackPos(void)
+{
+	return (double)GetSongTime() / (double)_tmrFreq;
+}
+
+static void PrintOutputStats(void)
+{
+	const OutputStats& stats = _outQueue.GetStats();
+	double tmr2us = 1000000.0 / (double)_tmrFreq;
+	double errAvg;
+	double errSD;
+	UINT32 inTarget;
+	UINT8 curBkt;
+	
+	if (stats.lateChunks > 0)
+		printf("Delayed by previous serial data: %u messages, max %.1f us\n", stats.lateChunks, stats.lateMax * tmr2us);
+	if (stats.chunks == 0)
+		return;
+	
+	errAvg = stats.errSum / stats.chunks;
+	errSD = sqrt(stats.errSqSum / stats.chunks - errAvg * errAvg);
+	printf("Scheduling error: %u messages, avg %.1f us, std.dev. %.1f us, min %.1f us, max %.1f us\n",
+		stats.chunks, errAvg * tmr2us, errSD * tmr2us, stats.errMin * tmr2us, stats.errMax * tmr2us);
+	
+	inTarget = 0;
+	for (curBkt = 0; curBkt < OUTHIST_BUCKETS; curBkt ++)
+	{
+		UINT32 bktCount = stats.histogram[curBkt];
 		
-		mTS.trkID = curTrk;
-		mTS.portID = 0;
-		mTS.endPos = mTrk->GetEventEnd();
-		mTS.evtPos = mTrk->GetEventBegin();
-		_trkStates.push_back(mTS);
+		if (curBkt < OUTHIST_BUCKETS - 1)
+		{
+			printf("    < %5u us: %6u (%5.1f %%)\n", OutputQueue::HIST_LIMITS[curBkt],
+				bktCount, 100.0 * bktCount / stats.chunks);
+			if (OutputQueue::HIST_LIMITS[curBkt] <= OUT_TARGET_US)
+				inTarget += bktCount;
+		}
+		else
+		{
+			printf("    >=%5u us: %6u (%5.1f %%)\n", OutputQueue::HIST_LIMITS[curBkt - 1],
+				bktCount, 100.0 * bktCount / stats.chunks);
+		}
 	}
-	_midiTempo = 500000;
-	RefreshTickTime();
+	printf("Within target (< %u us): %.1f %%\n", OUT_TARGET_US, 100.0 * inTarget / stats.chunks);
 	
-	_curEvtTick = 0;
-	_nextEvtTick = 0;
-	_tmrStep = 0;
-	_tmrMinStart = Timer_GetTime();
+	return;
+}
+
+static void ReceiveData(void)
+{
+	UINT8 rxBuf[0x100];
+	UINT8 pkts[MIDIPARSER_MAX_PACKETS * 4];
+	UINT32 rxLen;
+	UINT32 curPos;
+	UINT8 pktCnt;
+	UINT8 curPkt;
+	
+	// We don't do anything with the received data, but count the messages to see if the device sends something.
+	rxLen = ComPort_Read(rxBuf, sizeof(rxBuf));
+	for (curPos = 0; curPos < rxLen; curPos ++)
+	{
+		pktCnt = MidiParser_Feed(&_rxParser, rxBuf[curPos], pkts);
+		for (curPkt = 0; curPkt < pktCnt; curPkt ++)
+		{
+			UINT8 cin = pkts[curPkt * 4 + 0] & 0x0F;
+			
+			if (cin == 0x04)
+				continue;	// SysEx start/continue - the message is counted at its end
+			_rxMsgs ++;
+			if (cin >= 0x05 && cin <= 0x07 && pkts[curPkt * 4 + 1] != 0xF6)
+				_rxSysEx ++;
+			else if (cin == 0x0F && pkts[curPkt * 4 + 1] >= 0xF8)
+				_rxRealtime ++;
+		}
+	}
+	
+	return;
+}
+
+static void PrintRecvStats(void)
+{
+	if (_rxMsgs == 0)
+		return;
+	printf("Received: %u messages (%u SysEx, %u realtime)\n", _rxMsgs, _rxSysEx, _rxRealtime);
+	return;
+}
+
+static void PrintEncoderStats(void)
+{
+	const EncoderStats& stats = _encoder.GetStats();
+	
+	if (stats.bytes == 0)
+		return;
+	printf("Serial data: %u bytes, running status saved %u bytes (%.1f %%)\n",
+		stats.bytes, stats.rsSaved, 100.0 * stats.rsSaved / (stats.bytes + stats.rsSaved));
+	if (stats.noteOffConv > 0)
+		printf("Note Off messages sent as Note On with velocity 0: %u\n", stats.noteOffConv);
+	
+	return;
+}
+
+static void PrintSchedStats(void)
+{
+	const SchedStats& stats = _sched.GetStats();
+	double tmr2us = 1000000.0 / (double)_tmrFreq;
+	
+	printf("Serial bandwidth: %u messages, %u reordered, %u redundant controllers dropped\n",
+		stats.msgCount, stats.reordered, stats.ctrlDropped);
+	if (stats.portSelOrig > 0)
+		printf("Port selections: %u (%u in file order)\n", stats.portSelSorted, stats.portSelOrig);
+	if (stats.lateCount > 0)
+		printf("Late on the wire: %u messages, avg %.1f us, max %.1f us\n",
+			stats.lateCount, stats.lateSum / stats.lateCount * tmr2us, stats.lateMax * tmr2us);
+	
+	return;
+}
+
+void Start(void)
+{
+	UINT8 curPort;
+	
+	// We don't know what the module did before, so every controller has to be sent at least once.
+	for (curPort = 0; curPort < MAX_PORTS; curPort ++)
+		_liveState[curPort].Invalidate();
+	_playPos = 0;
+	_tmrStart = Timer_GetTime();
+	_paused = false;
 	_playing = true;
 	return;
 }
 
 void Stop(void)
+{
+	SendAllNotesOff();
+	
+	return;
+}
+
+void SeekTo(UINT64 songTime)
+{
+	MidiPortState portStates[MAX_PORTS];
+	std::vector<MidiEvent> restoreEvts;
+	std::vector<MidiEvent>::const_iterator evtIt;
+	UINT32 seekTick;
+	size_t evtID;
+	size_t snapID;
+	size_t curEvt;
+	UINT8 curPort;
+	UINT64 curTime;
+	
+	// start at the beginning of the tick that plays at "songTime", so that all of its events are sent
+	seekTick = _tempoMap.MicrosToTick(TimerToMicros(songTime));
+	songTime = MicrosToTimer(_tempoMap.TickToMicros(seekTick));
+	evtID = std::lower_bound(_playEvts.begin(), _playEvts.end(), seekTick, PlayEventTickOrder) - _playEvts.begin();
+	
+	// start with the last snapshot before the target and apply the remaining events
+	for (curPort = 0; curPort < MAX_PORTS; curPort ++)
+		portStates[curPort].Invalidate();
+	snapID = evtID / CHASE_SNAP_INTERVAL;
+	while(snapID > 0 && snapID * MAX_PORTS >= _chaseSnaps.size())
+		snapID --;
+	if (snapID * MAX_PORTS < _chaseSnaps.size())
+		std::copy(&_chaseSnaps[snapID * MAX_PORTS], &_chaseSnaps[snapID * MAX_PORTS] + MAX_PORTS, portStates);
+	for (curEvt = snapID * CHASE_SNAP_INTERVAL; curEvt < evtID; curEvt ++)
+	{
+		const PlayEvent* pEvt = &_playEvts[curEvt];
+		if (pEvt->evt->evtType < 0xF0)
+			portStates[pEvt->portID].ApplyEvent(pEvt->evt);
+	}
+	
+	// send only the events that are required to get the module into the target state
+	FlushOutput();
+	curTime = Timer_GetTime();
+	SendAllNotesOff();
+	for (curPort = 0; curPort < MAX_PORTS; curPort ++)
+	{
+		if (! _usedChns[curPort])
+			continue;	// the song doesn't use this port
+		restoreEvts.clear();
+		portStates[curPort].GetRestoreEvents(_liveState[curPort], restoreEvts, _usedChns[curPort]);
+		for (evtIt = restoreEvts.begin(); evtIt != restoreEvts.end(); ++evtIt)
+			SendShortEvt(curTime, curPort, &*evtIt);
+	}
+	
+	_playPos = evtID;
+	_tmrStart = curTime - songTime;
+	if (_paused)
+		_tmrPause = curTime;
+	return;
+}
+
+static void SendAllNotesOff(void)
 {
 	MidiEvent midEvt;
 	UINT8 curChn;
 	UINT8 curPort;
+	UINT64 curTime;
 	
+	curTime = Timer_GetTime();
 	midEvt.evtType = 0xB0;
 	midEvt.evtValA = 0x7B;
 	midEvt.evtValB = 0x00;
-	for (curPort = 0; curPort <= maxUsedPort; curPort ++)
+	for (curPort = 0; curPort <= _encoder.GetMaxUsedPort(); curPort ++)
 	{
 		for (curChn = 0; curChn < 0x10; curChn ++)
 		{
 			midEvt.evtType = (midEvt.evtType & 0xF0) | curChn;
-			SendShortEvt(curPort, &midEvt);
+			SendShortEvt(curTime, curPort, &midEvt);
 		}
 	}
 	
 	return;
 }
 
-static void SendShortEvt(UINT8 portID, const MidiEvent* midiEvt)
+static void FlushOutput(void)
 {
-	UINT8 evtType = midiEvt->evtType & 0xF0;
-	UINT8 evtLen = ((evtType & 0xE0) == 0xC0) ? 2 : 3;
-	UINT8 data[5] = {0xF5, 1 + portID, midiEvt->evtType, midiEvt->evtValA, midiEvt->evtValB};
+	UINT32 firstDropped;
+	UINT8 curPort;
+	UINT8 curChn;
 	
+	firstDropped = _outQueue.Flush();
+	// Values that were queued, but maybe not sent, are unknown now.
+	for (curPort = 0; curPort < MAX_PORTS; curPort ++)
 	{
-		DWORD comErrs;
-		COMSTAT comStat;
-		BOOL retB = ClearCommError(hComPort, &comErrs, &comStat);
-		if (! retB)
-			printf("ClearCommError failed\n");
+		for (curChn = 0; curChn < 0x10; curChn ++)
+		{
+			if ((INT32)(_chnQueuePos[curPort][curChn] - firstDropped) >= 0)
+				_liveState[curPort].InvalidateChannel(curChn);
+		}
 	}
-	if (portID == lastPort)
+	// The dropped data may have contained port selections and status bytes.
+	_encoder.Reset();
+	_sched.Flush();
+	
+	return;
+}
+
+void SetPause(bool pause)
+{
+	if (pause == _paused)
+		return;
+	
+	_paused = pause;
+	if (_paused)
 	{
-		WriteFile(hComPort, &data[2], evtLen, NULL, NULL);
+		// Drop the data that was queued ahead and continue from the current position later.
+		_tmrPause = Timer_GetTime();
+		SeekTo(GetSongTime());
 	}
 	else
-	{
-		lastPort = portID;
-		if (portID > maxUsedPort)
-			maxUsedPort = portID;
-		WriteFile(hComPort, &data[0], 2 + evtLen, NULL, NULL);
-	}
+		_tmrStart += Timer_GetTime() - _tmrPause;	// continue where we paused
 	return;
 }
 
-static void SendLongEvt(UINT8 portID, const MidiEvent* midiEvt)
+// returns the number of port selection commands needed to send the events in this order
+static UINT32 CountPortSwitches(const std::vector<const PlayEvent*>& evts, UINT8 curPort)
 {
-	std::vector<UINT8> data(3 + midiEvt->evtData.size());
-	data[0] = 0xF5;
-	data[1] = 1 + portID;
-	data[2] = midiEvt->evtType;
-	memcpy(&data[3], &midiEvt->evtData[0], midiEvt->evtData.size());
+	std::vector<const PlayEvent*>::const_iterator evtIt;
+	UINT32 switches;
 	
-	if (portID == lastPort)
+	switches = 0;
+	for (evtIt = evts.begin(); evtIt != evts.end(); ++evtIt)
 	{
-		WriteFile(hComPort, &data[2], data.size() - 2, NULL, NULL);
+		if ((*evtIt)->evt->evtType == 0xFF)
+			continue;	// Meta Events aren't sent
+		if ((*evtIt)->portID != curPort)
+		{
+			curPort = (*evtIt)->portID;
+			switches ++;
+		}
 	}
-	else
+	
+	return switches;
+}
+
+static void SortTickEvents(std::vector<const PlayEvent*>& evts)
+{
+	std::vector<UINT32> seenCtrls;
+	size_t segStart;
+	size_t segEnd;
+	size_t curEvt;
+	UINT32 reordered;
+	UINT32 dropped;
+	UINT32 portSwitches;
+	
+	portSwitches = CountPortSwitches(evts, _encoder.GetCurrentPort());
+	// Sort by priority, so that notes aren't delayed by controller sweeps.
+	// SysEx messages, pedals and Channel Mode messages split the list into segments, nothing is moved across them.
+	reordered = 0;
+	for (segStart = 0; segStart < evts.size(); segStart = segEnd + 1)
 	{
-		lastPort = portID;
-		if (portID > maxUsedPort)
-			maxUsedPort = portID;
-		WriteFile(hComPort, &data[0], data.size(), NULL, NULL);
+		for (segEnd = segStart; segEnd < evts.size(); segEnd ++)
+		{
+			if (OutScheduler::GetPriority(evts[segEnd]->evt) == SCHED_PRIO_BARRIER)
+				break;
+		}
+		if (segEnd - segStart < 2)
+			continue;
+		
+		std::vector<const PlayEvent*> segEvts(evts.begin() + segStart, evts.begin() + segEnd);
+		std::stable_sort(evts.begin() + segStart, evts.begin() + segEnd, PlayEventPrioOrder);
+		for (curEvt = segStart; curEvt < segEnd; curEvt ++)
+		{
+			if (evts[curEvt] != segEvts[curEvt - segStart])
+				reordered ++;
+		}
+		
+		// When a controller is set multiple times, only the last value has an effect.
+		seenCtrls.clear();
+		for (curEvt = segEnd; curEvt > segStart; curEvt --)
+		{
+			const PlayEvent* pEvt = evts[curEvt - 1];
+			UINT32 ctrlID;
+			
+			if (! OutScheduler::IsDroppableCtrl(pEvt->evt))
+				continue;
+			ctrlID = (pEvt->portID << 16) | (pEvt->evt->evtType << 8) | pEvt->evt->evtValA;
+			if (std::find(seenCtrls.begin(), seenCtrls.end(), ctrlID) != seenCtrls.end())
+				evts[curEvt - 1] = NULL;
+			else
+				seenCtrls.push_back(ctrlID);
+		}
 	}
+	_sched.CountReordered(reordered);
+	
+	dropped = (UINT32)(evts.end() - std::remove(evts.begin(), evts.end(), (const PlayEvent*)NULL));
+	evts.resize(evts.size() - dropped);
+	_sched.CountDropped(dropped);
+	// compare with sending the events in file order
+	_sched.CountPortSelections(CountPortSwitches(evts, _encoder.GetCurrentPort()), portSwitches);
+	
+	return;
+}
+
+static void QueueChunk(const OutChunk& chunk)
+{
+	OutChunk schedChunk = chunk;
+	
+	// send bursts at the speed of the serial link
+	schedChunk.time = _sched.ScheduleChunk(chunk.time, chunk.hdrLen + chunk.dataLen);
+	while(! _outQueue.Push(schedChunk))
+		Timer_Sleep(1);	// wait for the output thread to make space
+	return;
+}
+
+static void SendShortEvt(UINT64 time, UINT8 portID, const MidiEvent* midiEvt)
+{
+	OutChunk chunk;
+	
+	// The module may reset controllers that we don't track to values that we don't know.
+	if ((midiEvt->evtType & 0xF0) == 0xB0 && midiEvt->evtValA == 0x79)
+		_liveState[portID].InvalidateChannel(midiEvt->evtType & 0x0F);
+	else
+		_liveState[portID].ApplyEvent(midiEvt);
+	chunk.time = time;
+	_encoder.EncodeShort(portID, midiEvt, &chunk);
+	QueueChunk(chunk);
+	if ((midiEvt->evtType & 0xF0) >= 0xB0)	// everything except notes and Poly Aftertouch
+		_chnQueuePos[portID][midiEvt->evtType & 0x0F] = _outQueue.GetPushCount() - 1;
 	return;
 }
 
-void DoEvent(TrackState* trkState, const MidiEvent* midiEvt)
+static void SendLongEvt(UINT64 time, UINT8 portID, const MidiEvent* midiEvt)
 {
+	OutChunk chunk;
+	
+	_liveState[portID].Invalidate();	// a GM/GS/XG reset or parameter change can affect any value
+	chunk.time = time;
+	_encoder.EncodeLong(portID, midiEvt, &chunk);	// references the data in the MIDI file, which stays loaded during playback
+	QueueChunk(chunk);
+	return;
+}
+
+void DoEvent(const PlayEvent* playEvt)
+{
+	const MidiEvent* midiEvt = playEvt->evt;
+	UINT64 evtTime = _tmrStart + playEvt->time;
+	
 	if (midiEvt->evtType < 0xF0)
 	{
-		SendShortEvt(trkState->portID, midiEvt);
+		// GetCtrl() returns MSTATE_NONE for unknown values, so those are always sent.
+		if (OutScheduler::IsDroppableCtrl(midiEvt) &&
+			_liveState[playEvt->portID].GetCtrl(midiEvt->evtType & 0x0F, midiEvt->evtValA) == midiEvt->evtValB)
+		{
+			_sched.CountDropped(1);
+			return;	// the controller already has this value
+		}
+		SendShortEvt(evtTime, playEvt->portID, midiEvt);
 		return;
 	}
 	
 	switch(midiEvt->evtType)
 	{
 	case 0xF0:	// SysEx
-		if (midiEvt->evtData.size() < 0x03)
+		if (midiEvt->evtDataLen < 0x03)
 			break;	// ignore invalid/empty SysEx messages
-		SendLongEvt(trkState->portID, midiEvt);
+		SendLongEvt(evtTime, playEvt->portID, midiEvt);
 		break;
 	case 0xF7:	// SysEx continuation
-		SendLongEvt(trkState->portID, midiEvt);
+		SendLongEvt(evtTime, playEvt->portID, midiEvt);
 		break;
 	case 0xFF:	// Meta Event
-		switch(midiEvt->evtValA)
-		{
-		//case 0x20:	// Channel Prefix
-		case 0x21:	// MIDI Port
-			if (midiEvt->evtData.size() >= 1)
-			{
-				trkState->portID = midiEvt->evtData[0] % MAX_PORTS;
-			}
-			break;
-		case 0x2F:	// Track End
-			trkState->evtPos = trkState->endPos;
-			break;
-		case 0x51:	// Tempo
-			_midiTempo = ReadBE24(&midiEvt->evtData[0x00]);
-			RefreshTickTime();
-			break;
-		}
+		// MIDI Port and Tempo events were already applied by PrepareTimeline() and the tempo map.
 		break;
 	}
 	
@@ -417,62 +802,43 @@ void DoPlaybackStep(void)
 		return;
 	
 	UINT64 curTime;
+	UINT64 queueEndTime;
 	
 	curTime = Timer_GetTime();
-	if (! _tmrStep && curTime < _tmrMinStart)
-		_tmrStep = _tmrMinStart;	// handle "initial delay" after starting the song
-	if (curTime < _tmrStep)
-		return;
-	
-	while(_playing)
+	queueEndTime = curTime + _tmrFreq * OUT_LOOKAHEAD_MS / 1000;
+	while(_playPos < _playEvts.size())
 	{
-		UINT32 minNextTick = (UINT32)-1;
+		const PlayEvent* pEvt = &_playEvts[_playPos];
+		UINT64 evtTime = _tmrStart + pEvt->time;
+		size_t grpEnd;
+		size_t freeCnt;
+		std::vector<const PlayEvent*>::const_iterator evtIt;
 		
-		size_t curTrk;
-		for (curTrk = 0; curTrk < _trkStates.size(); curTrk ++)
-		{
-			TrackState* mTS = &_trkStates[curTrk];
-			if (mTS->evtPos == mTS->endPos)
-				continue;
-			
-			if (mTS->evtPos->tick < minNextTick)
-				minNextTick = mTS->evtPos->tick;
-		}
-		if (minNextTick == (UINT32)-1)	// -1 -> end of sequence
-		{
-			_playing = false;
-			break;
-		}
+		if (queueEndTime < evtTime)
+			return;	// exit the loop when going beyond the lookahead window
 		
-		if (minNextTick > _nextEvtTick)
+		// process all events with the same timestamp at once, so that they can be reordered
+		for (grpEnd = _playPos + 1; grpEnd < _playEvts.size(); grpEnd ++)
 		{
-			// next event has higher tick number than "next tick to wait for" (_nextEvtTick)
-			// -> set new values for "update time" (system time: _tmrStep, event tick: _nextEvtTick)
-			_tmrStep += (minNextTick - _nextEvtTick) * _curTickTime;
-			_nextEvtTick = minNextTick;
+			if (_playEvts[grpEnd].time != pEvt->time)
+				break;
 		}
-		
-		if (curTime < _tmrStep)
-			break;	// exit the loop when going beyond "current time"
-		if (_tmrStep + _tmrFreq * 1 < curTime)
-			_tmrStep = curTime;	// reset time when lagging behind >= 1 second
-		
-		_breakMidiProc = false;
-		_curEvtTick = _nextEvtTick;
-		for (curTrk = 0; curTrk < _trkStates.size(); curTrk ++)
+		freeCnt = _outQueue.GetFreeCount();
+		if (grpEnd - _playPos > freeCnt)
 		{
-			TrackState* mTS = &_trkStates[curTrk];
-			while(mTS->evtPos != mTS->endPos && mTS->evtPos->tick <= _nextEvtTick)
-			{
-				DoEvent(mTS, &*mTS->evtPos);
-				if (_breakMidiProc || mTS->evtPos == mTS->endPos)
-					break;
-				++mTS->evtPos;
-			}
-			if (_breakMidiProc)
-				break;
+			if (! _outQueue.IsEmpty())
+				return;	// queue is full - try again later
+			grpEnd = _playPos + freeCnt;	// the group is larger than the whole queue
 		}
+		
+		_tickEvts.clear();
+		for (; _playPos < grpEnd; _playPos ++)
+			_tickEvts.push_back(&_playEvts[_playPos]);
+		SortTickEvents(_tickEvts);
+		for (evtIt = _tickEvts.begin(); evtIt != _tickEvts.end(); ++evtIt)
+			DoEvent(*evtIt);
 	}
+	_playing = false;	// end of sequence
 	
 	return;
 }
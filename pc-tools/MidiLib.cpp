@@ -2,7 +2,6 @@
 
 #include <iostream>
 #include <fstream>
-#include <list>
 #include <vector>
 #include <algorithm>
 #include <string.h>
@@ -14,15 +13,82 @@
 #define FCC_MTHD	0x6468544D	// 'MThd'
 #define FCC_MTRK	0x6B72544D	// 'MTrk'
 
+#define ARENA_BLOCK_SIZE	0x1000
+
 
-static UINT16 ReadBE16(FILE* infile);
 static UINT32 ReadBE32(FILE* infile);
-static UINT32 ReadMidiValue(FILE* infile);
+static inline UINT16 ReadBE16(const UINT8* data);
+static inline UINT32 ReadBE32(const UINT8* data);
+static inline UINT32 ReadLE32(const UINT8* data);
+static inline UINT8 ReadByte(const UINT8** curPos, const UINT8* dataEnd);
+static UINT32 ReadMidiValue(const UINT8** curPos, const UINT8* dataEnd);
+static UINT8 ReadFileData(FILE* infile, std::vector<UINT8>& fileData);
+static bool EventTickOrder(const MidiEvent& evt, UINT32 tick);
 static void WriteBE16(FILE* outfile, UINT16 Value);
 static void WriteBE32(FILE* outfile, UINT32 Value);
 static void WriteMidiValue(FILE* outfile, UINT32 Value);
 
 
+// --- MidiDataArena Class ---
+MidiDataArena::MidiDataArena(void)
+{
+	_curBlock = NULL;
+	_curPos = 0;
+	_curSize = 0;
+	
+	return;
+}
+
+MidiDataArena::~MidiDataArena()
+{
+	Clear();
+	
+	return;
+}
+
+UINT8* MidiDataArena::Alloc(UINT32 DataLen)
+{
+	UINT8* retPtr;
+	
+	if (! DataLen)
+		return NULL;
+	
+	if (DataLen > ARENA_BLOCK_SIZE / 4)
+	{
+		// large data gets its own block, so that the current block can still be filled up
+		retPtr = new UINT8[DataLen];
+		_blocks.push_back(retPtr);
+		return retPtr;
+	}
+	
+	if (_curPos + DataLen > _curSize)
+	{
+		_curBlock = new UINT8[ARENA_BLOCK_SIZE];
+		_curPos = 0;
+		_curSize = ARENA_BLOCK_SIZE;
+		_blocks.push_back(_curBlock);
+	}
+	retPtr = &_curBlock[_curPos];
+	_curPos += DataLen;
+	
+	return retPtr;
+}
+
+void MidiDataArena::Clear(void)
+{
+	std::vector<UINT8*>::iterator blkIt;
+	
+	for (blkIt = _blocks.begin(); blkIt != _blocks.end(); ++blkIt)
+		delete[] *blkIt;
+	_blocks.clear();
+	_curBlock = NULL;
+	_curPos = 0;
+	_curSize = 0;
+	
+	return;
+}
+
+
 // --- MidiTrack Class ---
 MidiTrack::MidiTrack(void)
 {
@@ -37,37 +103,72 @@ MidiTrack::~MidiTrack()
 UINT8 MidiTrack::ReadFromFile(FILE* infile)
 {
 	UINT32 TempLng;
-	UINT32 TrkPos;
-	UINT32 TrkEnd;
-	UINT8 LastEvt;
-	UINT8 CurEvt;
-	UINT8 EvtVal;
-	UINT32 CurTick;
+	UINT32 TrkLen;
+	UINT8* TrkData;
 	
 	fread(&TempLng, 0x04, 1, infile);
 	if (TempLng != FCC_MTRK)
 		return 0x10;
 	
-	TempLng = ReadBE32(infile);	// Read Track Length
-	TrkPos = (UINT32)ftell(infile);
-	TrkEnd = TrkPos + TempLng;
+	TrkLen = ReadBE32(infile);	// Read Track Length
 	
 	_events.clear();
-	//_events.reserve(TempLng / 4);
+	_dataStore.Clear();
+	
+	// read the whole track at once and let the events refer to it
+	TrkData = _dataStore.Alloc(TrkLen);
+	if (TrkData == NULL)
+		return 0x00;	// empty track
+	TrkLen = (UINT32)fread(TrkData, 0x01, TrkLen, infile);
+	
+	return ParseEvents(TrkData, TrkData + TrkLen);
+}
+
+UINT8 MidiTrack::ReadFromMemory(UINT32 DataLen, const UINT8* Data, UINT32* ReadLen)
+{
+	UINT32 TrkLen;
+	
+	if (DataLen < 0x08 || ReadLE32(&Data[0x00]) != FCC_MTRK)
+		return 0x10;
+	
+	TrkLen = ReadBE32(&Data[0x04]);	// Read Track Length
+	if (TrkLen > DataLen - 0x08)
+		TrkLen = DataLen - 0x08;	// truncated file
+	if (ReadLen != NULL)
+		*ReadLen = 0x08 + TrkLen;
+	
+	_events.clear();
+	_dataStore.Clear();
+	
+	return ParseEvents(&Data[0x08], &Data[0x08 + TrkLen]);
+}
+
+UINT8 MidiTrack::ParseEvents(const UINT8* data, const UINT8* dataEnd)
+{
+	const UINT8* CurPos;
+	UINT8 LastEvt;
+	UINT8 CurEvt;
+	UINT8 EvtVal;
+	UINT32 CurTick;
+	UINT32 DataLen;
+	
+	_events.reserve((dataEnd - data) / 4);
 	
 	LastEvt = 0x00;
+	EvtVal = 0x00;
 	CurTick = 0;
+	CurPos = data;
 	// read events
-	while(! feof(infile) && (UINT32)ftell(infile) < TrkEnd)
+	while(CurPos < dataEnd)
 	{
 		MidiEvent* newEvt;
 		bool rsUse;
 		
-		CurTick += ReadMidiValue(infile);
-		if (feof(infile))
+		CurTick += ReadMidiValue(&CurPos, dataEnd);
+		if (CurPos >= dataEnd)
 			break;
 		
-		fread(&CurEvt, 0x01, 1, infile);
+		CurEvt = *CurPos++;
 		if (CurEvt < 0x80)
 		{
 			if (LastEvt < 0x80 || LastEvt >= 0xF0)
@@ -81,7 +182,7 @@ UINT8 MidiTrack::ReadFromFile(FILE* infile)
 			if (CurEvt < 0xF0)
 			{
 				LastEvt = CurEvt;
-				fread(&EvtVal, 0x01, 1, infile);
+				EvtVal = ReadByte(&CurPos, dataEnd);
 			}
 			rsUse = false;
 		}
@@ -92,6 +193,10 @@ UINT8 MidiTrack::ReadFromFile(FILE* infile)
 		newEvt->tick = CurTick;
 		newEvt->rsUse = rsUse;
 		newEvt->evtType = CurEvt;
+		newEvt->evtValA = 0x00;
+		newEvt->evtValB = 0x00;
+		newEvt->evtDataLen = 0;
+		newEvt->evtData = NULL;
 		switch(CurEvt & 0xF0)
 		{
 		case 0x80:
@@ -100,29 +205,31 @@ UINT8 MidiTrack::ReadFromFile(FILE* infile)
 		case 0xB0:
 		case 0xE0:
 			newEvt->evtValA = EvtVal;
-			fread(&newEvt->evtValB, 0x01, 1, infile);
+			newEvt->evtValB = ReadByte(&CurPos, dataEnd);
 			break;
 		case 0xC0:
 		case 0xD0:
 			newEvt->evtValA = EvtVal;
-			newEvt->evtValB = 0x00;
 			break;
 		case 0xF0:
 			switch(CurEvt)
 			{
 			case 0xFF:
-				fread(&newEvt->evtValA, 0x01, 1, infile);
+				newEvt->evtValA = ReadByte(&CurPos, dataEnd);
 				// fall through
 			case 0xF0:
 			case 0xF7:
-				newEvt->evtData.resize(ReadMidiValue(infile));
-				if (newEvt->evtData.size())
-					fread(&newEvt->evtData[0x00], 0x01, newEvt->evtData.size(), infile);
+				DataLen = ReadMidiValue(&CurPos, dataEnd);
+				if (DataLen > (UINT32)(dataEnd - CurPos))
+					DataLen = (UINT32)(dataEnd - CurPos);
+				// refer to the data instead of copying it
+				newEvt->evtDataLen = DataLen;
+				newEvt->evtData = CurPos;
+				CurPos += DataLen;
 				break;
 			}
 		}
 	}
-	fseek(infile, TrkEnd, SEEK_SET);
 	
 	return 0x00;
 }
@@ -179,9 +286,9 @@ UINT8 MidiTrack::WriteToFile(FILE* outfile) const
 				// fall through
 			case 0xF0:
 			case 0xF7:
-				WriteMidiValue(outfile, evtIt->evtData.size());
-				if (evtIt->evtData.size() > 0)
-					fwrite(&evtIt->evtData[0x00], 0x01, evtIt->evtData.size(), outfile);
+				WriteMidiValue(outfile, evtIt->evtDataLen);
+				if (evtIt->evtDataLen > 0)
+					fwrite(evtIt->evtData, 0x01, evtIt->evtDataLen, outfile);
 				break;
 			}
 		}
@@ -259,13 +366,9 @@ midevt_iterator MidiTrack::GetEventFromTick(UINT32 tick)
 	if (tick >= GetTickCount())
 		return _events.end();
 	
-	for (evtIt = _events.begin(); evtIt != _events.end(); ++evtIt)
-	{
-		if (evtIt->tick >= tick)
-			return evtIt;
-	}
-	
-	return _events.end();
+	// events are sorted by tick, so a binary search can be used
+	evtIt = std::lower_bound(_events.begin(), _events.end(), tick, EventTickOrder);
+	return evtIt;
 }
 
 /*static*/ MidiEvent MidiTrack::CreateEvent_Std(UINT8 Event, UINT8 Val1, UINT8 Val2)
@@ -277,7 +380,8 @@ midevt_iterator MidiTrack::GetEventFromTick(UINT32 tick)
 	newEvt.evtType = Event;
 	newEvt.evtValA = Val1;
 	newEvt.evtValB = Val2;
-	newEvt.evtData.clear();
+	newEvt.evtDataLen = 0;
+	newEvt.evtData = NULL;
 	
 	return newEvt;
 }
@@ -291,9 +395,8 @@ midevt_iterator MidiTrack::GetEventFromTick(UINT32 tick)
 	newEvt.evtType = 0xF0;
 	newEvt.evtValA = 0x00;
 	newEvt.evtValB = 0x00;
-	newEvt.evtData.resize(DataLen);
-	if (DataLen)
-		memcpy(&newEvt.evtData[0x00], Data, DataLen);
+	newEvt.evtDataLen = DataLen;
+	newEvt.evtData = (const UINT8*)Data;
 	
 	return newEvt;
 }
@@ -307,9 +410,8 @@ midevt_iterator MidiTrack::GetEventFromTick(UINT32 tick)
 	newEvt.evtType = 0xFF;
 	newEvt.evtValA = Type;
 	newEvt.evtValB = 0x00;
-	newEvt.evtData.resize(DataLen);
-	if (DataLen)
-		memcpy(&newEvt.evtData[0x00], Data, DataLen);
+	newEvt.evtDataLen = DataLen;
+	newEvt.evtData = (const UINT8*)Data;
 	
 	return newEvt;
 }
@@ -319,7 +421,7 @@ void MidiTrack::AppendEvent(const MidiEvent& Event)
 	if (Event.tick < GetTickCount())
 		return;
 	
-	_events.push_back(Event);
+	_events.push_back(CopyEventData(Event));
 	
 	return;
 }
@@ -359,7 +461,7 @@ void MidiTrack::InsertEventT(const MidiEvent& Event)
 	midevt_iterator evtIt;
 	
 	evtIt = GetFirstEventAtTick(Event.tick);
-	_events.insert(evtIt, Event);
+	_events.insert(evtIt, CopyEventData(Event));
 	
 	return;
 }
@@ -403,7 +505,7 @@ void MidiTrack::InsertEventD(midevt_iterator prevEvt, const MidiEvent& Event)
 		if (Event.tick >= GetTickCount())
 			AppendEvent(Event);
 		else if (! Event.tick)
-			_events.insert(_events.begin(), Event);
+			_events.insert(_events.begin(), CopyEventData(Event));
 		return;
 	}
 	if (Event.tick < prevEvt->tick)
@@ -414,7 +516,7 @@ void MidiTrack::InsertEventD(midevt_iterator prevEvt, const MidiEvent& Event)
 	if (nextEvt != _events.end() && Event.tick > nextEvt->tick)
 		return;
 	
-	_events.insert(nextEvt, Event);
+	_events.insert(nextEvt, CopyEventData(Event));
 	
 	return;
 }
@@ -459,25 +561,35 @@ void MidiTrack::InsertMetaEventD(midevt_iterator prevEvt, UINT32 Delay, UINT8 Ty
 
 void MidiTrack::RemoveEvent(midevt_iterator evtIt)
 {
-	_events.erase(evtIt);
+	_events.erase(evtIt);	// Note: The event's data is kept until the track is cleared.
 	
 	return;
 }
 
-midevt_iterator MidiTrack::GetFirstEventAtTick(UINT32 tick)
+MidiEvent MidiTrack::CopyEventData(const MidiEvent& Event)
 {
-	if (tick > GetTickCount())
-		return _events.end();
+	MidiEvent newEvt = Event;
 	
-	midevt_iterator evtIt;
-	
-	for (evtIt = _events.begin(); evtIt != _events.end(); ++evtIt)
+	if (Event.evtDataLen)
+	{
+		UINT8* evtData = _dataStore.Alloc(Event.evtDataLen);
+		memcpy(evtData, Event.evtData, Event.evtDataLen);
+		newEvt.evtData = evtData;
+	}
+	else
 	{
-		if (evtIt->tick >= tick)
-			return evtIt;
+		newEvt.evtData = NULL;
 	}
 	
-	return _events.end();
+	return newEvt;
+}
+
+midevt_iterator MidiTrack::GetFirstEventAtTick(UINT32 tick)
+{
+	if (tick > GetTickCount())
+		return _events.end();
+	
+	return std::lower_bound(_events.begin(), _events.end(), tick, EventTickOrder);
 }
 
 
@@ -506,6 +618,7 @@ void MidiFile::ClearAll()
 	for (trkIt = _tracks.begin(); trkIt != _tracks.end(); ++trkIt)
 		delete *trkIt;
 	_tracks.clear();
+	std::vector<UINT8>().swap(_fileData);	// free the file image after all tracks referring to it are gone
 	
 	return;
 }
@@ -626,41 +739,65 @@ UINT8 MidiFile::LoadFile(const char* fileName)
 
 UINT8 MidiFile::LoadFile(FILE* infile)
 {
-	UINT32 TempLng;
-	UINT32 HdrPos;
-	UINT32 HdrEnd;
+	std::vector<UINT8> fileData;
+	UINT8 RetVal;
+	
+	RetVal = ReadFileData(infile, fileData);
+	if (RetVal)
+		return RetVal;
+	
+	return LoadFromImage(fileData);
+}
+
+UINT8 MidiFile::LoadFile(UINT32 FileLen, const UINT8* FileData)
+{
+	std::vector<UINT8> fileData(FileData, FileData + FileLen);
+	
+	return LoadFromImage(fileData);
+}
+
+UINT8 MidiFile::LoadFromImage(std::vector<UINT8>& fileData)
+{
+	UINT32 FileLen;
+	UINT32 CurPos;
+	UINT32 TrkLen;
 	UINT16 trkCnt;
 	UINT16 CurTrk;
 	UINT8 RetVal;
 	
-//	fseek(infile, 0, SEEK_END);
-//	file_size = ftell(infile);
-//	fseek(infile, 0, SEEK_SET);
-	
-	fread(&TempLng, 0x04, 1, infile);
-	if (TempLng != FCC_MTHD)
+	FileLen = (UINT32)fileData.size();
+	if (FileLen < 0x0E || ReadLE32(&fileData[0x00]) != FCC_MTHD)
 		return 0x10;
 	
 	ClearAll();
+	_fileData.swap(fileData);	// take ownership of the data - the tracks will refer to it
+	const UINT8* FileBase = &_fileData[0x00];
 	
-	TempLng = ReadBE32(infile);	// Read Header Length
-	HdrPos = (UINT32)ftell(infile);
-	HdrEnd = HdrPos + TempLng;
-	
-	_format = ReadBE16(infile);
-	trkCnt = ReadBE16(infile);
-	_resolution = ReadBE16(infile);
+	_format = ReadBE16(&FileBase[0x08]);
+	trkCnt = ReadBE16(&FileBase[0x0A]);
+	_resolution = ReadBE16(&FileBase[0x0C]);
 	
-	fseek(infile, HdrEnd, SEEK_SET);
+	CurPos = 0x08 + ReadBE32(&FileBase[0x04]);	// skip Header
 	
 	RetVal = 0x00;
 	_tracks.reserve(trkCnt);
 	for (CurTrk = 0; CurTrk < trkCnt; CurTrk ++)
 	{
-		MidiTrack* newTrk = new MidiTrack;
-		RetVal = newTrk->ReadFromFile(infile);
+		MidiTrack* newTrk;
+		
+		if (CurPos >= FileLen)
+		{
+			RetVal = 0x10;
+			break;
+		}
+		newTrk = new MidiTrack;
+		RetVal = newTrk->ReadFromMemory(FileLen - CurPos, &FileBase[CurPos], &TrkLen);
 		if (RetVal)
+		{
+			delete newTrk;
 			break;
+		}
+		CurPos += TrkLen;
 		
 		Track_Append(newTrk);
 	}
@@ -718,42 +855,256 @@ UINT8 MidiFile::SaveFile(FILE* outfile)
 	return RetVal;
 }
 
-static UINT16 ReadBE16(FILE* infile)
+
+// --- MidiTempoMap Class ---
+struct TempoChange
+{
+	UINT32 tick;
+	UINT16 trkID;
+	UINT32 tempo;
+};
+
+static bool TempoChangeOrder(const TempoChange& a, const TempoChange& b)
+{
+	// same order as playback: by tick, then by track
+	if (a.tick != b.tick)
+		return a.tick < b.tick;
+	return a.trkID < b.trkID;
+}
+
+static bool SegmentTickOrder(UINT32 tick, const MidiTempoSegment& seg)
+{
+	return tick < seg.tick;
+}
+
+static bool SegmentTimeOrder(UINT64 micros, const MidiTempoSegment& seg)
+{
+	return micros < seg.micros;
+}
+
+MidiTempoMap::MidiTempoMap(void)
+{
+	Clear();
+	
+	return;
+}
+
+MidiTempoMap::~MidiTempoMap()
+{
+	return;
+}
+
+void MidiTempoMap::Clear(void)
+{
+	MidiTempoSegment defSeg;
+	
+	_resolution = 96;
+	defSeg.tick = 0;
+	defSeg.tempo = 500000;	// 120 BPM
+	defSeg.micros = 0;
+	_segments.assign(1, defSeg);
+	
+	return;
+}
+
+void MidiTempoMap::Build(MidiFile* midFile)
+{
+	std::vector<TempoChange> tempoList;
+	std::vector<TempoChange>::const_iterator tcIt;
+	UINT16 curTrk;
+	
+	Clear();
+	_resolution = midFile->GetMidiResolution();
+	if (! _resolution)
+		_resolution = 1;
+	
+	for (curTrk = 0; curTrk < midFile->GetTrackCount(); curTrk ++)
+	{
+		const MidiEvtList& evtList = midFile->GetTrack(curTrk)->GetEvents();
+		midevt_const_it evtIt;
+		
+		for (evtIt = evtList.begin(); evtIt != evtList.end(); ++evtIt)
+		{
+			if (evtIt->evtType != 0xFF)
+				continue;
+			if (evtIt->evtValA == 0x2F)
+				break;	// Track End
+			if (evtIt->evtValA == 0x51 && evtIt->evtDataLen >= 0x03)
+			{
+				TempoChange tc;
+				tc.tick = evtIt->tick;
+				tc.trkID = curTrk;
+				tc.tempo =	(evtIt->evtData[0x00] << 16) |
+							(evtIt->evtData[0x01] <<  8) |
+							(evtIt->evtData[0x02] <<  0);
+				tempoList.push_back(tc);
+			}
+		}
+	}
+	std::stable_sort(tempoList.begin(), tempoList.end(), TempoChangeOrder);
+	
+	for (tcIt = tempoList.begin(); tcIt != tempoList.end(); ++tcIt)
+	{
+		MidiTempoSegment& lastSeg = _segments.back();
+		
+		if (tcIt->tick == lastSeg.tick)
+		{
+			lastSeg.tempo = tcIt->tempo;	// the last tempo event on a tick wins
+		}
+		else
+		{
+			MidiTempoSegment newSeg;
+			newSeg.tick = tcIt->tick;
+			newSeg.tempo = tcIt->tempo;
+			newSeg.micros = TickToMicros(tcIt->tick);
+			_segments.push_back(newSeg);
+		}
+	}
+	
+	return;
+}
+
+size_t MidiTempoMap::FindSegmentByTick(UINT32 tick) const
 {
-	UINT8 InData[0x02];
+	std::vector<MidiTempoSegment>::const_iterator segIt;
 	
-	fread(InData, 0x02, 1, infile);
-	return (InData[0x00] << 8) | (InData[0x01] << 0);
+	// find the last segment that starts at or before "tick"
+	segIt = std::upper_bound(_segments.begin(), _segments.end(), tick, SegmentTickOrder);
+	return (segIt - _segments.begin()) - 1;	// the first segment always starts at tick 0
 }
 
+size_t MidiTempoMap::FindSegmentByTime(UINT64 micros) const
+{
+	std::vector<MidiTempoSegment>::const_iterator segIt;
+	
+	segIt = std::upper_bound(_segments.begin(), _segments.end(), micros, SegmentTimeOrder);
+	return (segIt - _segments.begin()) - 1;
+}
+
+UINT64 MidiTempoMap::TickToMicros(UINT32 tick) const
+{
+	const MidiTempoSegment& seg = _segments[FindSegmentByTick(tick)];
+	
+	return seg.micros + ((UINT64)(tick - seg.tick) * seg.tempo + _resolution / 2) / _resolution;
+}
+
+UINT32 MidiTempoMap::MicrosToTick(UINT64 micros) const
+{
+	const MidiTempoSegment& seg = _segments[FindSegmentByTime(micros)];
+	UINT64 tick;
+	
+	if (! seg.tempo)
+		return seg.tick;
+	// return the last tick that starts at or before "micros" (the inverse of TickToMicros, including its rounding)
+	tick = seg.tick + ((micros - seg.micros + 1) * _resolution - _resolution / 2 - 1) / seg.tempo;
+	return (tick > 0xFFFFFFFF) ? 0xFFFFFFFF : (UINT32)tick;
+}
+
+UINT32 MidiTempoMap::GetTempo(UINT32 tick) const
+{
+	return _segments[FindSegmentByTick(tick)].tempo;
+}
+
+const std::vector<MidiTempoSegment>& MidiTempoMap::GetSegments(void) const
+{
+	return _segments;
+}
+
+
 static UINT32 ReadBE32(FILE* infile)
 {
 	UINT8 InData[0x04];
 	
 	fread(InData, 0x04, 1, infile);
-	return	(InData[0x00] << 24) | (InData[0x01] << 16) |
-			(InData[0x02] <<  8) | (InData[0x03] <<  0);
+	return ReadBE32(InData);
+}
+
+static inline UINT16 ReadBE16(const UINT8* data)
+{
+	return (data[0x00] << 8) | (data[0x01] << 0);
+}
+
+static inline UINT32 ReadBE32(const UINT8* data)
+{
+	return	(data[0x00] << 24) | (data[0x01] << 16) |
+			(data[0x02] <<  8) | (data[0x03] <<  0);
 }
 
-static UINT32 ReadMidiValue(FILE* infile)
+static inline UINT32 ReadLE32(const UINT8* data)
 {
+	return	(data[0x03] << 24) | (data[0x02] << 16) |
+			(data[0x01] <<  8) | (data[0x00] <<  0);
+}
+
+static inline UINT8 ReadByte(const UINT8** curPos, const UINT8* dataEnd)
+{
+	if (*curPos >= dataEnd)
+		return 0x00;
+	return *(*curPos)++;
+}
+
+static UINT32 ReadMidiValue(const UINT8** curPos, const UINT8* dataEnd)
+{
+	const UINT8* pos = *curPos;
 	UINT8 TempByt;
 	UINT32 ResVal;
-	size_t readBytes;
 	
 	ResVal = 0x00;
 	do
 	{
-		readBytes = fread(&TempByt, 0x01, 1, infile);
-		if (! readBytes)
+		if (pos >= dataEnd)
 			break;
+		TempByt = *pos++;
 		ResVal <<= 7;
 		ResVal |= (TempByt & 0x7F);
 	} while(TempByt & 0x80);
+	*curPos = pos;
 	
 	return ResVal;
 }
 
+static UINT8 ReadFileData(FILE* infile, std::vector<UINT8>& fileData)
+{
+	long startPos;
+	long endPos;
+	size_t readBytes;
+	
+	// read everything from the current position until the end of the file
+	startPos = ftell(infile);
+	endPos = -1;
+	if (startPos >= 0 && ! fseek(infile, 0, SEEK_END))
+	{
+		endPos = ftell(infile);
+		fseek(infile, startPos, SEEK_SET);
+	}
+	
+	if (endPos >= startPos && startPos >= 0)
+	{
+		fileData.resize(endPos - startPos);
+		readBytes = fileData.empty() ? 0 : fread(&fileData[0x00], 0x01, fileData.size(), infile);
+		fileData.resize(readBytes);
+	}
+	else
+	{
+		// unseekable stream - read it in blocks
+		fileData.clear();
+		do
+		{
+			size_t oldSize = fileData.size();
+			fileData.resize(oldSize + 0x10000);
+			readBytes = fread(&fileData[oldSize], 0x01, 0x10000, infile);
+			fileData.resize(oldSize + readBytes);
+		} while(readBytes > 0);
+	}
+	
+	return fileData.empty() ? 0xFF : 0x00;
+}
+
+static bool EventTickOrder(const MidiEvent& evt, UINT32 tick)
+{
+	return evt.tick < tick;
+}
+
 static void WriteBE16(FILE* outfile, UINT16 Value)
 {
 	UINT8 OutData[0x02];
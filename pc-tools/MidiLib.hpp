@@ -3,10 +3,10 @@
 
 #include "stdtype.h"
 
-#include <list>
 #include <vector>
 #include <stdio.h>	// for FILE
 
+// Note: MidiEvent is a plain data record. SysEx/Meta data is kept outside of it.
 struct MidiEvent
 {
 	UINT32 tick;
@@ -14,13 +14,36 @@ struct MidiEvent
 	UINT8 evtType;
 	UINT8 evtValA;	// Note Height, Controller Type, ...
 	UINT8 evtValB;
-	std::vector<UINT8> evtData;
+	UINT32 evtDataLen;
+	const UINT8* evtData;	// SysEx/Meta data, points into the file image or the track's data storage
 };
 
-typedef std::list<MidiEvent> MidiEvtList;
+// The events of a track are stored in a contiguous array.
+// Inserting events may reallocate it, which invalidates all iterators and pointers to events of the track.
+// Removing events invalidates the ones that point to or behind the removed position.
+typedef std::vector<MidiEvent> MidiEvtList;
 typedef MidiEvtList::iterator midevt_iterator;
 typedef MidiEvtList::const_iterator midevt_const_it;
 
+class MidiDataArena	// append-only storage for SysEx/Meta data, pointers stay valid until Clear() is called
+{
+public:
+	MidiDataArena(void);
+	~MidiDataArena();
+	
+	UINT8* Alloc(UINT32 DataLen);
+	void Clear(void);
+	
+private:
+	std::vector<UINT8*> _blocks;
+	UINT8* _curBlock;
+	UINT32 _curPos;
+	UINT32 _curSize;
+	
+	MidiDataArena(const MidiDataArena&);
+	MidiDataArena& operator=(const MidiDataArena&);
+};
+
 class MidiTrack
 {
 public:
@@ -40,6 +63,7 @@ public:
 	static void SetPitchBendValue(MidiEvent* evt, INT16 pbValue);
 	
 	// create MIDI events
+	// Note: SysEx/Meta events only refer to "Data". It is copied when inserting the event into a track.
 	static MidiEvent CreateEvent_Std(UINT8 Event, UINT8 Val1, UINT8 Val2);
 	static MidiEvent CreateEvent_SysEx(UINT32 DataLen, const void* Data);
 	static MidiEvent CreateEvent_Meta(UINT8 Type, UINT32 DataLen, const void* Data);
@@ -57,7 +81,7 @@ public:
 	void InsertEventT(UINT32 Tick, UINT8 Event, UINT8 Val1, UINT8 Val2);
 	void InsertSysExT(UINT32 Tick, UINT32 DataLen, const void* Data);
 	void InsertMetaEventT(UINT32 Tick, UINT8 Type, UINT32 DataLen, const void* Data);
-	// insert with previous event and delay
+	// insert with previous event and delay ("prevEvt" is invalid after the call)
 	void InsertEventD(midevt_iterator prevEvt, const MidiEvent& Event);
 	void InsertEventD(midevt_iterator prevEvt, UINT32 Delay, MidiEvent Event);
 	void InsertEventD(midevt_iterator prevEvt, UINT32 Delay, UINT8 Event, UINT8 Val1, UINT8 Val2);
@@ -67,11 +91,19 @@ public:
 	void RemoveEvent(midevt_iterator evtIt);
 	
 	UINT8 ReadFromFile(FILE* infile);
+	// Note: Events read from memory refer to "Data", so it must stay valid while the track is used.
+	UINT8 ReadFromMemory(UINT32 DataLen, const UINT8* Data, UINT32* ReadLen);
 	UINT8 WriteToFile(FILE* outfile) const;
 	
 private:
 	MidiEvtList _events;
+	MidiDataArena _dataStore;	// SysEx/Meta data of events that weren't read from memory
+	
+	MidiTrack(const MidiTrack&);	// no copying - events point into _dataStore
+	MidiTrack& operator=(const MidiTrack&);
 	
+	UINT8 ParseEvents(const UINT8* data, const UINT8* dataEnd);
+	MidiEvent CopyEventData(const MidiEvent& Event);
 	midevt_iterator GetFirstEventAtTick(UINT32 Tick);
 };
 
@@ -82,6 +114,9 @@ private:
 	//UINT16 _trackCount;
 	UINT16 _resolution;
 	std::vector<MidiTrack*> _tracks;
+	std::vector<UINT8> _fileData;	// file image, referenced by the SysEx/Meta events of loaded tracks
+	
+	UINT8 LoadFromImage(std::vector<UINT8>& fileData);
 	
 public:
 	MidiFile(void);
@@ -90,7 +125,7 @@ public:
 	
 	UINT8 LoadFile(const char* fileName);
 	UINT8 LoadFile(FILE* infile);
-	//UINT8 LoadFile(UINT32 FileLen, UINT8* FileData);
+	UINT8 LoadFile(UINT32 FileLen, const UINT8* FileData);
 	
 	UINT8 SaveFile(const char* fileName);
 	UINT8 SaveFile(FILE* outfile);
@@ -116,4 +151,35 @@ public:
 	UINT8 DeleteTrack(UINT16 trackID);
 };
 
+struct MidiTempoSegment
+{
+	UINT32 tick;	// first tick of the segment
+	UINT32 tempo;	// microseconds per quarter note
+	UINT64 micros;	// time of the first tick in microseconds
+};
+
+// Tempo changes of all tracks, for converting between ticks and time.
+// Conversions do a binary search over the tempo segments.
+class MidiTempoMap
+{
+public:
+	MidiTempoMap(void);
+	~MidiTempoMap();
+	
+	void Clear(void);
+	void Build(MidiFile* midFile);
+	
+	UINT64 TickToMicros(UINT32 tick) const;
+	UINT32 MicrosToTick(UINT64 micros) const;
+	UINT32 GetTempo(UINT32 tick) const;
+	const std::vector<MidiTempoSegment>& GetSegments(void) const;
+	
+private:
+	UINT16 _resolution;
+	std::vector<MidiTempoSegment> _segments;
+	
+	size_t FindSegmentByTick(UINT32 tick) const;
+	size_t FindSegmentByTime(UINT64 micros) const;
+};
+
 #endif	// __MIDILIB_HPP__
@@ -0,0 +1,276 @@
+// MIDI Channel State Tracking
+
+#include <vector>
+#include <string.h>
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+#include "MidiState.hpp"
+
+
+MidiPortState::MidiPortState(void)
+{
+	Reset();
+	
+	return;
+}
+
+void MidiPortState::Reset(void)
+{
+	UINT8 curChn;
+	
+	for (curChn = 0; curChn < 0x10; curChn ++)
+		SetDefaults(&_chn[curChn]);
+	
+	return;
+}
+
+/*static*/ void MidiPortState::SetDefaults(MidiChnState* chnSt)
+{
+	// controllers without a well-defined default value stay "unknown"
+	memset(chnSt->ctrl, MSTATE_NONE, sizeof(chnSt->ctrl));
+	chnSt->ctrl[0x00] = 0x00;	// Bank MSB
+	chnSt->ctrl[0x20] = 0x00;	// Bank LSB
+	chnSt->ctrl[0x07] = 100;	// Volume
+	chnSt->ctrl[0x0A] = 0x40;	// Pan
+	chnSt->ctrl[0x5B] = 40;		// Reverb Send Level (GM2/GS)
+	chnSt->ctrl[0x5D] = 0x00;	// Chorus Send Level (GM2/GS)
+	chnSt->prog = 0x00;
+	ResetControllers(chnSt);
+	
+	chnSt->rpnData[0][0] = 0x02;	// Pitch Bend Range: 2 semitones
+	chnSt->rpnData[0][1] = 0x00;
+	chnSt->rpnData[1][0] = 0x40;	// Fine Tuning: center
+	chnSt->rpnData[1][1] = 0x00;
+	chnSt->rpnData[2][0] = 0x40;	// Coarse Tuning: center
+	chnSt->rpnData[2][1] = 0x00;
+	memset(&chnSt->rpnData[3], MSTATE_NONE, sizeof(chnSt->rpnData) - sizeof(chnSt->rpnData[0]) * 3);
+	
+	return;
+}
+
+void MidiPortState::Invalidate(void)
+{
+	UINT8 curChn;
+	
+	for (curChn = 0; curChn < 0x10; curChn ++)
+		InvalidateChannel(curChn);
+	
+	return;
+}
+
+void MidiPortState::InvalidateChannel(UINT8 chn)
+{
+	MidiChnState* chnSt = &_chn[chn & 0x0F];
+	
+	memset(chnSt->ctrl, MSTATE_NONE, sizeof(chnSt->ctrl));
+	chnSt->prog = MSTATE_NONE;
+	chnSt->chnPres = MSTATE_NONE;
+	chnSt->pbLSB = MSTATE_NONE;
+	chnSt->pbMSB = MSTATE_NONE;
+	chnSt->rpnSel[0] = MSTATE_NONE;
+	chnSt->rpnSel[1] = MSTATE_NONE;
+	chnSt->nrpnSel = false;
+	memset(chnSt->rpnData, MSTATE_NONE, sizeof(chnSt->rpnData));
+	
+	return;
+}
+
+/*static*/ void MidiPortState::ResetControllers(MidiChnState* chnSt)
+{
+	// values affected by "Reset All Controllers" (see GM Recommended Practice RP-015)
+	chnSt->ctrl[0x01] = 0x00;	// Modulation
+	chnSt->ctrl[0x0B] = 0x7F;	// Expression
+	chnSt->ctrl[0x40] = 0x00;	// Sustain
+	chnSt->ctrl[0x41] = 0x00;	// Portamento
+	chnSt->ctrl[0x42] = 0x00;	// Sostenuto
+	chnSt->ctrl[0x43] = 0x00;	// Soft Pedal
+	chnSt->chnPres = 0x00;
+	chnSt->pbLSB = 0x00;
+	chnSt->pbMSB = 0x40;
+	chnSt->rpnSel[0] = 0x7F;	// RPN Null
+	chnSt->rpnSel[1] = 0x7F;
+	chnSt->nrpnSel = false;
+	
+	return;
+}
+
+/*static*/ void MidiPortState::ApplyController(MidiChnState* chnSt, UINT8 ctrl, UINT8 value)
+{
+	switch(ctrl)
+	{
+	case 0x06:	// Data Entry MSB
+	case 0x26:	// Data Entry LSB
+		if (! chnSt->nrpnSel && chnSt->rpnSel[0] == 0x00 && chnSt->rpnSel[1] < MSTATE_RPNS)
+			chnSt->rpnData[chnSt->rpnSel[1]][(ctrl == 0x06) ? 0 : 1] = value;
+		break;	// NRPN data isn't tracked
+	case 0x60:	// Data Increment
+	case 0x61:	// Data Decrement
+		break;	// not tracked
+	case 0x62:	// NRPN LSB
+	case 0x63:	// NRPN MSB
+		chnSt->rpnSel[(ctrl == 0x63) ? 0 : 1] = value;
+		chnSt->nrpnSel = true;
+		break;
+	case 0x64:	// RPN LSB
+	case 0x65:	// RPN MSB
+		chnSt->rpnSel[(ctrl == 0x65) ? 0 : 1] = value;
+		chnSt->nrpnSel = false;
+		break;
+	case 0x79:	// Reset All Controllers
+		ResetControllers(chnSt);
+		break;
+	default:
+		if (ctrl < 0x78)	// 78..7F are Channel Mode messages
+			chnSt->ctrl[ctrl] = value;
+		break;
+	}
+	
+	return;
+}
+
+void MidiPortState::ApplyEvent(const MidiEvent* midiEvt)
+{
+	MidiChnState* chnSt = &_chn[midiEvt->evtType & 0x0F];
+	
+	switch(midiEvt->evtType & 0xF0)
+	{
+	case 0xB0:
+		ApplyController(chnSt, midiEvt->evtValA, midiEvt->evtValB);
+		break;
+	case 0xC0:
+		chnSt->prog = midiEvt->evtValA;
+		break;
+	case 0xD0:
+		chnSt->chnPres = midiEvt->evtValA;
+		break;
+	case 0xE0:
+		chnSt->pbLSB = midiEvt->evtValA;
+		chnSt->pbMSB = midiEvt->evtValB;
+		break;
+	}
+	
+	return;
+}
+
+UINT8 MidiPortState::GetCtrl(UINT8 chn, UINT8 ctrl) const
+{
+	return _chn[chn & 0x0F].ctrl[ctrl & 0x7F];
+}
+
+// Values that are unknown in "tgtSt", but known in "oldSt", can't stay as they are, because the module may
+// have a value from a later position of the song. Those are set to their defaults, if there is one.
+/*static*/ void MidiPortState::FillDefaults(MidiChnState* tgtSt, const MidiChnState* oldSt, const MidiChnState* defSt)
+{
+	UINT8 curCtrl;
+	UINT8 curRPN;
+	
+	for (curCtrl = 0x00; curCtrl < 0x78; curCtrl ++)
+	{
+		if (tgtSt->ctrl[curCtrl] == MSTATE_NONE && oldSt->ctrl[curCtrl] != MSTATE_NONE)
+			tgtSt->ctrl[curCtrl] = defSt->ctrl[curCtrl];
+	}
+	if (tgtSt->prog == MSTATE_NONE && oldSt->prog != MSTATE_NONE)
+		tgtSt->prog = defSt->prog;
+	if (tgtSt->chnPres == MSTATE_NONE && oldSt->chnPres != MSTATE_NONE)
+		tgtSt->chnPres = defSt->chnPres;
+	if (tgtSt->pbMSB == MSTATE_NONE && oldSt->pbMSB != MSTATE_NONE)
+	{
+		tgtSt->pbLSB = defSt->pbLSB;
+		tgtSt->pbMSB = defSt->pbMSB;
+	}
+	if (tgtSt->rpnSel[0] == MSTATE_NONE && oldSt->rpnSel[0] != MSTATE_NONE)
+	{
+		tgtSt->rpnSel[0] = defSt->rpnSel[0];
+		tgtSt->rpnSel[1] = defSt->rpnSel[1];
+		tgtSt->nrpnSel = defSt->nrpnSel;
+	}
+	for (curRPN = 0; curRPN < MSTATE_RPNS; curRPN ++)
+	{
+		if (tgtSt->rpnData[curRPN][0] == MSTATE_NONE && oldSt->rpnData[curRPN][0] != MSTATE_NONE)
+		{
+			tgtSt->rpnData[curRPN][0] = defSt->rpnData[curRPN][0];
+			tgtSt->rpnData[curRPN][1] = defSt->rpnData[curRPN][1];
+		}
+	}
+	
+	return;
+}
+
+void MidiPortState::GetRestoreEvents(const MidiPortState& curState, std::vector<MidiEvent>& evtList, UINT16 chnMask) const
+{
+	MidiChnState defState;
+	MidiChnState tgtState;
+	UINT8 curChn;
+	UINT8 curCtrl;
+	
+	SetDefaults(&defState);
+	for (curChn = 0; curChn < 0x10; curChn ++)
+	{
+		const MidiChnState* newSt = &tgtState;
+		const MidiChnState* oldSt = &curState._chn[curChn];
+		UINT8 evtCtrl = 0xB0 | curChn;
+		bool progChange;
+		bool rpnChange;
+		UINT8 curRPN;
+		
+		if (! (chnMask & (1 << curChn)))
+			continue;
+		tgtState = _chn[curChn];
+		FillDefaults(&tgtState, oldSt, &defState);
+		
+		// A program change applies the bank, so both have to be sent when either one differs.
+		progChange = (newSt->prog != MSTATE_NONE) && (newSt->prog != oldSt->prog ||
+					newSt->ctrl[0x00] != oldSt->ctrl[0x00] || newSt->ctrl[0x20] != oldSt->ctrl[0x20]);
+		if (progChange)
+		{
+			if (newSt->ctrl[0x00] != MSTATE_NONE)
+				evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x00, newSt->ctrl[0x00]));
+			if (newSt->ctrl[0x20] != MSTATE_NONE)
+				evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x20, newSt->ctrl[0x20]));
+			evtList.push_back(MidiTrack::CreateEvent_Std(0xC0 | curChn, newSt->prog, 0x00));
+		}
+		
+		for (curCtrl = 0x00; curCtrl < 0x78; curCtrl ++)
+		{
+			if (newSt->ctrl[curCtrl] == MSTATE_NONE || newSt->ctrl[curCtrl] == oldSt->ctrl[curCtrl])
+				continue;
+			if (progChange && (curCtrl == 0x00 || curCtrl == 0x20))
+				continue;	// already sent
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, curCtrl, newSt->ctrl[curCtrl]));
+		}
+		
+		rpnChange = false;
+		for (curRPN = 0; curRPN < MSTATE_RPNS; curRPN ++)
+		{
+			const UINT8* newData = newSt->rpnData[curRPN];
+			const UINT8* oldData = oldSt->rpnData[curRPN];
+			
+			if (newData[0] == MSTATE_NONE || (newData[0] == oldData[0] && newData[1] == oldData[1]))
+				continue;
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x65, 0x00));
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x64, curRPN));
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x06, newData[0]));
+			if (newData[1] != MSTATE_NONE)
+				evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, 0x26, newData[1]));
+			rpnChange = true;
+		}
+		// restore the parameter selection, so that following Data Entry events work as expected
+		if (rpnChange || newSt->nrpnSel != oldSt->nrpnSel ||
+			newSt->rpnSel[0] != oldSt->rpnSel[0] || newSt->rpnSel[1] != oldSt->rpnSel[1])
+		{
+			UINT8 selCtrl = newSt->nrpnSel ? 0x63 : 0x65;
+			UINT8 selMSB = (newSt->rpnSel[0] != MSTATE_NONE) ? newSt->rpnSel[0] : 0x7F;
+			UINT8 selLSB = (newSt->rpnSel[1] != MSTATE_NONE) ? newSt->rpnSel[1] : 0x7F;
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, selCtrl, selMSB));
+			evtList.push_back(MidiTrack::CreateEvent_Std(evtCtrl, selCtrl - 1, selLSB));
+		}
+		
+		if (newSt->pbMSB != MSTATE_NONE && (newSt->pbLSB != oldSt->pbLSB || newSt->pbMSB != oldSt->pbMSB))
+			evtList.push_back(MidiTrack::CreateEvent_Std(0xE0 | curChn, newSt->pbLSB, newSt->pbMSB));
+		if (newSt->chnPres != MSTATE_NONE && newSt->chnPres != oldSt->chnPres)
+			evtList.push_back(MidiTrack::CreateEvent_Std(0xD0 | curChn, newSt->chnPres, 0x00));
+	}
+	
+	return;
+}
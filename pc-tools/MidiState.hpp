@@ -0,0 +1,50 @@
+#ifndef __MIDISTATE_HPP__
+#define __MIDISTATE_HPP__
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+
+#include <vector>
+
+#define MSTATE_NONE		0xFF	// value is unknown
+#define MSTATE_RPNS		0x06	// number of tracked RPNs (0 = pitch bend range, 1/2 = fine/coarse tuning, ...)
+
+struct MidiChnState
+{
+	UINT8 ctrl[0x80];	// controller values
+	UINT8 prog;			// program (instrument)
+	UINT8 chnPres;		// channel pressure
+	UINT8 pbLSB;		// pitch bend
+	UINT8 pbMSB;
+	UINT8 rpnSel[2];	// selected RPN/NRPN (MSB, LSB)
+	bool nrpnSel;		// rpnSel refers to an NRPN
+	UINT8 rpnData[MSTATE_RPNS][2];	// Data Entry MSB/LSB of each RPN
+};
+
+// Tracks the state of the 16 channels of a MIDI port, so that it can be restored after seeking.
+// Notes and SysEx messages are not tracked.
+class MidiPortState
+{
+public:
+	MidiPortState(void);
+	
+	void Reset(void);	// set everything to the power-on defaults
+	void Invalidate(void);	// set everything to "unknown"
+	void InvalidateChannel(UINT8 chn);
+	void ApplyEvent(const MidiEvent* midiEvt);
+	UINT8 GetCtrl(UINT8 chn, UINT8 ctrl) const;	// returns MSTATE_NONE when the value is unknown
+	// Generate the events that turn "curState" into this state, for the channels in "chnMask" (bit 0 = channel 1).
+	// Values that are unknown in this state, but known in "curState", are set to their power-on defaults.
+	// Controllers without a defined default (e.g. Cutoff) keep the value of "curState".
+	void GetRestoreEvents(const MidiPortState& curState, std::vector<MidiEvent>& evtList, UINT16 chnMask = 0xFFFF) const;
+	
+private:
+	MidiChnState _chn[0x10];
+	
+	static void SetDefaults(MidiChnState* chnSt);
+	static void ResetControllers(MidiChnState* chnSt);
+	static void FillDefaults(MidiChnState* tgtSt, const MidiChnState* oldSt, const MidiChnState* defSt);
+	static void ApplyController(MidiChnState* chnSt, UINT8 ctrl, UINT8 value);
+};
+
+#endif	// __MIDISTATE_HPP__
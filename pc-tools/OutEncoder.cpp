@@ -0,0 +1,112 @@
+// Serial MIDI Encoder
+
+#include <string.h>
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+#include "OutputQueue.hpp"
+#include "OutEncoder.hpp"
+
+
+OutEncoder::OutEncoder(void) :
+	_noteOffConv(false),
+	_maxUsedPort(0)
+{
+	Reset();
+	memset(&_stats, 0x00, sizeof(EncoderStats));
+	
+	return;
+}
+
+void OutEncoder::Reset(void)
+{
+	_curPort = (UINT8)-1;
+	_runStatus = 0x00;
+	
+	return;
+}
+
+void OutEncoder::SetNoteOffConversion(bool enable)
+{
+	_noteOffConv = enable;
+	
+	return;
+}
+
+void OutEncoder::SelectPort(UINT8 portID, OutChunk* chunk)
+{
+	if (portID == _curPort)
+		return;
+	
+	_curPort = portID;
+	if (portID > _maxUsedPort)
+		_maxUsedPort = portID;
+	chunk->hdr[chunk->hdrLen++] = 0xF5;
+	chunk->hdr[chunk->hdrLen++] = 1 + portID;
+	// F5 is a System Common message, which cancels running status.
+	_runStatus = 0x00;
+	
+	return;
+}
+
+void OutEncoder::EncodeShort(UINT8 portID, const MidiEvent* midiEvt, OutChunk* chunk)
+{
+	UINT8 evtType = midiEvt->evtType;
+	UINT8 evtLen = ((evtType & 0xE0) == 0xC0) ? 2 : 3;
+	UINT8 valB = midiEvt->evtValB;
+	
+	if (_noteOffConv && (evtType & 0xF0) == 0x80)
+	{
+		evtType = 0x90 | (evtType & 0x0F);
+		valB = 0x00;
+		_stats.noteOffConv ++;
+	}
+	
+	chunk->dataLen = 0;
+	chunk->data = NULL;
+	chunk->hdrLen = 0;
+	SelectPort(portID, chunk);
+	if (evtType == _runStatus)
+	{
+		_stats.rsSaved ++;
+	}
+	else
+	{
+		chunk->hdr[chunk->hdrLen++] = evtType;
+		_runStatus = evtType;
+	}
+	chunk->hdr[chunk->hdrLen++] = midiEvt->evtValA;
+	if (evtLen >= 3)
+		chunk->hdr[chunk->hdrLen++] = valB;
+	_stats.bytes += chunk->hdrLen;
+	
+	return;
+}
+
+void OutEncoder::EncodeLong(UINT8 portID, const MidiEvent* midiEvt, OutChunk* chunk)
+{
+	chunk->dataLen = midiEvt->evtDataLen;
+	chunk->data = midiEvt->evtData;
+	chunk->hdrLen = 0;
+	SelectPort(portID, chunk);
+	chunk->hdr[chunk->hdrLen++] = midiEvt->evtType;
+	_runStatus = 0x00;	// SysEx cancels running status
+	_stats.bytes += chunk->hdrLen + chunk->dataLen;
+	
+	return;
+}
+
+UINT8 OutEncoder::GetCurrentPort(void) const
+{
+	return _curPort;
+}
+
+UINT8 OutEncoder::GetMaxUsedPort(void) const
+{
+	return _maxUsedPort;
+}
+
+const EncoderStats& OutEncoder::GetStats(void) const
+{
+	return _stats;
+}
@@ -0,0 +1,45 @@
+#ifndef __OUTENCODER_HPP__
+#define __OUTENCODER_HPP__
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+#include "OutputQueue.hpp"
+
+struct EncoderStats
+{
+	UINT32 bytes;		// number of bytes sent
+	UINT32 rsSaved;		// status bytes saved by using running status
+	UINT32 noteOffConv;	// Note Off messages sent as Note On with velocity 0
+};
+
+// Turns MIDI events into the bytes that are sent over the serial line.
+// It uses running status and sends "F5 xx" port selection commands only when the port changes.
+class OutEncoder
+{
+public:
+	OutEncoder(void);
+	
+	void Reset(void);	// forget the state of the receiver, i.e. send full messages again
+	// Send Note Off as Note On with velocity 0, so that running status can be used more often.
+	// (The release velocity is lost.)
+	void SetNoteOffConversion(bool enable);
+	
+	void EncodeShort(UINT8 portID, const MidiEvent* midiEvt, OutChunk* chunk);
+	// The chunk references the SysEx data of midiEvt, so it must stay valid until it was sent.
+	void EncodeLong(UINT8 portID, const MidiEvent* midiEvt, OutChunk* chunk);
+	
+	UINT8 GetCurrentPort(void) const;	// port that the receiver has currently selected
+	UINT8 GetMaxUsedPort(void) const;
+	const EncoderStats& GetStats(void) const;
+	
+private:
+	bool _noteOffConv;
+	UINT8 _curPort;
+	UINT8 _maxUsedPort;
+	UINT8 _runStatus;	// 0x00 = no running status
+	EncoderStats _stats;
+	
+	void SelectPort(UINT8 portID, OutChunk* chunk);
+};
+
+#endif	// __OUTENCODER_HPP__
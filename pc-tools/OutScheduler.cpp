@@ -0,0 +1,131 @@
+// Serial Bandwidth Scheduler
+
+#include <string.h>
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+#include "OutScheduler.hpp"
+
+
+OutScheduler::OutScheduler(void)
+{
+	Reset(1000000, 38400);
+	
+	return;
+}
+
+void OutScheduler::Reset(UINT64 tmrFreq, UINT32 baudRate)
+{
+	_tmrFreq = tmrFreq;
+	_baudRate = baudRate;
+	_wireFree = 0;
+	memset(&_stats, 0x00, sizeof(SchedStats));
+	
+	return;
+}
+
+UINT64 OutScheduler::ScheduleChunk(UINT64 deadline, UINT32 bytes)
+{
+	UINT64 startTime = (_wireFree > deadline) ? _wireFree : deadline;
+	
+	// 10 bits per byte (start bit + 8 data bits + stop bit)
+	_wireFree = startTime + bytes * 10 * _tmrFreq / _baudRate;
+	
+	_stats.msgCount ++;
+	if (startTime > deadline)
+	{
+		UINT64 lateness = startTime - deadline;
+		_stats.lateCount ++;
+		_stats.lateSum += (double)lateness;
+		if (lateness > _stats.lateMax)
+			_stats.lateMax = lateness;
+	}
+	
+	return startTime;
+}
+
+void OutScheduler::Flush(void)
+{
+	_wireFree = 0;
+	return;
+}
+
+void OutScheduler::CountReordered(UINT32 count)
+{
+	_stats.reordered += count;
+	return;
+}
+
+void OutScheduler::CountDropped(UINT32 count)
+{
+	_stats.ctrlDropped += count;
+	return;
+}
+
+void OutScheduler::CountPortSelections(UINT32 sorted, UINT32 orig)
+{
+	_stats.portSelSorted += sorted;
+	_stats.portSelOrig += orig;
+	return;
+}
+
+const SchedStats& OutScheduler::GetStats(void) const
+{
+	return _stats;
+}
+
+/*static*/ UINT8 OutScheduler::GetPriority(const MidiEvent* midiEvt)
+{
+	switch(midiEvt->evtType & 0xF0)
+	{
+	case 0x80:	// Note Off
+	case 0x90:	// Note On
+		return SCHED_PRIO_NOTE;
+	case 0xA0:	// Polyphonic Aftertouch
+	case 0xD0:	// Channel Aftertouch
+		return SCHED_PRIO_SWEEP;
+	case 0xB0:
+		switch(midiEvt->evtValA)
+		{
+		case 0x00:	// Bank MSB
+		case 0x20:	// Bank LSB
+		case 0x06:	// Data Entry MSB
+		case 0x26:	// Data Entry LSB
+		case 0x60:	// Data Increment
+		case 0x61:	// Data Decrement
+		case 0x62:	// NRPN LSB
+		case 0x63:	// NRPN MSB
+		case 0x64:	// RPN LSB
+		case 0x65:	// RPN MSB
+			return SCHED_PRIO_SETUP;
+		case 0x40:	// Sustain
+		case 0x41:	// Portamento
+		case 0x42:	// Sostenuto
+		case 0x43:	// Soft Pedal
+		case 0x44:	// Legato Footswitch
+		case 0x45:	// Hold 2
+		case 0x54:	// Portamento Control
+			// These affect the notes around them, so their order relative to the notes must stay.
+			return SCHED_PRIO_BARRIER;
+		default:
+			// 78..7F are Channel Mode messages (All Sound Off, Reset All Controllers, All Notes Off, ...).
+			// They act on the values and notes that were sent before them, so they must stay in place.
+			return (midiEvt->evtValA < 0x78) ? SCHED_PRIO_SWEEP : SCHED_PRIO_BARRIER;
+		}
+	case 0xC0:	// Program Change
+	case 0xE0:	// Pitch Bend
+		return SCHED_PRIO_SETUP;
+	case 0xF0:
+		if (midiEvt->evtType == 0xFF)
+			return SCHED_PRIO_SETUP;	// Meta Events aren't sent
+		return SCHED_PRIO_BARRIER;
+	}
+	return SCHED_PRIO_BARRIER;
+}
+
+/*static*/ bool OutScheduler::IsDroppableCtrl(const MidiEvent* midiEvt)
+{
+	if ((midiEvt->evtType & 0xF0) != 0xB0)
+		return false;
+	return GetPriority(midiEvt) == SCHED_PRIO_SWEEP;
+}
@@ -0,0 +1,52 @@
+#ifndef __OUTSCHEDULER_HPP__
+#define __OUTSCHEDULER_HPP__
+
+#include "stdtype.h"
+#include "MidiLib.hpp"
+
+// priority classes for messages with the same timestamp (lower values are sent first)
+#define SCHED_PRIO_SETUP	0x00	// program changes, RPNs, pitch bend, ... - must stay in front of the notes
+#define SCHED_PRIO_NOTE		0x01
+#define SCHED_PRIO_SWEEP	0x02	// controllers and aftertouch that can be delayed a bit
+#define SCHED_PRIO_BARRIER	0xFF	// SysEx, pedals, Channel Mode - no message is moved across it
+
+struct SchedStats
+{
+	UINT32 msgCount;
+	UINT32 lateCount;	// messages that reached the wire after their deadline
+	double lateSum;		// in timer ticks
+	UINT64 lateMax;
+	UINT32 reordered;	// messages that were moved behind other messages of the same tick
+	UINT32 ctrlDropped;	// redundant controllers that weren't sent
+	UINT32 portSelSorted;	// port selection commands needed for the messages in the order they are sent
+	UINT32 portSelOrig;		// ... and in the order of the MIDI file
+};
+
+// Models the time that messages need on the serial line, so that bursts are spread out
+// at the speed of the link instead of piling up in the UART.
+class OutScheduler
+{
+public:
+	OutScheduler(void);
+	
+	void Reset(UINT64 tmrFreq, UINT32 baudRate);
+	// Returns the time when "bytes" bytes that are due at "deadline" can start on the wire.
+	UINT64 ScheduleChunk(UINT64 deadline, UINT32 bytes);
+	void Flush(void);	// forget the scheduled data after it was dropped from the output queue
+	void CountReordered(UINT32 count);
+	void CountDropped(UINT32 count);
+	void CountPortSelections(UINT32 sorted, UINT32 orig);
+	const SchedStats& GetStats(void) const;
+	
+	static UINT8 GetPriority(const MidiEvent* midiEvt);
+	// true for controllers where repeating the current value has no effect
+	static bool IsDroppableCtrl(const MidiEvent* midiEvt);
+	
+private:
+	UINT64 _tmrFreq;
+	UINT32 _baudRate;
+	UINT64 _wireFree;	// time when all scheduled data will have been sent
+	SchedStats _stats;
+};
+
+#endif	// __OUTSCHEDULER_HPP__
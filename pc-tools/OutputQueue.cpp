@@ -0,0 +1,226 @@
+// Serial Output Queue
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string.h>
+
+#include "stdtype.h"
+#include "Platform.hpp"
+#include "OutputQueue.hpp"
+
+
+/*static*/ const UINT32 OutputQueue::HIST_LIMITS[OUTHIST_BUCKETS - 1] =
+	{10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+
+OutputQueue::OutputQueue(void) :
+	_readPos(0),
+	_writePos(0),
+	_flushPos(0),
+	_quit(false),
+	_prioResult(0x00),
+	_spinMicros(0)
+{
+	return;
+}
+
+OutputQueue::~OutputQueue(void)
+{
+	Stop();
+	
+	return;
+}
+
+void OutputQueue::SetSpinTime(UINT32 micros)
+{
+	_spinMicros = micros;
+	
+	return;
+}
+
+UINT8 OutputQueue::Start(void)
+{
+	if (_thread.joinable())
+		return 0x00;
+	
+	_tmrFreq = Timer_GetFrequency();
+	_spinTime = _spinMicros * _tmrFreq / 1000000;
+	memset(&_stats, 0x00, sizeof(OutputStats));
+	_lastWriteEnd = 0;
+	_quit = false;
+	_prioResult = 0xFF;
+	_thread = std::thread(&OutputQueue::WriterThread, this);
+	
+	// wait for the thread to report whether or not it got the high priority
+	while(_prioResult == 0xFF)
+		std::this_thread::yield();
+	return _prioResult;
+}
+
+void OutputQueue::Stop(void)
+{
+	if (! _thread.joinable())
+		return;
+	
+	{
+		std::lock_guard<std::mutex> lock(_waitMtx);
+		_quit = true;
+	}
+	_waitCond.notify_one();
+	_thread.join();
+	
+	return;
+}
+
+bool OutputQueue::Push(const OutChunk& chunk)
+{
+	UINT32 wPos = _writePos.load(std::memory_order_relaxed);
+	
+	if (wPos - _readPos.load(std::memory_order_acquire) >= RING_SIZE)
+		return false;
+	_ring[wPos & (RING_SIZE - 1)] = chunk;
+	{
+		// taking the mutex ensures that the writer thread can't miss the notification
+		std::lock_guard<std::mutex> lock(_waitMtx);
+		_writePos.store(wPos + 1, std::memory_order_release);
+	}
+	_waitCond.notify_one();
+	return true;
+}
+
+UINT32 OutputQueue::GetPushCount(void) const
+{
+	return _writePos.load(std::memory_order_relaxed);
+}
+
+UINT32 OutputQueue::Flush(void)
+{
+	// The writer checks the flush position right before writing a chunk, so the chunk at the
+	// current read position may still be sent.
+	UINT32 rPos = _readPos.load(std::memory_order_acquire);
+	
+	_flushPos.store(_writePos.load(std::memory_order_relaxed), std::memory_order_release);
+	return rPos;
+}
+
+bool OutputQueue::IsFlushed(UINT32 pos) const
+{
+	return (INT32)(pos - _flushPos.load(std::memory_order_acquire)) < 0;
+}
+
+UINT32 OutputQueue::GetFreeCount(void) const
+{
+	return RING_SIZE - (_writePos.load(std::memory_order_relaxed) - _readPos.load(std::memory_order_acquire));
+}
+
+bool OutputQueue::IsEmpty(void) const
+{
+	return _writePos.load(std::memory_order_relaxed) == _readPos.load(std::memory_order_acquire);
+}
+
+const OutputStats& OutputQueue::GetStats(void) const
+{
+	return _stats;
+}
+
+bool OutputQueue::WaitForDeadline(UINT64 deadline, UINT32 pos)
+{
+	UINT64 curTime = Timer_GetTime();
+	UINT64 sleepEnd = (deadline > _spinTime) ? (deadline - _spinTime) : 0;
+	UINT64 sliceLen = _tmrFreq * FLUSH_CHECK_MS / 1000;
+	
+	// Sleep in slices, so that a chunk that was flushed doesn't hold up the ones after it.
+	while(curTime < sleepEnd)
+	{
+		if (IsFlushed(pos))
+			return false;
+		Timer_SleepUntil((sleepEnd - curTime > sliceLen) ? (curTime + sliceLen) : sleepEnd);
+		curTime = Timer_GetTime();
+	}
+	while(curTime < deadline)	// spin for the remaining time
+		curTime = Timer_GetTime();
+	
+	return ! IsFlushed(pos);
+}
+
+void OutputQueue::AddTimingStats(UINT64 deadline, UINT64 sendTime, bool serialDelay)
+{
+	INT64 timeErr = (INT64)(sendTime - deadline);
+	UINT64 errMicros;
+	UINT8 curBkt;
+	
+	if (serialDelay)
+	{
+		_stats.lateChunks ++;
+		if (timeErr > _stats.lateMax)
+			_stats.lateMax = timeErr;
+		return;
+	}
+	
+	if (_stats.chunks == 0 || timeErr < _stats.errMin)
+		_stats.errMin = timeErr;
+	if (_stats.chunks == 0 || timeErr > _stats.errMax)
+		_stats.errMax = timeErr;
+	_stats.errSum += (double)timeErr;
+	_stats.errSqSum += (double)timeErr * timeErr;
+	_stats.chunks ++;
+	
+	errMicros = (timeErr > 0) ? ((UINT64)timeErr * 1000000 / _tmrFreq) : 0;
+	for (curBkt = 0; curBkt < OUTHIST_BUCKETS - 1; curBkt ++)
+	{
+		if (errMicros < HIST_LIMITS[curBkt])
+			break;
+	}
+	_stats.histogram[curBkt] ++;
+	
+	return;
+}
+
+void OutputQueue::WriterThread(void)
+{
+	UINT32 rPos;
+	
+	_prioResult = Thread_SetHighPriority() ? 0x01 : 0x00;
+	
+	rPos = _readPos.load(std::memory_order_relaxed);
+	while(true)
+	{
+		if (rPos == _writePos.load(std::memory_order_acquire))
+		{
+			std::unique_lock<std::mutex> lock(_waitMtx);
+			
+			if (rPos != _writePos.load(std::memory_order_acquire))
+				continue;
+			if (_quit)
+				break;	// all data was sent
+			_waitCond.wait(lock);
+			continue;
+		}
+		
+		const OutChunk* chunk = &_ring[rPos & (RING_SIZE - 1)];
+		UINT64 sendTime;
+		bool serialDelay;
+		
+		// When the previous write only returned after the deadline, the chunk was held up by
+		// earlier serial data. That isn't a scheduling error, so it is counted separately.
+		serialDelay = (_lastWriteEnd > chunk->time);
+		if (! WaitForDeadline(chunk->time, rPos))
+		{
+			rPos ++;	// dropped by Flush()
+			_readPos.store(rPos, std::memory_order_release);
+			continue;
+		}
+		sendTime = Timer_GetTime();
+		ComPort_Write(chunk->hdr, chunk->hdrLen);
+		if (chunk->dataLen > 0)
+			ComPort_Write(chunk->data, chunk->dataLen);
+		_lastWriteEnd = Timer_GetTime();
+		AddTimingStats(chunk->time, sendTime, serialDelay);
+		
+		rPos ++;
+		_readPos.store(rPos, std::memory_order_release);	// the slot may be reused from now on
+	}
+	
+	return;
+}
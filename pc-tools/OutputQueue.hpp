@@ -0,0 +1,91 @@
+#ifndef __OUTPUTQUEUE_HPP__
+#define __OUTPUTQUEUE_HPP__
+
+#include "stdtype.h"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct OutChunk	// pre-encoded serial data with the time it has to be sent at
+{
+	UINT64 time;		// deadline (Timer_GetTime() value)
+	UINT32 dataLen;
+	const UINT8* data;	// sent after hdr, must stay valid until the chunk was sent (used for SysEx data)
+	UINT8 hdrLen;
+	UINT8 hdr[7];		// short messages are stored completely in here
+};
+
+#define OUTHIST_BUCKETS	11
+
+struct OutputStats	// timing error of the writer thread, in timer ticks
+{
+	// chunks that weren't held up by serial data (i.e. the scheduling error)
+	UINT32 chunks;
+	INT64 errMin;
+	INT64 errMax;
+	double errSum;
+	double errSqSum;
+	UINT32 histogram[OUTHIST_BUCKETS];	// number of chunks per error range, see OutputQueue::HIST_LIMITS
+	// chunks whose deadline had already passed, because the previous write only finished after it
+	UINT32 lateChunks;
+	INT64 lateMax;
+};
+
+// Lock-free single-producer/single-consumer queue of OutChunks.
+// A writer thread sends each chunk to the serial port when its deadline is reached.
+// The mutex is only used to let the writer thread sleep while the queue is empty.
+class OutputQueue
+{
+public:
+	OutputQueue(void);
+	~OutputQueue(void);
+	
+	// Busy-wait for the last "micros" microseconds before a deadline instead of sleeping.
+	// This trades CPU time for precision on systems with coarse sleep timers.
+	void SetSpinTime(UINT32 micros);
+	UINT8 Start(void);	// start the writer thread, returns 0x01 if it runs without high priority
+	void Stop(void);	// send all remaining chunks and end the writer thread
+	
+	// producer functions
+	bool Push(const OutChunk& chunk);	// returns false when the queue is full
+	UINT32 GetPushCount(void) const;	// number of chunks pushed so far (wraps around)
+	// Drop all chunks that weren't sent yet. (e.g. when seeking)
+	// Returns the push count of the first chunk that may have been dropped.
+	UINT32 Flush(void);
+	UINT32 GetFreeCount(void) const;
+	bool IsEmpty(void) const;
+	
+	const OutputStats& GetStats(void) const;	// only valid after Stop()
+	
+	static const UINT32 HIST_LIMITS[OUTHIST_BUCKETS - 1];	// upper limits of the histogram buckets in microseconds
+	
+private:
+	enum { RING_SIZE = 0x400 };	// must be a power of 2
+	enum { FLUSH_CHECK_MS = 1 };	// interval for checking for Flush() while waiting for a deadline
+	
+	OutChunk _ring[RING_SIZE];
+	std::atomic<UINT32> _readPos;	// modified by the writer thread only
+	std::atomic<UINT32> _writePos;	// modified by the producer only
+	std::atomic<UINT32> _flushPos;	// chunks before this position are dropped, modified by the producer only
+	std::atomic<bool> _quit;
+	std::atomic<UINT8> _prioResult;
+	std::thread _thread;
+	std::mutex _waitMtx;
+	std::condition_variable _waitCond;	// signalled when data was pushed or the thread has to quit
+	UINT64 _tmrFreq;
+	UINT32 _spinMicros;
+	UINT64 _spinTime;	// _spinMicros in timer ticks
+	OutputStats _stats;
+	UINT64 _lastWriteEnd;	// time when the previous ComPort_Write() call returned
+	
+	OutputQueue(const OutputQueue&);	// non-copyable
+	OutputQueue& operator=(const OutputQueue&);
+	void WriterThread(void);
+	bool IsFlushed(UINT32 pos) const;
+	bool WaitForDeadline(UINT64 deadline, UINT32 pos);	// returns false when the chunk at "pos" was flushed meanwhile
+	void AddTimingStats(UINT64 deadline, UINT64 sendTime, bool serialDelay);
+};
+
+#endif	// __OUTPUTQUEUE_HPP__
@@ -0,0 +1,38 @@
+#ifndef __PLATFORM_HPP__
+#define __PLATFORM_HPP__
+
+#include "stdtype.h"
+
+#define COM_BAUDRATE	38400	// the speed of Serial MIDI
+
+// COM port flow control profiles
+#define COMFLOW_NONE	0x00	// Yamaha - no CTS flow control used
+#define COMFLOW_CTSRTS	0x01	// Roland - requires CTS/RTS flow control
+
+// Opens the serial port with 38400 baud, 8N1.
+// "port" is the name of the serial port. ("COM1" on Windows, "/dev/ttyS0" on Linux)
+// On POSIX systems, the special name "pty" creates a pseudo-terminal instead.
+// Writes to it are paced to the speed of a 38400 baud link.
+UINT8 ComPort_Open(const char* port, UINT8 flowCtrl);
+void ComPort_Close(void);
+const char* ComPort_GetName(void);	// returns the name of the port that was opened (e.g. the path of the pseudo-terminal)
+UINT32 ComPort_Write(const void* data, UINT32 len);
+// Reads up to "len" bytes that were already received. Doesn't wait for data and returns the number of bytes read.
+UINT32 ComPort_Read(void* data, UINT32 len);
+void ComPort_PurgeRX(void);
+
+UINT64 Timer_GetFrequency(void);	// number of timer ticks for 1 second
+UINT64 Timer_GetTime(void);
+void Timer_Sleep(UINT32 msec);
+void Timer_SleepUntil(UINT64 time);	// sleep until Timer_GetTime() reaches "time", using the OS's high-resolution timers
+
+// Raises the priority of the calling thread for time-critical work.
+// Returns 0xFF when the OS doesn't allow it. (e.g. missing privileges for real-time scheduling)
+UINT8 Thread_SetHighPriority(void);
+
+void Console_Init(void);	// switch to unbuffered keyboard input
+void Console_Deinit(void);
+int Console_KeyHit(void);
+int Console_GetKey(void);
+
+#endif	// __PLATFORM_HPP__
@@ -0,0 +1,288 @@
+// POSIX platform functions
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+
+#include "stdtype.h"
+#include "Platform.hpp"
+
+
+#define PTY_FIFO_SIZE	16	// size of the emulated UART FIFO for pseudo-terminals
+
+static UINT8 OpenPty(void);
+static void PacePtyWrite(UINT32 len);
+
+static int hComPort = -1;
+static std::string portName;
+static bool isPty = false;
+static UINT64 ptyWireEnd;	// time when the last byte written to the pseudo-terminal would have left the UART
+
+static bool conInit = false;
+static struct termios conOldAttr;
+
+UINT8 ComPort_Open(const char* port, UINT8 flowCtrl)
+{
+	struct termios tio;
+	int modemBits;
+	int retI;
+	
+	if (! strcmp(port, "pty"))
+		return OpenPty();
+	
+	portName = port;
+	if (portName.find('/') == std::string::npos)
+		portName = "/dev/" + portName;	// allow "ttyS0" as well as "/dev/ttyS0"
+	// open non-blocking, so that we don't wait for the carrier detect signal
+	hComPort = open(portName.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (hComPort < 0)
+		return 0xFF;
+	fcntl(hComPort, F_SETFL, fcntl(hComPort, F_GETFL) & ~O_NONBLOCK);
+	
+	retI = tcgetattr(hComPort, &tio);
+	if (retI)
+		printf("tcgetattr failed\n");
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, B38400);
+	cfsetospeed(&tio, B38400);
+	tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+	tio.c_cflag |= CS8 | CLOCAL | CREAD;	// 8 bits, no parity, 1 stop bit
+	tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+#ifdef CRTSCTS
+	if (flowCtrl == COMFLOW_CTSRTS)	// Roland - requires CTS/RTS flow control
+		tio.c_cflag |= CRTSCTS;
+	else	// Yamaha - no CTS flow control used
+		tio.c_cflag &= ~CRTSCTS;
+#endif
+	retI = tcsetattr(hComPort, TCSANOW, &tio);
+	if (retI)
+		printf("tcsetattr failed\n");
+	tcflush(hComPort, TCIOFLUSH);
+	
+	// RTS_CONTROL_DISABLE / RTS_CONTROL_ENABLE
+	modemBits = TIOCM_RTS;
+	retI = ioctl(hComPort, (flowCtrl == COMFLOW_NONE) ? TIOCMBIC : TIOCMBIS, &modemBits);
+	if (retI)
+		printf("Setting RTS failed\n");
+	
+	isPty = false;
+	return 0x00;
+}
+
+static UINT8 OpenPty(void)
+{
+	struct termios tio;
+	const char* ptsName;
+	
+	hComPort = posix_openpt(O_RDWR | O_NOCTTY);
+	if (hComPort < 0)
+		return 0xFF;
+	if (grantpt(hComPort) || unlockpt(hComPort))
+	{
+		close(hComPort);
+		hComPort = -1;
+		return 0xFF;
+	}
+	ptsName = ptsname(hComPort);
+	portName = (ptsName != NULL) ? ptsName : "pty";
+	
+	// pass all bytes through unmodified
+	if (! tcgetattr(hComPort, &tio))
+	{
+		cfmakeraw(&tio);
+		tcsetattr(hComPort, TCSANOW, &tio);
+	}
+	
+	isPty = true;
+	ptyWireEnd = 0;
+	return 0x00;
+}
+
+void ComPort_Close(void)
+{
+	if (hComPort < 0)
+		return;
+	
+	if (! isPty)
+		tcdrain(hComPort);
+	close(hComPort);
+	hComPort = -1;
+	
+	return;
+}
+
+const char* ComPort_GetName(void)
+{
+	return portName.c_str();
+}
+
+static void PacePtyWrite(UINT32 len)
+{
+	// A pseudo-terminal accepts data as fast as we write it.
+	// Emulate a UART with a small FIFO by blocking while the FIFO would be full.
+	UINT64 tmrFreq = Timer_GetFrequency();
+	UINT64 fifoTime = PTY_FIFO_SIZE * 10 * tmrFreq / COM_BAUDRATE;	// 10 bits per byte (start + 8 data + stop)
+	UINT64 curTime = Timer_GetTime();
+	
+	if (ptyWireEnd < curTime)
+		ptyWireEnd = curTime;
+	if (ptyWireEnd > curTime + fifoTime)
+		Timer_SleepUntil(ptyWireEnd - fifoTime);
+	ptyWireEnd += len * 10 * tmrFreq / COM_BAUDRATE;
+	
+	return;
+}
+
+UINT32 ComPort_Write(const void* data, UINT32 len)
+{
+	const UINT8* dataPtr = (const UINT8*)data;
+	UINT32 written;
+	
+	if (isPty)
+		PacePtyWrite(len);
+	
+	written = 0;
+	while(written < len)
+	{
+		ssize_t wrtBytes = write(hComPort, &dataPtr[written], len - written);
+		if (wrtBytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += (UINT32)wrtBytes;
+	}
+	
+	return written;
+}
+
+UINT32 ComPort_Read(void* data, UINT32 len)
+{
+	int avail;
+	ssize_t rdBytes;
+	
+	if (ioctl(hComPort, FIONREAD, &avail) || avail <= 0)
+		return 0;
+	if ((UINT32)avail < len)
+		len = (UINT32)avail;
+	rdBytes = read(hComPort, data, len);
+	return (rdBytes > 0) ? (UINT32)rdBytes : 0;
+}
+
+void ComPort_PurgeRX(void)
+{
+	if (! isPty)
+		tcflush(hComPort, TCIFLUSH);
+	return;
+}
+
+UINT64 Timer_GetFrequency(void)
+{
+	return 1000000000;	// nanoseconds
+}
+
+UINT64 Timer_GetTime(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Timer_Sleep(UINT32 msec)
+{
+	struct timespec ts;
+	
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+	return;
+}
+
+void Timer_SleepUntil(UINT64 time)
+{
+	struct timespec ts;
+	
+	// Timer_GetTime() uses CLOCK_MONOTONIC with nanosecond resolution, so the value can be used directly.
+	ts.tv_sec = (time_t)(time / 1000000000);
+	ts.tv_nsec = (long)(time % 1000000000);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	return;
+}
+
+UINT8 Thread_SetHighPriority(void)
+{
+	struct sched_param schedPrm;
+	int retI;
+	
+	// SCHED_FIFO usually requires root or CAP_SYS_NICE.
+	memset(&schedPrm, 0x00, sizeof(struct sched_param));
+	schedPrm.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	retI = pthread_setschedparam(pthread_self(), SCHED_FIFO, &schedPrm);
+	return retI ? 0xFF : 0x00;
+}
+
+void Console_Init(void)
+{
+	struct termios tio;
+	
+	if (! isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &conOldAttr))
+		return;
+	
+	// disable line buffering and echo, so that single key presses can be read
+	tio = conOldAttr;
+	tio.c_lflag &= ~(ICANON | ECHO);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+	conInit = true;
+	
+	return;
+}
+
+void Console_Deinit(void)
+{
+	if (! conInit)
+		return;
+	
+	tcsetattr(STDIN_FILENO, TCSANOW, &conOldAttr);
+	conInit = false;
+	
+	return;
+}
+
+int Console_KeyHit(void)
+{
+	fd_set readFDs;
+	struct timeval tv;
+	
+	if (! conInit)
+		return 0;
+	
+	FD_ZERO(&readFDs);
+	FD_SET(STDIN_FILENO, &readFDs);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	return select(STDIN_FILENO + 1, &readFDs, NULL, NULL, &tv) > 0;
+}
+
+int Console_GetKey(void)
+{
+	unsigned char key;
+	
+	if (read(STDIN_FILENO, &key, 1) != 1)
+		return -1;
+	return key;
+}
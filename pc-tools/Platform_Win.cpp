@@ -0,0 +1,227 @@
+// Windows platform functions
+
+#include <stdio.h>
+#include <string>
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT	0x0600	// for CreateWaitableTimerEx
+#endif
+#include <windows.h>
+#include <conio.h>
+
+#include "stdtype.h"
+#include "Platform.hpp"
+
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002	// Windows 10 1803 and later
+#endif
+
+static HANDLE hComPort;
+static std::string portName;
+static UINT64 tmrFreq = 0;
+static HANDLE hSleepTimer = NULL;
+
+UINT8 ComPort_Open(const char* port, UINT8 flowCtrl)
+{
+	BOOL retB;
+	
+	portName = port;
+	std::string fullPath = std::string("\\\\.\\") + port;
+	hComPort = CreateFileA(fullPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0x00, NULL, OPEN_EXISTING, /*FILE_FLAG_OVERLAPPED*/0, NULL);
+	if (hComPort == INVALID_HANDLE_VALUE)
+		return 0xFF;
+	
+	retB = SetupComm(hComPort, 1024, 1024);
+	if (! retB)
+		printf("SetupComm failed\n");
+	retB = PurgeComm(hComPort, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
+	if (! retB)
+		printf("PurgeComm failed\n");
+	
+	COMMTIMEOUTS cto;
+	cto.ReadIntervalTimeout = -1;
+	cto.ReadTotalTimeoutMultiplier = -1;
+	cto.ReadTotalTimeoutConstant = 6;
+	cto.WriteTotalTimeoutMultiplier = 0;
+	cto.WriteTotalTimeoutConstant = 0;
+	retB = SetCommTimeouts(hComPort, &cto);
+	if (! retB)
+		printf("SetCommTimeouts failed\n");
+	
+	DCB dcb;
+	GetCommState(hComPort, &dcb);
+	memset(&dcb, 0x00, sizeof(DCB));
+	dcb.DCBlength = sizeof(DCB);
+	dcb.BaudRate = 38400;
+	dcb.fBinary = 1;
+	if (flowCtrl == COMFLOW_NONE)	// Yamaha - no CTS flow control used
+	{
+		dcb.fOutxCtsFlow = 0;
+		dcb.fRtsControl = RTS_CONTROL_DISABLE;
+	}
+	else if (flowCtrl == COMFLOW_CTSRTS)	// Roland - requires CTS/RTS flow control
+	{
+		dcb.fOutxCtsFlow = 1;
+		dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	}
+	dcb.ByteSize = 8;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.XoffLim = 512;
+	retB = SetCommState(hComPort, &dcb);
+	if (! retB)
+		printf("SetCommState failed\n");
+	
+	//COMMPROP comProp;
+	//retB = GetCommProperties(hComPort, &comProp);
+	//if (! retB)
+	//	printf("GetCommProperties failed\n");
+	
+	//DWORD comErrs;
+	//COMSTAT comStat;
+	//retB = ClearCommError(hComPort, &comErrs, &comStat);
+	//if (! retB)
+	//	printf("ClearCommError failed\n");
+	//printf("Initial CTS: %u\n", ! comStat.fCtsHold);
+	
+	return 0x00;
+}
+
+void ComPort_Close(void)
+{
+	CloseHandle(hComPort);
+	hComPort = NULL;
+	
+	return;
+}
+
+const char* ComPort_GetName(void)
+{
+	return portName.c_str();
+}
+
+UINT32 ComPort_Write(const void* data, UINT32 len)
+{
+	DWORD comErrs;
+	COMSTAT comStat;
+	DWORD written;
+	BOOL retB;
+	
+	retB = ClearCommError(hComPort, &comErrs, &comStat);
+	if (! retB)
+		printf("ClearCommError failed\n");
+	
+	written = 0;
+	WriteFile(hComPort, data, len, &written, NULL);
+	return written;
+}
+
+UINT32 ComPort_Read(void* data, UINT32 len)
+{
+	DWORD comErrs;
+	COMSTAT comStat;
+	DWORD readBytes;
+	
+	// only read what is already in the input buffer, so that ReadFile doesn't wait for the timeout
+	if (! ClearCommError(hComPort, &comErrs, &comStat) || comStat.cbInQue == 0)
+		return 0;
+	if (comStat.cbInQue < len)
+		len = comStat.cbInQue;
+	
+	readBytes = 0;
+	ReadFile(hComPort, data, len, &readBytes, NULL);
+	return readBytes;
+}
+
+void ComPort_PurgeRX(void)
+{
+#if 0
+	{
+		DWORD comErrs;
+		COMSTAT comStat;
+		BOOL retB = ClearCommError(hComPort, &comErrs, &comStat);
+		if (! retB)
+			printf("ClearCommError failed\n");
+		printf("ComStat: fCtsHold %u, fDsrHold %u, fRlsdHold %u, fXoffHold %u, fXoffSent %u, fEof %u, fTxim %u  \r",
+			comStat.fCtsHold, comStat.fDsrHold, comStat.fRlsdHold, comStat.fXoffHold, comStat.fXoffSent, comStat.fEof, comStat.fTxim);
+	}
+#endif
+	PurgeComm(hComPort, PURGE_RXCLEAR);
+	return;
+}
+
+UINT64 Timer_GetFrequency(void)
+{
+	LARGE_INTEGER TempLInt;
+	QueryPerformanceFrequency(&TempLInt);
+	return TempLInt.QuadPart;
+}
+
+UINT64 Timer_GetTime(void)
+{
+	LARGE_INTEGER lgInt;
+	QueryPerformanceCounter(&lgInt);
+	return (UINT64)lgInt.QuadPart;
+}
+
+void Timer_Sleep(UINT32 msec)
+{
+	Sleep(msec);
+	return;
+}
+
+void Timer_SleepUntil(UINT64 time)
+{
+	UINT64 curTime = Timer_GetTime();
+	LARGE_INTEGER dueTime;
+	
+	if (curTime >= time)
+		return;
+	if (! tmrFreq)
+		tmrFreq = Timer_GetFrequency();
+	if (hSleepTimer == NULL)
+	{
+		hSleepTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		if (hSleepTimer == NULL)	// not supported by older Windows versions
+			hSleepTimer = CreateWaitableTimerExW(NULL, NULL, 0x00, TIMER_ALL_ACCESS);
+		if (hSleepTimer == NULL)
+		{
+			Sleep((DWORD)((time - curTime) * 1000 / tmrFreq));
+			return;
+		}
+	}
+	
+	// negative values specify a relative time in 100 ns units
+	dueTime.QuadPart = -(LONGLONG)((time - curTime) * 10000000 / tmrFreq);
+	if (SetWaitableTimer(hSleepTimer, &dueTime, 0, NULL, NULL, FALSE))
+		WaitForSingleObject(hSleepTimer, INFINITE);
+	return;
+}
+
+UINT8 Thread_SetHighPriority(void)
+{
+	BOOL retB;
+	
+	retB = SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	return retB ? 0x00 : 0xFF;
+}
+
+void Console_Init(void)
+{
+	return;
+}
+
+void Console_Deinit(void)
+{
+	return;
+}
+
+int Console_KeyHit(void)
+{
+	return _kbhit();
+}
+
+int Console_GetKey(void)
+{
+	return _getch();
+}